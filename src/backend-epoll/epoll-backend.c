@@ -0,0 +1,281 @@
+
+#define _GNU_SOURCE
+
+#include <evcon-epoll.h>
+
+#include <evcon-allocator.h>
+#include <evcon-backend.h>
+
+#include <evcon-config-private.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+#define EVCON_EPOLL_MAX_EVENTS 64
+
+/* epoll loop */
+
+typedef struct evcon_epoll_data evcon_epoll_data;
+typedef struct evcon_epoll_async evcon_epoll_async;
+
+struct evcon_epoll_data {
+	evcon_epoll_set epoll; /* fd watchers are registered directly (evcon_epoll_entry as watcher data) */
+	int loop_break;
+	int no_pwait2; /* epoll_pwait2 not supported by the kernel */
+	evcon_allocator *allocator;
+
+	struct epoll_event events[EVCON_EPOLL_MAX_EVENTS];
+	evcon_fd_event batch[EVCON_EPOLL_MAX_EVENTS];
+
+	evcon_timer_queue timers;
+
+	evcon_wakeup_fd async_wakeup;
+	evcon_fd_watcher *async_watcher;
+	pthread_mutex_t async_mutex;
+	evcon_epoll_async *async_pending_head, *async_pending_tail;
+};
+
+struct evcon_epoll_async {
+	evcon_epoll_async *pending_next;
+	evcon_async_watcher *orig;
+	int active;
+};
+
+static void evcon_epoll_fatal(const char *msg) {
+	fprintf(stderr, "evcon epoll backend: %s: %s\n", msg, strerror(errno));
+	abort();
+}
+
+static void evcon_epoll_free_loop(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_epoll_data *data = (evcon_epoll_data*) loop_data;
+	evcon_allocator *allocator = data->allocator;
+	UNUSED(backend_data);
+
+	evcon_loop_ref(loop);
+	evcon_fd_free(data->async_watcher);
+
+	evcon_wakeup_fd_clear(&data->async_wakeup);
+	evcon_epoll_set_clear(&data->epoll);
+
+	pthread_mutex_destroy(&data->async_mutex);
+	evcon_timer_queue_clear(&data->timers);
+	evcon_free(allocator, data, sizeof(evcon_epoll_data));
+}
+
+/* fd watchers */
+
+static void evcon_epoll_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_epoll_data *data = (evcon_epoll_data*) loop_data;
+	UNUSED(allocator);
+
+	if (-1 == evcon_epoll_set_update(&data->epoll, (evcon_epoll_entry*) watcher_data, watcher, fd, events)) {
+		evcon_epoll_fatal((EEXIST == errno) ? "only one active watcher per fd supported" : "epoll_ctl failed");
+	}
+}
+
+/* timer watchers */
+
+static void evcon_epoll_timer_update(evcon_timer_watcher *watcher, evcon_interval timeout, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_epoll_data *data = (evcon_epoll_data*) loop_data;
+	UNUSED(allocator);
+	UNUSED(watcher_data);
+
+	evcon_timer_queue_update(&data->timers, watcher, timeout);
+}
+
+static int evcon_epoll_timeout_msec(evcon_interval timeout) {
+	if (timeout < 0) return -1;
+	if (EVCON_INTERVAL_AS_MSEC(timeout) >= INT_MAX) return INT_MAX;
+	return (int) EVCON_INTERVAL_AS_MSEC(timeout);
+}
+
+static int evcon_epoll_wait(evcon_epoll_data *data, int block) {
+	evcon_interval timeout = block ? evcon_timer_queue_next_timeout(&data->timers) : 0;
+
+#if defined(HAVE_EPOLL_PWAIT2) && defined(EVCON_INTERVAL_NSEC)
+	/* epoll_wait only takes milliseconds */
+	if (!data->no_pwait2) {
+		evcon_interval sec = EVCON_INTERVAL_FROM_SEC(1);
+		struct timespec ts;
+		int n;
+
+		ts.tv_sec = timeout / sec;
+		ts.tv_nsec = (long) EVCON_INTERVAL_AS_NSEC(timeout % sec);
+		n = epoll_pwait2(data->epoll.epoll_fd, data->events, EVCON_EPOLL_MAX_EVENTS, (timeout < 0) ? NULL : &ts, NULL);
+		if (-1 != n || ENOSYS != errno) return n;
+		data->no_pwait2 = 1; /* kernel < 5.11 */
+	}
+#endif
+
+	return epoll_wait(data->epoll.epoll_fd, data->events, EVCON_EPOLL_MAX_EVENTS, evcon_epoll_timeout_msec(timeout));
+}
+
+/* async watchers */
+
+static void evcon_epoll_async_update(evcon_async_watcher *watcher, evcon_async_func f, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_epoll_data *data = (evcon_epoll_data*) loop_data;
+	evcon_epoll_async *w = (evcon_epoll_async*) watcher_data;
+	UNUSED(allocator);
+
+	switch (f) {
+	case EVCON_ASYNC_TRIGGER:
+		pthread_mutex_lock(&data->async_mutex);
+		if (!w->active) {
+			w->active = 1;
+			w->pending_next = NULL;
+			if (NULL == data->async_pending_tail) {
+				data->async_pending_head = data->async_pending_tail = w;
+				if (-1 == evcon_wakeup_fd_signal(&data->async_wakeup)) evcon_epoll_fatal("async wake write failed");
+			} else {
+				data->async_pending_tail->pending_next = w;
+				data->async_pending_tail = w;
+			}
+		}
+		pthread_mutex_unlock(&data->async_mutex);
+		break;
+	case EVCON_ASYNC_NEW:
+		w->orig = watcher;
+		break;
+	case EVCON_ASYNC_FREE:
+
+		pthread_mutex_lock(&data->async_mutex);
+		if (w->active) {
+			evcon_epoll_async *prev = NULL, *cur = data->async_pending_head;
+			while (cur != w) {
+				prev = cur;
+				cur = cur->pending_next;
+			}
+			if (NULL != prev) {
+				prev->pending_next = w->pending_next;
+			} else {
+				data->async_pending_head = w->pending_next;
+			}
+			if (data->async_pending_tail == w) data->async_pending_tail = prev;
+			w->active = 0;
+		}
+		pthread_mutex_unlock(&data->async_mutex);
+		return;
+	}
+}
+
+static void evcon_epoll_async_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data) {
+	evcon_epoll_data *data = user_data;
+	evcon_epoll_async *w;
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(fd);
+	UNUSED(revents);
+
+	evcon_wakeup_fd_drain(&data->async_wakeup);
+
+	for (;;) {
+		pthread_mutex_lock(&data->async_mutex);
+		w = data->async_pending_head;
+		if (NULL != w) {
+			data->async_pending_head = w->pending_next;
+			if (NULL == data->async_pending_head) data->async_pending_tail = NULL;
+			w->pending_next = NULL;
+			w->active = 0;
+		}
+		pthread_mutex_unlock(&data->async_mutex);
+
+		if (NULL == w) break;
+
+		evcon_feed_async(w->orig);
+	}
+}
+
+/* main loop */
+
+static void evcon_epoll_loop_iteration(evcon_loop *loop, evcon_epoll_data *data, int block) {
+	unsigned int count = 0;
+	int i, n;
+
+	evcon_loop_flush_fd_updates(loop);
+	n = evcon_epoll_wait(data, block);
+	if (-1 == n) {
+		if (EINTR != errno) evcon_epoll_fatal("epoll_wait failed");
+		n = 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		count += evcon_epoll_set_event(&data->epoll, data->events[i].data.fd, data->events[i].events, &data->batch[count]);
+	}
+
+	/* batch end hooks run once, after fd and timer callbacks */
+	evcon_loop_batch_begin(loop);
+	if (count > 0) evcon_feed_fd_batch(loop, data->batch, count);
+	evcon_timer_queue_dispatch(&data->timers);
+	evcon_loop_batch_end(loop);
+}
+
+void evcon_loop_epoll_run(evcon_loop *loop, int flags) {
+	evcon_epoll_data *data = (evcon_epoll_data*) evcon_loop_get_backend_data(loop);
+
+	data->loop_break = 0;
+	do {
+		evcon_epoll_loop_iteration(loop, data, 0 == (flags & EVCON_EPOLL_RUN_NOWAIT));
+	} while (!data->loop_break && 0 == (flags & (EVCON_EPOLL_RUN_ONCE | EVCON_EPOLL_RUN_NOWAIT)));
+}
+
+void evcon_loop_epoll_break(evcon_loop *loop) {
+	evcon_epoll_data *data = (evcon_epoll_data*) evcon_loop_get_backend_data(loop);
+	data->loop_break = 1;
+}
+
+static char static_backend_buf[EVCON_BACKEND_RECOMMENDED_SIZE];
+static evcon_backend* static_backend = NULL;
+static pthread_once_t static_backend_once = PTHREAD_ONCE_INIT;
+
+static void evcon_epoll_backend_init(void) {
+	static_backend = evcon_backend_init(static_backend_buf, sizeof(static_backend_buf), NULL, NULL, evcon_epoll_free_loop, evcon_epoll_fd_update, evcon_epoll_timer_update, evcon_epoll_async_update);
+	/* fd and async state live in the evcon watchers; timers only need the evcon_timer_queue entry */
+	evcon_backend_set_watcher_data_sizes(static_backend, sizeof(evcon_epoll_entry), 0, sizeof(evcon_epoll_async));
+	evcon_backend_set_fd_batching(static_backend, NULL);
+}
+
+static evcon_backend* evcon_epoll_backend(void) {
+	pthread_once(&static_backend_once, evcon_epoll_backend_init);
+	return static_backend;
+}
+
+evcon_loop* evcon_loop_new_epoll(evcon_allocator *allocator) {
+	evcon_backend *backend;
+	evcon_epoll_data *loop_data;
+	evcon_loop *evc_loop;
+	evcon_wakeup_fd async_wakeup;
+	evcon_epoll_set epoll;
+
+	if (-1 == evcon_epoll_set_init(&epoll, allocator)) return NULL;
+	if (-1 == evcon_wakeup_fd_init(&async_wakeup)) {
+		int err = errno;
+		evcon_epoll_set_clear(&epoll);
+		errno = err;
+		return NULL;
+	}
+
+	backend = evcon_epoll_backend();
+	loop_data = evcon_alloc0(allocator, sizeof(evcon_epoll_data));
+	evc_loop = evcon_loop_new(backend, allocator);
+
+	loop_data->epoll = epoll;
+	loop_data->allocator = allocator;
+	evcon_timer_queue_init(&loop_data->timers, allocator);
+	loop_data->async_wakeup = async_wakeup;
+	pthread_mutex_init(&loop_data->async_mutex, NULL);
+	evcon_loop_set_backend_data(evc_loop, loop_data);
+
+	loop_data->async_watcher = evcon_fd_new(evc_loop, evcon_epoll_async_cb, async_wakeup.read_fd, EVCON_READ, loop_data);
+	evcon_fd_start(loop_data->async_watcher);
+	evcon_loop_unref(evc_loop);
+
+	return evc_loop;
+}
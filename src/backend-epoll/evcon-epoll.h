@@ -0,0 +1,24 @@
+#ifndef __EVCON_EVCON_EPOLL_H
+#define __EVCON_EVCON_EPOLL_H __EVCON_EVCON_EPOLL_H
+
+#include <evcon.h>
+
+/* native linux backend: epoll for fds, a timer heap and an eventfd for async wakeups.
+ * doesn't need any other event loop library.
+ */
+
+typedef enum {
+	EVCON_EPOLL_RUN_DEFAULT = 0, /* run until evcon_loop_epoll_break() is called */
+	EVCON_EPOLL_RUN_ONCE    = 1, /* wait for events once and handle them */
+	EVCON_EPOLL_RUN_NOWAIT  = 2  /* handle pending events, but don't wait for new ones */
+} evcon_epoll_run_flags;
+
+/* returns NULL (with errno set) if epoll or eventfd are not available.
+ * the loop is destroyed with the last evcon_loop_unref()
+ */
+evcon_loop* evcon_loop_new_epoll(evcon_allocator *allocator);
+
+void evcon_loop_epoll_run(evcon_loop *loop, int flags);
+void evcon_loop_epoll_break(evcon_loop *loop); /* not thread-safe; use an async watcher to break from other threads */
+
+#endif
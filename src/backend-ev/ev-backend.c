@@ -12,10 +12,60 @@
 
 /* ev loop wrapper */
 
+typedef struct evcon_ev_data evcon_ev_data;
+
+struct evcon_ev_data {
+	struct ev_loop *evl;
+
+	/* flushes fd watcher changes before ev polls; only started while there are some */
+	ev_prepare fd_flush;
+
+	/* bracket the callbacks of an iteration in a batch: ev queues the check watchers after polling, and the
+	 * evcon watchers run at the default priority in between. neither keeps the ev loop alive.
+	 */
+	ev_check batch_begin, batch_end;
+};
+
 static void evcon_ev_free_loop(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_ev_data *data = (evcon_ev_data*) loop_data;
+	UNUSED(backend_data);
+
+	ev_prepare_stop(data->evl, &data->fd_flush);
+	ev_ref(data->evl);
+	ev_check_stop(data->evl, &data->batch_begin);
+	ev_ref(data->evl);
+	ev_check_stop(data->evl, &data->batch_end);
+	evcon_free(evcon_loop_get_allocator(loop), data, sizeof(evcon_ev_data));
+}
+
+static void evcon_ev_fd_flush_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	UNUSED(revents);
+
+	ev_prepare_stop(loop, w);
+	evcon_loop_flush_fd_updates((evcon_loop*) w->data);
+}
+
+static void evcon_ev_batch_begin_cb(struct ev_loop *loop, ev_check *w, int revents) {
+	UNUSED(loop);
+	UNUSED(revents);
+
+	evcon_loop_batch_begin((evcon_loop*) w->data);
+}
+
+/* might free the loop (and stop this watcher) */
+static void evcon_ev_batch_end_cb(struct ev_loop *loop, ev_check *w, int revents) {
+	UNUSED(loop);
+	UNUSED(revents);
+
+	evcon_loop_batch_end((evcon_loop*) w->data);
+}
+
+static void evcon_ev_fd_dirty(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_ev_data *data = (evcon_ev_data*) loop_data;
 	UNUSED(loop);
 	UNUSED(backend_data);
-	UNUSED(loop_data);
+
+	ev_prepare_start(data->evl, &data->fd_flush);
 }
 
 static void evcon_ev_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
@@ -31,18 +81,21 @@ static void evcon_ev_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
 	evcon_feed_fd(watcher, events);
 }
 
+/* the ev_io, ev_timer and ev_async structs are allocated inline with the evcon watchers (see evcon_ev_backend);
+ * a NULL data pointer means the ev watcher wasn't initialized yet.
+ */
+
 static void evcon_ev_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
 	ev_io *w = (ev_io*) watcher_data;
-	struct ev_loop *evl = (struct ev_loop*) loop_data;
+	struct ev_loop *evl = ((evcon_ev_data*) loop_data)->evl;
 	int evs;
+	UNUSED(allocator);
 
 	if (-1 == fd) {
 		/* delete watcher */
-		if (NULL == w) return;
+		if (NULL == w->data) return;
 
 		ev_io_stop(evl, w);
-		evcon_free(allocator, w, sizeof(*w));
-		evcon_fd_set_backend_data(watcher, NULL);
 		return;
 	}
 
@@ -50,16 +103,14 @@ static void evcon_ev_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int event
 	if (0 != (events & EVCON_READ)) evs |= EV_READ;
 	if (0 != (events & EVCON_WRITE)) evs |= EV_WRITE;
 
-	if (NULL == w) {
-		w = evcon_alloc0(allocator, sizeof(ev_io));
-		evcon_fd_set_backend_data(watcher, w);
+	if (NULL == w->data) {
 		ev_io_init(w, evcon_ev_fd_cb, fd, evs);
 		w->data = watcher;
 		if (0 != evs) ev_io_start(evl, w);
 		return;
 	}
 
-	if (w->events == evs && fd == w->fd) return;
+	if (w->events == evs && fd == w->fd && !evcon_fd_is_rearm(watcher)) return;
 
 	ev_io_stop(evl, w);
 	ev_io_set(w, fd, evs);
@@ -76,35 +127,22 @@ static void evcon_ev_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
 
 static void evcon_ev_timer_update(evcon_timer_watcher *watcher, evcon_interval timeout, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
 	ev_timer *w = (ev_timer*) watcher_data;
-	struct ev_loop *evl = (struct ev_loop*) loop_data;
-
-	if (-2 == timeout) {
-		/* delete watcher */
-		if (NULL == w) return;
-
-		ev_timer_stop(evl, w);
-		evcon_free(allocator, w, sizeof(*w));
-		evcon_timer_set_backend_data(watcher, NULL);
-		return;
-	}
+	struct ev_loop *evl = ((evcon_ev_data*) loop_data)->evl;
+	UNUSED(allocator);
 
-	if (-1 == timeout && NULL == w) return;
+	if (NULL == w->data) {
+		if (timeout < 0) return;
 
-	if (-1 == timeout) {
-		ev_timer_stop(evl, w);
-		return;
-	}
-
-	if (NULL == w) {
-		w = evcon_alloc0(allocator, sizeof(ev_timer));
-		evcon_timer_set_backend_data(watcher, w);
 		ev_timer_init(w, evcon_ev_timer_cb, EVCON_INTERVAL_AS_DOUBLE_SEC(timeout), 0.);
 		w->data = watcher;
 		ev_timer_start(evl, w);
 		return;
 	}
 
+	/* -1: stop, -2: delete watcher */
 	ev_timer_stop(evl, w);
+	if (timeout < 0) return;
+
 	ev_timer_set(w, EVCON_INTERVAL_AS_DOUBLE_SEC(timeout), 0.);
 	ev_timer_start(evl, w);
 }
@@ -119,26 +157,21 @@ static void evcon_ev_async_cb(struct ev_loop *loop, ev_async *w, int revents) {
 
 static void evcon_ev_async_update(evcon_async_watcher *watcher, evcon_async_func f, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
 	ev_async *w = (ev_async*) watcher_data;
-	struct ev_loop *evl = (struct ev_loop*) loop_data;
+	struct ev_loop *evl = ((evcon_ev_data*) loop_data)->evl;
+	UNUSED(allocator);
 
 	switch (f) {
 	case EVCON_ASYNC_TRIGGER:
 		ev_async_send(evl, w);
 		break;
 	case EVCON_ASYNC_NEW:
-		w = evcon_alloc0(allocator, sizeof(ev_async));
-		evcon_async_set_backend_data(watcher, w);
 		ev_async_init(w, evcon_ev_async_cb);
 		w->data = watcher;
 		ev_async_start(evl, w);
 		break;
 	case EVCON_ASYNC_FREE:
-		if (NULL == w) return;
-
 		ev_async_stop(evl, w);
-		evcon_free(allocator, w, sizeof(*w));
-		evcon_async_set_backend_data(watcher, NULL);
-		return;
+		break;
 	}
 }
 
@@ -148,6 +181,8 @@ static evcon_backend* evcon_ev_backend(evcon_allocator* allocator) {
 
 	if (g_once_init_enter(&backend)) {
 		evcon_backend* bcknd = evcon_backend_init(static_backend_buf, sizeof(static_backend_buf), NULL, allocator, evcon_ev_free_loop, evcon_ev_fd_update, evcon_ev_timer_update, evcon_ev_async_update);
+		evcon_backend_set_watcher_data_sizes(bcknd, sizeof(ev_io), sizeof(ev_timer), sizeof(ev_async));
+		evcon_backend_set_fd_batching(bcknd, evcon_ev_fd_dirty);
 
 		g_once_init_leave(&backend, bcknd);
 	}
@@ -158,8 +193,24 @@ static evcon_backend* evcon_ev_backend(evcon_allocator* allocator) {
 evcon_loop* evcon_loop_from_ev(struct ev_loop *loop, evcon_allocator* allocator) {
 	evcon_backend *backend = evcon_ev_backend(allocator);
 	evcon_loop *evc_loop = evcon_loop_new(backend, allocator);
-
-	evcon_loop_set_backend_data(evc_loop, loop);
+	evcon_ev_data *data = evcon_alloc0(evcon_loop_get_allocator(evc_loop), sizeof(evcon_ev_data));
+
+	data->evl = loop;
+	ev_prepare_init(&data->fd_flush, evcon_ev_fd_flush_cb);
+	data->fd_flush.data = evc_loop; /* weak reference */
+
+	ev_check_init(&data->batch_begin, evcon_ev_batch_begin_cb);
+	ev_set_priority(&data->batch_begin, EV_MAXPRI);
+	data->batch_begin.data = evc_loop; /* weak reference */
+	ev_check_start(loop, &data->batch_begin);
+	ev_unref(loop);
+
+	ev_check_init(&data->batch_end, evcon_ev_batch_end_cb);
+	ev_set_priority(&data->batch_end, EV_MINPRI);
+	data->batch_end.data = evc_loop; /* weak reference */
+	ev_check_start(loop, &data->batch_end);
+	ev_unref(loop);
+	evcon_loop_set_backend_data(evc_loop, data);
 
 	return evc_loop;
 }
@@ -12,10 +12,87 @@
 
 /* event loop wrapper */
 
+/* timeouts used often enough are registered with event_base_init_common_timeout: libevent keeps
+ * events with a common timeout in a list instead of its heap, so adding one is O(1).
+ * libevent allows at most 256 common timeouts per base; only the first few popular durations get one.
+ */
+#define EVCON_EVENT_COMMON_TIMEOUTS (16)
+#define EVCON_EVENT_COMMON_TIMEOUT_MIN_USES (32)
+
+typedef struct evcon_event_data evcon_event_data;
+typedef struct evcon_event_common_timeout evcon_event_common_timeout;
+typedef struct evcon_event_timer evcon_event_timer;
+
+struct evcon_event_common_timeout {
+	evcon_interval timeout;
+	unsigned int uses; /* candidate until it is used often enough */
+	const struct timeval *common; /* NULL if not registered (yet) */
+};
+
+struct evcon_event_data {
+	struct event_base *base;
+
+	/* activated when fd watchers change or a batch begins; runs after the pending callbacks, before libevent
+	 * polls again
+	 */
+	struct event *fd_flush;
+	/* libevent has no iteration hooks: the first evcon callback of an iteration begins a batch, fd_flush ends it */
+	int in_batch;
+
+	evcon_event_common_timeout common_timeouts[EVCON_EVENT_COMMON_TIMEOUTS];
+};
+
+/* timer state, following the struct event in the inline watcher storage */
+struct evcon_event_timer {
+	evcon_interval timeout; /* timeout the event was added with */
+	int persist; /* assigned with EV_PERSIST (repeating timer) */
+	int triggered; /* persistent event triggered: libevent already re-added it */
+};
+
+static size_t evcon_event_timer_offset;
+
 static void evcon_event_free_loop(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_event_data *data = (evcon_event_data*) loop_data;
+	UNUSED(backend_data);
+
+	event_free(data->fd_flush);
+	evcon_free(evcon_loop_get_allocator(loop), data, sizeof(evcon_event_data));
+}
+
+static void evcon_event_fd_flush_cb(evutil_socket_t fd, short revents, void *user_data) {
+	evcon_loop *loop = (evcon_loop*) user_data;
+	evcon_event_data *data = (evcon_event_data*) evcon_loop_get_backend_data(loop);
+	UNUSED(fd);
+	UNUSED(revents);
+
+	if (!data->in_batch) {
+		evcon_loop_flush_fd_updates(loop);
+		return;
+	}
+
+	/* batch end hooks might change fd watchers, or drop the last loop reference */
+	data->in_batch = 0;
+	evcon_loop_ref(loop);
+	evcon_loop_batch_end(loop);
+	evcon_loop_flush_fd_updates(loop);
+	evcon_loop_unref(loop);
+}
+
+static void evcon_event_batch_begin(evcon_loop *loop) {
+	evcon_event_data *data = (evcon_event_data*) evcon_loop_get_backend_data(loop);
+
+	if (data->in_batch) return;
+	data->in_batch = 1;
+	evcon_loop_batch_begin(loop);
+	event_active(data->fd_flush, EV_TIMEOUT, 0);
+}
+
+static void evcon_event_fd_dirty(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_event_data *data = (evcon_event_data*) loop_data;
 	UNUSED(loop);
 	UNUSED(backend_data);
-	UNUSED(loop_data);
+
+	event_active(data->fd_flush, EV_TIMEOUT, 0);
 }
 
 static void evcon_event_fd_cb(evutil_socket_t fd, short revents, void *user_data) {
@@ -27,80 +104,131 @@ static void evcon_event_fd_cb(evutil_socket_t fd, short revents, void *user_data
 	if (0 != (revents & EV_READ)) events |= EVCON_READ;
 	if (0 != (revents & EV_WRITE)) events |= EVCON_WRITE;
 
+	evcon_event_batch_begin(evcon_fd_get_loop(watcher));
 	evcon_feed_fd(watcher, events);
 }
 
+/* struct event is allocated inline with the evcon watchers (see evcon_event_backend); its size is only known
+ * at runtime. event_initialized() tells whether it was assigned yet.
+ */
+
 static void evcon_event_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
 	struct event *w = (struct event*) watcher_data;
-	struct event_base *base = (struct event_base*) loop_data;
+	struct event_base *base = ((evcon_event_data*) loop_data)->base;
 	short evs;
 	UNUSED(allocator);
 
 	if (-1 == fd) {
 		/* delete watcher */
-		if (NULL == w) return;
+		if (!event_initialized(w)) return;
 
-		event_free(w);
-		evcon_fd_set_backend_data(watcher, NULL);
+		event_del(w);
 		return;
 	}
 
 	evs = EV_PERSIST;
 	if (0 != (events & EVCON_READ)) evs |= EV_READ;
 	if (0 != (events & EVCON_WRITE)) evs |= EV_WRITE;
+	if (EV_PERSIST != evs && 0 != (events & EVCON_ET)) evs |= EV_ET;
 
-	if (NULL == w) {
-		w = event_new(base, fd, evs, evcon_event_fd_cb, watcher);
-		evcon_fd_set_backend_data(watcher, w);
+	if (!event_initialized(w)) {
+		event_assign(w, base, fd, evs, evcon_event_fd_cb, watcher);
 		if (EV_PERSIST != evs) event_add(w, NULL);
 		return;
 	}
 
-	if (event_get_events(w) == evs && event_get_fd(w) == fd) return;
+	if (event_get_events(w) == evs && event_get_fd(w) == fd && !evcon_fd_is_rearm(watcher)) return;
 
 	event_del(w);
 	event_assign(w, base, fd, evs, evcon_event_fd_cb, watcher);
 	if (EV_PERSIST != evs) event_add(w, NULL);
 }
 
+static evcon_event_timer* evcon_event_timer_state(void *watcher_data) {
+	return (evcon_event_timer*) ((char*) watcher_data + evcon_event_timer_offset);
+}
+
 static void evcon_event_timer_cb(evutil_socket_t fd, short revents, void *user_data) {
 	evcon_timer_watcher *watcher = (evcon_timer_watcher*) user_data;
+	evcon_event_timer *t = evcon_event_timer_state(evcon_timer_get_backend_data(watcher));
 	UNUSED(fd);
 	UNUSED(revents);
 
+	/* consumed by the timer update following the callback */
+	if (t->persist) t->triggered = 1;
+	evcon_event_batch_begin(evcon_timer_get_loop(watcher));
 	evcon_feed_timer(watcher);
 }
 
+/* rounds up to whole microseconds */
+static void evcon_event_interval_to_timeval(evcon_interval timeout, struct timeval *tv) {
+	evcon_interval sec = EVCON_INTERVAL_FROM_SEC(1);
+
+	tv->tv_sec = timeout / sec;
+	tv->tv_usec = EVCON_INTERVAL_AS_USEC(timeout % sec);
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/* @tv is @timeout converted; returns the common timeout for it instead if there is one */
+static const struct timeval* evcon_event_timer_timeval(evcon_event_data *data, evcon_interval timeout, const struct timeval *tv) {
+	/* fibonacci hashing; timeouts are often multiples of powers of two (1ms in nsec builds) */
+	evcon_event_common_timeout *c = &data->common_timeouts[(((uint64_t) timeout * UINT64_C(0x9E3779B97F4A7C15)) >> 32) % EVCON_EVENT_COMMON_TIMEOUTS];
+
+	if (c->timeout != timeout) {
+		if (NULL != c->common) return tv;
+		c->timeout = timeout;
+		c->uses = 0;
+	}
+
+	if (NULL == c->common && ++c->uses == EVCON_EVENT_COMMON_TIMEOUT_MIN_USES) {
+		c->common = event_base_init_common_timeout(data->base, tv);
+	}
+
+	return (NULL != c->common) ? c->common : tv;
+}
+
 static void evcon_event_timer_update(evcon_timer_watcher *watcher, evcon_interval timeout, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_event_data *data = (evcon_event_data*) loop_data;
 	struct event *w = (struct event*) watcher_data;
-	struct event_base *base = (struct event_base*) loop_data;
+	evcon_event_timer *t = evcon_event_timer_state(watcher_data);
+	int persist, triggered;
 	struct timeval tv;
 	UNUSED(allocator);
 
 	if (-2 == timeout) {
 		/* delete watcher */
-		if (NULL == w) return;
+		if (!event_initialized(w)) return;
 
-		event_free(w);
-		evcon_timer_set_backend_data(watcher, NULL);
+		event_del(w);
 		return;
 	}
 
-	if (-1 == timeout && NULL == w) return;
+	triggered = t->triggered;
+	t->triggered = 0;
+
+	if (-1 == timeout && !event_initialized(w)) return;
 
 	if (-1 == timeout) {
 		event_del(w);
 		return;
 	}
 
-	if (NULL == w) {
-		w = event_new(base, -1, EV_TIMEOUT, evcon_event_timer_cb, watcher);
-		evcon_timer_set_backend_data(watcher, w);
+	/* repeating timers (restarted with the repeat value after each trigger) use EV_PERSIST */
+	persist = (timeout > 0 && timeout == evcon_timer_get_repeat(watcher));
+	if (triggered && persist && timeout == t->timeout) return;
+
+	if (!event_initialized(w) || persist != t->persist) {
+		if (event_initialized(w)) event_del(w);
+		event_assign(w, data->base, -1, persist ? EV_PERSIST : EV_TIMEOUT, evcon_event_timer_cb, watcher);
+		t->persist = persist;
 	}
+	t->timeout = timeout;
 
-	tv.tv_sec = EVCON_INTERVAL_AS_SEC(timeout);
-	//tv.tv_usec = EVCON_INTERVAL_AS_USEC(timeout) % 1000000;
-	event_add(w, &tv);
+	evcon_event_interval_to_timeval(timeout, &tv);
+	event_add(w, evcon_event_timer_timeval(data, timeout, &tv));
 }
 
 static void evcon_event_async_cb(evutil_socket_t fd, short revents, void *user_data) {
@@ -108,12 +236,13 @@ static void evcon_event_async_cb(evutil_socket_t fd, short revents, void *user_d
 	UNUSED(fd);
 	UNUSED(revents);
 
+	evcon_event_batch_begin(evcon_async_get_loop(watcher));
 	evcon_feed_async(watcher);
 }
 
 static void evcon_event_async_update(evcon_async_watcher *watcher, evcon_async_func f, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
 	struct event *w = (struct event*) watcher_data;
-	struct event_base *base = (struct event_base*) loop_data;
+	struct event_base *base = ((evcon_event_data*) loop_data)->base;
 	UNUSED(allocator);
 
 	switch (f) {
@@ -121,15 +250,11 @@ static void evcon_event_async_update(evcon_async_watcher *watcher, evcon_async_f
 		event_active(w, EV_SIGNAL, 0);
 		break;
 	case EVCON_ASYNC_NEW:
-		w = event_new(base, -1, EV_PERSIST, evcon_event_async_cb, watcher);
-		evcon_async_set_backend_data(watcher, w);
+		event_assign(w, base, -1, EV_PERSIST, evcon_event_async_cb, watcher);
 		event_add(w, NULL);
 		break;
 	case EVCON_ASYNC_FREE:
-		if (NULL == w) return;
-
-		event_free(w);
-		evcon_async_set_backend_data(watcher, NULL);
+		event_del(w);
 		return;
 	}
 }
@@ -140,6 +265,12 @@ static evcon_backend* evcon_event_backend(evcon_allocator* allocator) {
 
 	if (g_once_init_enter(&backend)) {
 		evcon_backend* bcknd = evcon_backend_init(static_backend_buf, sizeof(static_backend_buf), NULL, allocator, evcon_event_free_loop, evcon_event_fd_update, evcon_event_timer_update, evcon_event_async_update);
+		size_t event_size = event_get_struct_event_size();
+
+		/* evcon_event_timer follows the struct event */
+		evcon_event_timer_offset = (event_size + sizeof(evcon_interval) - 1) / sizeof(evcon_interval) * sizeof(evcon_interval);
+		evcon_backend_set_watcher_data_sizes(bcknd, event_size, evcon_event_timer_offset + sizeof(evcon_event_timer), event_size);
+		evcon_backend_set_fd_batching(bcknd, evcon_event_fd_dirty);
 
 		g_once_init_leave(&backend, bcknd);
 	}
@@ -150,8 +281,11 @@ static evcon_backend* evcon_event_backend(evcon_allocator* allocator) {
 evcon_loop* evcon_loop_from_event(struct event_base *base, evcon_allocator* allocator) {
 	evcon_backend *backend = evcon_event_backend(allocator);
 	evcon_loop *evc_loop = evcon_loop_new(backend, allocator);
+	evcon_event_data *data = evcon_alloc0(evcon_loop_get_allocator(evc_loop), sizeof(evcon_event_data));
 
-	evcon_loop_set_backend_data(evc_loop, base);
+	data->base = base;
+	data->fd_flush = event_new(base, -1, 0, evcon_event_fd_flush_cb, evc_loop); /* weak reference */
+	evcon_loop_set_backend_data(evc_loop, data);
 
 	return evc_loop;
 }
@@ -9,90 +9,78 @@
 #include <evcon-config-private.h>
 
 #include <errno.h>
-#include <fcntl.h>
-#include <unistd.h>
+#include <limits.h>
 
-#define UNUSED(x) ((void)(x))
-
-#ifndef EVCON_GLIB_COMPAT_API
-# if GLIB_MAJOR_VERSION == 2 && GLIB_MINOR_VERSION < 31
-#  define EVCON_GLIB_COMPAT_API 1
-# endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+/* fd watchers are registered in an internal epoll set; the context only polls its fd */
+# define EVCON_GLIB_EPOLL 1
 #endif
 
-#ifdef EVCON_GLIB_COMPAT_API
-
-typedef GMutex* evcon_glib_mutex;
-
-static void evcon_glib_mutex_init(evcon_glib_mutex *m) {
-	*m = (*g_thread_functions_for_glib_use.mutex_new)();
-}
-
-static void evcon_glib_mutex_clear(evcon_glib_mutex *m) {
-	GMutex *mx = *m;
-	if (g_thread_supported()) (*g_thread_functions_for_glib_use.mutex_free)(mx);
-	*m = NULL;
-}
-
-static void evcon_glib_mutex_lock(evcon_glib_mutex *m) {
-	GMutex *mx = *m;
-	if (g_thread_supported()) (*g_thread_functions_for_glib_use.mutex_lock)(mx);
-}
-
-static void evcon_glib_mutex_unlock(evcon_glib_mutex *m) {
-	GMutex *mx = *m;
-	if (g_thread_supported()) (*g_thread_functions_for_glib_use.mutex_unlock)(mx);
-}
-
-#else
-
-typedef GMutex evcon_glib_mutex;
-
-static void evcon_glib_mutex_init(evcon_glib_mutex *m) {
-	g_mutex_init(m);
-}
-
-static void evcon_glib_mutex_clear(evcon_glib_mutex *m) {
-	g_mutex_clear(m);
-}
-
-static void evcon_glib_mutex_lock(evcon_glib_mutex *m) {
-	g_mutex_lock(m);
-}
-
-static void evcon_glib_mutex_unlock(evcon_glib_mutex *m) {
-	g_mutex_unlock(m);
-}
+#define UNUSED(x) ((void)(x))
 
-#endif
+#define EVCON_GLIB_MAX_EVENTS 64
 
 /* GLib loop wrapper */
 
 typedef struct evcon_glib_data evcon_glib_data;
-typedef struct evcon_glib_fd_source evcon_glib_fd_source;
+typedef struct evcon_glib_source evcon_glib_source;
+typedef struct evcon_glib_fd evcon_glib_fd;
 typedef struct evcon_glib_async_watcher evcon_glib_async_watcher;
 
 struct evcon_glib_data {
 	GMainContext *ctx;
+	GSource *source; /* evcon_glib_source */
+
+	evcon_timer_queue timers;
 
-	gint async_pipe_fds[2];
+#ifdef EVCON_GLIB_EPOLL
+	evcon_epoll_set epoll; /* evcon_epoll_entry as fd watcher data */
+# if GLIB_CHECK_VERSION(2, 36, 0)
+	gpointer epoll_tag;
+# else
+	GPollFD epoll_pollfd;
+# endif
+
+	struct epoll_event events[EVCON_GLIB_MAX_EVENTS];
+	evcon_fd_event batch[EVCON_GLIB_MAX_EVENTS];
+#endif
+
+	evcon_wakeup_fd async_wakeup;
 	evcon_fd_watcher *async_watcher;
-	evcon_glib_mutex async_mutex;
-	GQueue async_pending;
+	gpointer async_pending; /* evcon_glib_async_watcher*: lock-free LIFO list, pushed by any thread, detached by the loop */
 };
 
-struct evcon_glib_fd_source {
+/* one source per loop: passes fd watcher changes on in its prepare, before the context polls,
+ * dispatches the ready fd watchers (with epoll) and the expired timers in one batch.
+ */
+struct evcon_glib_source {
+	GSource source;
+	evcon_loop *loop; /* weak reference */
+	evcon_glib_data *data;
+};
+
+#ifndef EVCON_GLIB_EPOLL
+/* without epoll every fd watcher gets its own source; the context dispatches those one by one, so each callback
+ * is a batch of its own.
+ */
+struct evcon_glib_fd {
 	GSource source;
 	GPollFD pollfd;
 	evcon_fd_watcher *watcher;
 };
+#endif
 
 struct evcon_glib_async_watcher {
-	GList pending_link;
+	evcon_glib_async_watcher *pending_next;
 	evcon_async_watcher *orig;
-	gboolean active;
+	gint active; /* atomic: 1 while in a pending list */
+	gboolean dead; /* freed while still in a pending list; the loop frees it when it gets there */
 };
 
+static evcon_glib_async_watcher* evcon_glib_async_detach(evcon_glib_data *data);
+static void evcon_glib_async_free_list(evcon_glib_async_watcher *w);
+
 static void evcon_glib_free_loop(evcon_loop *loop, void *loop_data, void *backend_data) {
 	evcon_glib_data *data = (evcon_glib_data*) loop_data;
 	UNUSED(loop);
@@ -101,15 +89,62 @@ static void evcon_glib_free_loop(evcon_loop *loop, void *loop_data, void *backen
 	evcon_loop_ref(loop);
 	evcon_fd_free(data->async_watcher);
 
-	close(data->async_pipe_fds[0]); data->async_pipe_fds[0] = -1;
-	close(data->async_pipe_fds[1]); data->async_pipe_fds[1] = -1;
+	g_source_destroy(data->source);
+	g_source_unref(data->source);
+
+	evcon_wakeup_fd_clear(&data->async_wakeup);
+
+	/* all async watchers are gone; only dead entries can be left */
+	evcon_glib_async_free_list(evcon_glib_async_detach(data));
+
+	evcon_timer_queue_clear(&data->timers);
+#ifdef EVCON_GLIB_EPOLL
+	evcon_epoll_set_clear(&data->epoll);
+#endif
 
-	g_main_context_ref(data->ctx);
-	evcon_glib_mutex_clear(&data->async_mutex);
+	g_main_context_unref(data->ctx);
 	g_slice_free(evcon_glib_data, data);
 }
 
-/* own FD poll handling */
+/* fd watchers */
+
+#ifdef EVCON_GLIB_EPOLL
+
+static void evcon_glib_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_glib_data *data = (evcon_glib_data*) loop_data;
+	UNUSED(allocator);
+
+	if (-1 == evcon_epoll_set_update(&data->epoll, (evcon_epoll_entry*) watcher_data, watcher, fd, events)) {
+		if (EEXIST == errno) g_error("only one active watcher per fd supported (fd %i)", fd);
+		g_error("epoll_ctl failed: %s", g_strerror(errno));
+	}
+}
+
+static gboolean evcon_glib_fd_pending(evcon_glib_data *data) {
+#if GLIB_CHECK_VERSION(2, 36, 0)
+	return 0 != (g_source_query_unix_fd(data->source, data->epoll_tag) & G_IO_IN);
+#else
+	return 0 != (data->epoll_pollfd.revents & G_IO_IN);
+#endif
+}
+
+static void evcon_glib_fd_dispatch_ready(evcon_loop *loop, evcon_glib_data *data) {
+	unsigned int count = 0;
+	int i, n;
+
+	n = epoll_wait(data->epoll.epoll_fd, data->events, EVCON_GLIB_MAX_EVENTS, 0);
+	if (-1 == n) {
+		if (EINTR != errno) g_error("epoll_wait failed: %s", g_strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		count += evcon_epoll_set_event(&data->epoll, data->events[i].data.fd, data->events[i].events, &data->batch[count]);
+	}
+	if (count > 0) evcon_feed_fd_batch(loop, data->batch, count);
+}
+
+#else /* EVCON_GLIB_EPOLL */
 
 static gboolean fd_source_prepare(GSource *source, gint *timeout);
 static gboolean fd_source_check(GSource *source);
@@ -129,11 +164,11 @@ static gboolean fd_source_prepare(GSource *source, gint *timeout) {
 	return FALSE;
 }
 static gboolean fd_source_check(GSource *source) {
-	evcon_glib_fd_source *watch = (evcon_glib_fd_source*) source;
+	evcon_glib_fd *watch = (evcon_glib_fd*) source;
 	return 0 != (watch->pollfd.revents & watch->pollfd.events);
 }
 static gboolean fd_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
-	evcon_glib_fd_source *watch = (evcon_glib_fd_source*) source;
+	evcon_glib_fd *watch = (evcon_glib_fd*) source;
 	int events;
 	UNUSED(callback);
 	UNUSED(user_data);
@@ -153,8 +188,8 @@ static void fd_source_finalize(GSource *source) {
 }
 
 static GSource* fd_source_new(evcon_fd_watcher *watcher) {
-	GSource *source = g_source_new(&fd_source_funcs, sizeof(evcon_glib_fd_source));
-	evcon_glib_fd_source *watch = (evcon_glib_fd_source*) source;
+	GSource *source = g_source_new(&fd_source_funcs, sizeof(evcon_glib_fd));
+	evcon_glib_fd *watch = (evcon_glib_fd*) source;
 	watch->watcher = watcher;
 	watch->pollfd.fd = -1;
 	watch->pollfd.events = watch->pollfd.revents = 0;
@@ -165,7 +200,7 @@ static GSource* fd_source_new(evcon_fd_watcher *watcher) {
 static void evcon_glib_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
 	GMainContext *ctx = ((evcon_glib_data*) loop_data)->ctx;
 	GSource *source = (GSource*) watcher_data;
-	evcon_glib_fd_source *watch;
+	evcon_glib_fd *watch;
 	int evs;
 	UNUSED(allocator);
 
@@ -180,10 +215,10 @@ static void evcon_glib_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int eve
 	if (NULL == source) {
 		source = fd_source_new(watcher);
 		g_source_attach(source, ctx);
-		watch = (evcon_glib_fd_source*) source;
+		watch = (evcon_glib_fd*) source;
 		g_source_add_poll(source, &watch->pollfd);
 	} else {
-		watch = (evcon_glib_fd_source*) source;
+		watch = (evcon_glib_fd*) source;
 	}
 
 	evs = 0;
@@ -198,117 +233,177 @@ static void evcon_glib_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int eve
 	watch->pollfd.events = evs;
 }
 
-static gboolean evcon_glib_timer_cb(gpointer data) {
-	evcon_timer_watcher *watcher = (evcon_timer_watcher*) data;
-	evcon_feed_timer(watcher);
-	return FALSE;
+#endif /* EVCON_GLIB_EPOLL */
+
+/* loop source */
+
+static gboolean loop_source_prepare(GSource *source, gint *timeout);
+static gboolean loop_source_check(GSource *source);
+static gboolean loop_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+static GSourceFuncs loop_source_funcs = {
+	loop_source_prepare,
+	loop_source_check,
+	loop_source_dispatch,
+	NULL, 0, 0
+};
+
+static gboolean loop_source_prepare(GSource *source, gint *timeout) {
+	evcon_glib_source *ls = (evcon_glib_source*) source;
+	evcon_interval next = evcon_timer_queue_next_timeout(&ls->data->timers);
+
+	evcon_loop_flush_fd_updates(ls->loop);
+
+	if (next < 0) {
+		*timeout = -1;
+	} else if (EVCON_INTERVAL_AS_MSEC(next) >= INT_MAX) {
+		*timeout = INT_MAX;
+	} else {
+		*timeout = (gint) EVCON_INTERVAL_AS_MSEC(next);
+	}
+	return 0 == next;
 }
+static gboolean loop_source_check(GSource *source) {
+	evcon_glib_source *ls = (evcon_glib_source*) source;
+
+#ifdef EVCON_GLIB_EPOLL
+	if (evcon_glib_fd_pending(ls->data)) return TRUE;
+#endif
+	return 0 == evcon_timer_queue_next_timeout(&ls->data->timers);
+}
+static gboolean loop_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+	evcon_glib_source *ls = (evcon_glib_source*) source;
+	evcon_loop *loop = ls->loop;
+	UNUSED(callback);
+	UNUSED(user_data);
+
+	/* callbacks might drop the last reference; batch end hooks run once, after fd and timer callbacks */
+	evcon_loop_ref(loop);
+	evcon_loop_batch_begin(loop);
+#ifdef EVCON_GLIB_EPOLL
+	evcon_glib_fd_dispatch_ready(loop, ls->data);
+#endif
+	evcon_timer_queue_dispatch(&ls->data->timers);
+	evcon_loop_batch_end(loop);
+	evcon_loop_unref(loop);
+
+	return TRUE;
+}
+
+/* timer watchers */
 
 static void evcon_glib_timer_update(evcon_timer_watcher *watcher, evcon_interval timeout, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
-	GMainContext *ctx = ((evcon_glib_data*) loop_data)->ctx;
-	GSource *source = (GSource*) watcher_data;
+	evcon_glib_data *data = (evcon_glib_data*) loop_data;
 	UNUSED(allocator);
+	UNUSED(watcher_data);
 
-	if (NULL != source) {
-		/* delete old source */
-		g_source_destroy(source);
-		g_source_unref(source);
+	evcon_timer_queue_update(&data->timers, watcher, timeout);
+}
+
+
+/* async watchers: triggers push onto data->async_pending with a CAS (multiple producers), the loop
+ * thread detaches the whole list at once with an atomic exchange (single consumer). there are no
+ * single-element pops, so the push doesn't suffer from ABA.
+ */
+
+static void evcon_glib_async_push(evcon_glib_data *data, evcon_glib_async_watcher *w) {
+	gpointer head;
+
+	do {
+		head = g_atomic_pointer_get(&data->async_pending);
+		w->pending_next = (evcon_glib_async_watcher*) head;
+	} while (!g_atomic_pointer_compare_and_exchange(&data->async_pending, head, w));
+
+	/* only the first trigger after the loop emptied the list needs to wake it up */
+	if (NULL == head && -1 == evcon_wakeup_fd_signal(&data->async_wakeup)) {
+		g_error("async wake write failed: %s", g_strerror(errno));
 	}
+}
 
-	if (timeout < 0) return;
+/* returns the pending watchers in trigger order */
+static evcon_glib_async_watcher* evcon_glib_async_detach(evcon_glib_data *data) {
+	evcon_glib_async_watcher *w, *next, *list = NULL;
 
-	if (timeout == 0) {
-		source = g_idle_source_new();
-	} else {
-		source = g_timeout_source_new(EVCON_INTERVAL_AS_MSEC(timeout));
+#if GLIB_CHECK_VERSION(2, 74, 0)
+	w = (evcon_glib_async_watcher*) g_atomic_pointer_exchange(&data->async_pending, NULL);
+#else
+	do {
+		w = (evcon_glib_async_watcher*) g_atomic_pointer_get(&data->async_pending);
+	} while (NULL != w && !g_atomic_pointer_compare_and_exchange(&data->async_pending, w, NULL));
+#endif
+
+	/* reverse LIFO to FIFO */
+	for (; NULL != w; w = next) {
+		next = w->pending_next;
+		w->pending_next = list;
+		list = w;
 	}
-	evcon_timer_set_backend_data(watcher, source);
-	g_source_set_callback(source, evcon_glib_timer_cb, watcher, NULL);
-	g_source_attach(source, ctx);
+
+	return list;
 }
 
+static void evcon_glib_async_free_list(evcon_glib_async_watcher *w) {
+	evcon_glib_async_watcher *next;
+
+	for (; NULL != w; w = next) {
+		next = w->pending_next;
+		g_slice_free(evcon_glib_async_watcher, w);
+	}
+}
 
 static void evcon_glib_async_update(evcon_async_watcher *watcher, evcon_async_func f, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
-	static const char val = 'A';
 	evcon_glib_data *data = (evcon_glib_data*) loop_data;
 	evcon_glib_async_watcher *w = (evcon_glib_async_watcher*) watcher_data;
 	UNUSED(allocator);
 
-	evcon_glib_mutex_lock(&data->async_mutex);
-
 	switch (f) {
 	case EVCON_ASYNC_TRIGGER:
-		if (!w->active) {
-			w->active = TRUE;
-			if (0 == data->async_pending.length) {
-				int r;
-trigger_again:
-				r = write(data->async_pipe_fds[1], &val, sizeof(val));
-				if (-1 == r) {
-					switch (errno) {
-					case EINTR:
-						goto trigger_again;
-					case EAGAIN:
-#if EWOULDBLOCK != EAGAIN
-					case EWOULDBLOCK:
-#endif
-						break; /* enough data in the pipe to trigger */
-					default:
-						g_error("async wake write failed: %s", g_strerror(errno));
-					}
-				}
-			}
-			g_queue_push_tail_link(&data->async_pending, &w->pending_link);
-		}
+		/* already pending: nothing to do */
+		if (g_atomic_int_compare_and_exchange(&w->active, 0, 1)) evcon_glib_async_push(data, w);
 		break;
 	case EVCON_ASYNC_NEW:
 		w = g_slice_new0(evcon_glib_async_watcher);
-		w->pending_link.data = w;
 		w->orig = watcher;
 		evcon_async_set_backend_data(watcher, w);
 		break;
 	case EVCON_ASYNC_FREE:
-		if (NULL == w) goto exit;
+		if (NULL == w) break;
 
-		if (w->active) {
-			g_queue_unlink(&data->async_pending, &w->pending_link);
-			w->active = FALSE;
-		}
-		g_slice_free(evcon_glib_async_watcher, w);
 		evcon_async_set_backend_data(watcher, NULL);
-		goto exit;
+		/* can't unlink from a lock-free list; free it later in evcon_glib_async_cb */
+		if (g_atomic_int_get(&w->active)) {
+			w->orig = NULL;
+			w->dead = TRUE;
+		} else {
+			g_slice_free(evcon_glib_async_watcher, w);
+		}
+		break;
 	}
-
-exit:
-	evcon_glib_mutex_unlock(&data->async_mutex);
 }
 
 static void evcon_glib_async_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data) {
 	evcon_glib_data *data = user_data;
-	evcon_glib_async_watcher *w;
-	char buf[32];
+	evcon_glib_async_watcher *w, *next;
 	UNUSED(loop);
 	UNUSED(watcher);
+	UNUSED(fd);
 	UNUSED(revents);
 
-	(void) read(fd, buf, sizeof(buf));
-
-	for (;;) {
-		{
-			GList *link;
-			evcon_glib_mutex_lock(&data->async_mutex);
-			link = g_queue_pop_head_link(&data->async_pending);
-			if (NULL != link) {
-				w = (evcon_glib_async_watcher*) link->data;
-				w->active = FALSE;
-			} else {
-				w = NULL;
-			}
-			evcon_glib_mutex_unlock(&data->async_mutex);
-		}
+	/* drain before detaching: a trigger after the detach signals again */
+	evcon_wakeup_fd_drain(&data->async_wakeup);
 
-		if (NULL == w) break;
+	for (w = evcon_glib_async_detach(data); NULL != w; w = next) {
+		next = w->pending_next;
+
+		if (w->dead) {
+			g_slice_free(evcon_glib_async_watcher, w);
+			continue;
+		}
 
+		/* callbacks may free (mark dead) watchers later in the list, or trigger again (pushes
+		 * onto the shared list), but never touch our local list
+		 */
+		g_atomic_int_set(&w->active, 0);
 		evcon_feed_async(w->orig);
 	}
 }
@@ -319,6 +414,10 @@ static evcon_backend* evcon_glib_backend(void) {
 
 	if (g_once_init_enter(&backend)) {
 		evcon_backend* bcknd = evcon_backend_init(static_backend_buf, sizeof(static_backend_buf), NULL, evcon_glib_allocator(), evcon_glib_free_loop, evcon_glib_fd_update, evcon_glib_timer_update, evcon_glib_async_update);
+#ifdef EVCON_GLIB_EPOLL
+		evcon_backend_set_watcher_data_sizes(bcknd, sizeof(evcon_epoll_entry), 0, 0);
+#endif
+		evcon_backend_set_fd_batching(bcknd, NULL);
 
 		g_once_init_leave(&backend, bcknd);
 	}
@@ -326,46 +425,59 @@ static evcon_backend* evcon_glib_backend(void) {
 	return (evcon_backend*) backend;
 }
 
-static gboolean setup_pipe(int fds[2]) {
-#ifdef HAVE_PIPE2
-	if (-1 == pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
-		g_error("Cannot create pipe: %s\n", g_strerror(errno));
-		return FALSE;
-	}
-#else
-	if (-1 == pipe(fds)) {
-		g_error("Cannot create pipe: %s\n", g_strerror(errno));
-		return FALSE;
-	}
-
-	evcon_init_fd(fds[0]);
-	evcon_init_fd(fds[1]);
-#endif
-	return TRUE;
-}
-
 evcon_loop* evcon_loop_from_glib(GMainContext *ctx, evcon_allocator *allocator) {
 	evcon_backend *backend;
 	evcon_glib_data *loop_data;
 	evcon_loop *evc_loop;
-	int async_pipe_fds[2];
-
-	if (!setup_pipe(async_pipe_fds)) return NULL;
+	evcon_wakeup_fd async_wakeup;
+	evcon_glib_source *source;
+#ifdef EVCON_GLIB_EPOLL
+	evcon_epoll_set epoll;
+#endif
 
 	if (NULL == allocator) allocator = evcon_glib_allocator();
 
+#ifdef EVCON_GLIB_EPOLL
+	if (-1 == evcon_epoll_set_init(&epoll, allocator)) {
+		g_error("Cannot create epoll fd: %s\n", g_strerror(errno));
+		return NULL;
+	}
+#endif
+
+	if (-1 == evcon_wakeup_fd_init(&async_wakeup)) {
+		g_error("Cannot create wakeup fd: %s\n", g_strerror(errno));
+		return NULL;
+	}
+
 	backend = evcon_glib_backend();
 	loop_data = g_slice_new0(evcon_glib_data);
 	evc_loop = evcon_loop_new(backend, allocator);
 
 	g_main_context_ref(ctx);
 	loop_data->ctx = ctx;
-	loop_data->async_pipe_fds[0] = async_pipe_fds[0];
-	loop_data->async_pipe_fds[1] = async_pipe_fds[1];
-	evcon_glib_mutex_init(&loop_data->async_mutex);
+	loop_data->async_wakeup = async_wakeup;
+	loop_data->async_pending = NULL;
+	evcon_timer_queue_init(&loop_data->timers, allocator);
 	evcon_loop_set_backend_data(evc_loop, loop_data);
 
-	loop_data->async_watcher = evcon_fd_new(evc_loop, evcon_glib_async_cb, async_pipe_fds[0], EVCON_READ, loop_data);
+	loop_data->source = g_source_new(&loop_source_funcs, sizeof(evcon_glib_source));
+	source = (evcon_glib_source*) loop_data->source;
+	source->loop = evc_loop;
+	source->data = loop_data;
+#ifdef EVCON_GLIB_EPOLL
+	loop_data->epoll = epoll;
+# if GLIB_CHECK_VERSION(2, 36, 0)
+	loop_data->epoll_tag = g_source_add_unix_fd(loop_data->source, epoll.epoll_fd, G_IO_IN);
+# else
+	loop_data->epoll_pollfd.fd = epoll.epoll_fd;
+	loop_data->epoll_pollfd.events = G_IO_IN;
+	g_source_add_poll(loop_data->source, &loop_data->epoll_pollfd);
+# endif
+#endif
+	g_source_attach(loop_data->source, ctx);
+
+	loop_data->async_watcher = evcon_fd_new(evc_loop, evcon_glib_async_cb, async_wakeup.read_fd, EVCON_READ, loop_data);
+	evcon_fd_start(loop_data->async_watcher);
 	evcon_loop_unref(evc_loop);
 
 	return evc_loop;
@@ -0,0 +1,405 @@
+
+#include <evcon-qt.h>
+
+#include <evcon-allocator.h>
+#include <evcon-backend.h>
+
+#include <QAbstractEventDispatcher>
+#include <QCoreApplication>
+#include <QEvent>
+#include <QMutex>
+#include <QObject>
+#include <QSocketNotifier>
+#include <QTimerEvent>
+
+#include <climits>
+#include <cstddef>
+
+#define UNUSED(x) ((void)(x))
+
+/* Qt loop wrapper; no signals or slots (and no moc): the loop object and the
+ * notifiers handle their events directly.
+ */
+
+namespace {
+
+struct evcon_qt_data;
+struct evcon_qt_fd;
+struct evcon_qt_async;
+
+/* QSocketNotifier delivers activation as QEvent::SockAct to itself */
+class evcon_qt_notifier : public QSocketNotifier {
+public:
+	evcon_qt_notifier(evcon_fd fd, Type type, evcon_qt_fd *fd_owner)
+	: QSocketNotifier(fd, type), owner(fd_owner) { }
+
+	/* the owner is gone; while dispatching this might be called from our own event() */
+	void detach(bool dispatching) {
+		owner = NULL;
+		if (dispatching) {
+			setEnabled(false);
+			deleteLater();
+		} else {
+			delete this;
+		}
+	}
+
+protected:
+	virtual bool event(QEvent *e);
+
+private:
+	evcon_qt_fd *owner;
+};
+
+/* posted to wake up the loop for async watchers and to end batches, and receives the timer events */
+class evcon_qt_object : public QObject {
+public:
+	explicit evcon_qt_object(evcon_qt_data *loop_data)
+	: data(loop_data) { }
+
+	void detach() { data = NULL; }
+
+protected:
+	virtual bool event(QEvent *e);
+	virtual void timerEvent(QTimerEvent *e);
+
+private:
+	evcon_qt_data *data;
+};
+
+struct evcon_qt_data {
+	evcon_loop *loop;
+	evcon_qt_object *object;
+	/* the object and notifiers can't be deleted from their own event handlers; if the loop
+	 * is freed while dispatching the data is kept until the dispatch ends.
+	 */
+	int dispatching;
+	bool freed;
+
+	/* Qt has no iteration hooks usable without moc: the first evcon callback begins a batch and posts an event
+	 * (low priority, after the other posted events) that ends it, before the dispatcher blocks again.
+	 */
+	bool in_batch;
+
+	/* all timers share one Qt timer, armed for the first deadline. when that moves to a later
+	 * time the Qt timer is left alone; timerEvent arms it again for the new deadline.
+	 */
+	evcon_timer_queue timers;
+	int timer_id;
+	evcon_interval timer_deadline; /* -1 if the Qt timer is not running */
+
+	QMutex async_mutex;
+	evcon_qt_async *async_first, *async_last;
+};
+
+/* inline storage in the evcon watchers */
+struct evcon_qt_fd {
+	evcon_fd_watcher *watcher;
+	evcon_qt_data *data;
+	evcon_fd fd; /* fd of the notifiers */
+	evcon_qt_notifier *read, *write; /* created on first use, then only enabled/disabled */
+};
+
+struct evcon_qt_async {
+	evcon_qt_async *pending_next;
+	evcon_async_watcher *orig;
+	int active;
+};
+
+QEvent::Type evcon_qt_async_event_type() {
+	static const QEvent::Type type = static_cast<QEvent::Type>(QEvent::registerEventType());
+	return type;
+}
+
+QEvent::Type evcon_qt_batch_event_type() {
+	static const QEvent::Type type = static_cast<QEvent::Type>(QEvent::registerEventType());
+	return type;
+}
+
+/* callbacks might drop the last loop reference */
+void evcon_qt_dispatch_begin(evcon_qt_data *data) {
+	data->dispatching++;
+	evcon_loop_ref(data->loop);
+}
+
+void evcon_qt_dispatch_end(evcon_qt_data *data) {
+	evcon_loop_unref(data->loop);
+	if (0 == --data->dispatching && data->freed) delete data;
+}
+
+void evcon_qt_batch_begin(evcon_qt_data *data) {
+	if (data->in_batch) return;
+	data->in_batch = true;
+	evcon_loop_batch_begin(data->loop);
+	QCoreApplication::postEvent(data->object, new QEvent(evcon_qt_batch_event_type()), Qt::LowEventPriority);
+}
+
+/* fd watchers */
+
+void evcon_qt_fd_release(evcon_qt_fd *w) {
+	bool dispatching = (w->data->dispatching > 0);
+	if (NULL != w->read) w->read->detach(dispatching);
+	if (NULL != w->write) w->write->detach(dispatching);
+	w->read = w->write = NULL;
+	w->fd = -1;
+}
+
+void evcon_qt_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_qt_fd *w = static_cast<evcon_qt_fd*>(watcher_data);
+	bool want_read = (0 != (events & EVCON_READ)), want_write = (0 != (events & EVCON_WRITE));
+	UNUSED(allocator);
+
+	if (-1 == fd) {
+		/* delete watcher */
+		if (NULL == w->watcher) return;
+
+		evcon_qt_fd_release(w);
+		return;
+	}
+
+	if (NULL == w->watcher) {
+		w->watcher = watcher;
+		w->data = static_cast<evcon_qt_data*>(loop_data);
+		w->fd = -1;
+		w->read = w->write = NULL;
+	}
+
+	/* notifiers are bound to an fd (which might have been closed and reused) */
+	if (fd != w->fd || evcon_fd_is_rearm(watcher)) {
+		evcon_qt_fd_release(w);
+		w->fd = fd;
+	}
+
+	if (want_read && NULL == w->read) w->read = new evcon_qt_notifier(fd, QSocketNotifier::Read, w);
+	if (want_write && NULL == w->write) w->write = new evcon_qt_notifier(fd, QSocketNotifier::Write, w);
+
+	if (NULL != w->read && w->read->isEnabled() != want_read) w->read->setEnabled(want_read);
+	if (NULL != w->write && w->write->isEnabled() != want_write) w->write->setEnabled(want_write);
+}
+
+bool evcon_qt_notifier::event(QEvent *e) {
+	evcon_qt_fd *w = owner;
+	evcon_qt_data *d;
+	int events;
+
+	if (QEvent::SockAct != e->type()) return QSocketNotifier::event(e);
+	if (NULL == w) return true;
+
+	events = (QSocketNotifier::Read == type()) ? EVCON_READ : EVCON_WRITE;
+	events &= evcon_fd_get_events(w->watcher);
+
+	if (0 == events) return true;
+
+	/* might free the watcher (and detach us) or drop the last loop reference */
+	d = w->data;
+	evcon_qt_dispatch_begin(d);
+	evcon_qt_batch_begin(d);
+	evcon_feed_fd(w->watcher, events);
+	evcon_qt_dispatch_end(d);
+	return true;
+}
+
+/* timer watchers */
+
+void evcon_qt_timer_schedule(evcon_qt_data *data) {
+	evcon_interval deadline = evcon_timer_queue_next_deadline(&data->timers), timeout;
+	int msec;
+
+	/* a later deadline is handled when the Qt timer triggers */
+	if (-1 != data->timer_deadline && (-1 == deadline || deadline >= data->timer_deadline)) return;
+
+	if (-1 != data->timer_deadline) {
+		data->object->killTimer(data->timer_id);
+		data->timer_deadline = -1;
+	}
+	if (-1 == deadline) return;
+
+	timeout = deadline - evcon_monotonic_now();
+	if (timeout < 0) timeout = 0;
+	msec = (EVCON_INTERVAL_AS_MSEC(timeout) >= INT_MAX) ? INT_MAX : (int) EVCON_INTERVAL_AS_MSEC(timeout);
+
+#if QT_VERSION >= 0x050000
+	data->timer_id = data->object->startTimer(msec, Qt::PreciseTimer);
+#else
+	data->timer_id = data->object->startTimer(msec);
+#endif
+	data->timer_deadline = deadline;
+}
+
+void evcon_qt_timer_update(evcon_timer_watcher *watcher, evcon_interval timeout, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_qt_data *data = static_cast<evcon_qt_data*>(loop_data);
+	UNUSED(allocator);
+	UNUSED(watcher_data);
+
+	evcon_timer_queue_update(&data->timers, watcher, timeout);
+	evcon_qt_timer_schedule(data);
+}
+
+void evcon_qt_object::timerEvent(QTimerEvent *e) {
+	evcon_qt_data *d = data;
+
+	if (NULL == d || e->timerId() != d->timer_id || -1 == d->timer_deadline) return;
+
+	/* Qt timers repeat */
+	killTimer(d->timer_id);
+	d->timer_deadline = -1;
+
+	evcon_qt_dispatch_begin(d);
+	evcon_qt_batch_begin(d);
+	evcon_timer_queue_dispatch(&d->timers);
+	if (!d->freed) evcon_qt_timer_schedule(d);
+	evcon_qt_dispatch_end(d);
+}
+
+/* async watchers */
+
+void evcon_qt_async_update(evcon_async_watcher *watcher, evcon_async_func f, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_qt_data *data = static_cast<evcon_qt_data*>(loop_data);
+	evcon_qt_async *w = static_cast<evcon_qt_async*>(watcher_data);
+	UNUSED(allocator);
+
+	switch (f) {
+	case EVCON_ASYNC_TRIGGER:
+		data->async_mutex.lock();
+		if (!w->active) {
+			w->active = 1;
+			w->pending_next = NULL;
+			if (NULL == data->async_last) {
+				data->async_first = data->async_last = w;
+				/* thread-safe; only the first trigger after the loop emptied the list posts */
+				QCoreApplication::postEvent(data->object, new QEvent(evcon_qt_async_event_type()));
+			} else {
+				data->async_last->pending_next = w;
+				data->async_last = w;
+			}
+		}
+		data->async_mutex.unlock();
+		break;
+	case EVCON_ASYNC_NEW:
+		w->orig = watcher;
+		break;
+	case EVCON_ASYNC_FREE:
+		data->async_mutex.lock();
+		if (w->active) {
+			evcon_qt_async *prev = NULL, *cur = data->async_first;
+			while (cur != w) {
+				prev = cur;
+				cur = cur->pending_next;
+			}
+			if (NULL != prev) {
+				prev->pending_next = w->pending_next;
+			} else {
+				data->async_first = w->pending_next;
+			}
+			if (data->async_last == w) data->async_last = prev;
+			w->active = 0;
+		}
+		data->async_mutex.unlock();
+		break;
+	}
+}
+
+bool evcon_qt_object::event(QEvent *e) {
+	evcon_qt_data *d = data;
+	evcon_qt_async *w;
+
+	if (evcon_qt_batch_event_type() == e->type()) {
+		if (NULL == d || !d->in_batch) return true;
+
+		/* batch end hooks might drop the last loop reference */
+		d->in_batch = false;
+		evcon_qt_dispatch_begin(d);
+		evcon_loop_batch_end(d->loop);
+		evcon_qt_dispatch_end(d);
+		return true;
+	}
+	if (evcon_qt_async_event_type() != e->type()) return QObject::event(e);
+	if (NULL == d) return true;
+
+	evcon_qt_dispatch_begin(d);
+	evcon_qt_batch_begin(d);
+	/* one at a time: callbacks may free other pending watchers */
+	for (;;) {
+		d->async_mutex.lock();
+		w = d->async_first;
+		if (NULL != w) {
+			d->async_first = w->pending_next;
+			if (NULL == d->async_first) d->async_last = NULL;
+			w->pending_next = NULL;
+			w->active = 0;
+		}
+		d->async_mutex.unlock();
+
+		if (NULL == w) break;
+
+		evcon_feed_async(w->orig);
+	}
+	evcon_qt_dispatch_end(d);
+
+	return true;
+}
+
+/* loop */
+
+void evcon_qt_free_loop(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_qt_data *data = static_cast<evcon_qt_data*>(loop_data);
+	UNUSED(loop);
+	UNUSED(backend_data);
+
+	/* deleting the object drops pending posted events and timers */
+	data->object->detach();
+	if (data->dispatching > 0) {
+		data->object->deleteLater();
+	} else {
+		delete data->object;
+	}
+
+	evcon_timer_queue_clear(&data->timers);
+	if (data->dispatching > 0) {
+		data->freed = true;
+	} else {
+		delete data;
+	}
+}
+
+evcon_backend* evcon_qt_backend_init() {
+	static char static_backend_buf[EVCON_BACKEND_RECOMMENDED_SIZE];
+	evcon_backend *backend = evcon_backend_init(static_backend_buf, sizeof(static_backend_buf), NULL, NULL, evcon_qt_free_loop, evcon_qt_fd_update, evcon_qt_timer_update, evcon_qt_async_update);
+
+	/* the notifiers of an fd watcher and the pending link of an async watcher are kept inline; timers have no
+	 * per-watcher Qt state, they all share the one Qt timer of the loop
+	 */
+	evcon_backend_set_watcher_data_sizes(backend, sizeof(evcon_qt_fd), 0, sizeof(evcon_qt_async));
+	return backend;
+}
+
+evcon_backend* evcon_qt_backend() {
+	/* initialized once, thread-safe (function-local static) */
+	static evcon_backend *backend = evcon_qt_backend_init();
+	return backend;
+}
+
+} /* namespace */
+
+evcon_loop* evcon_loop_new_qt(evcon_allocator *allocator) {
+	evcon_qt_data *data;
+	evcon_loop *evc_loop;
+
+	if (NULL == QAbstractEventDispatcher::instance()) return NULL;
+
+	data = new evcon_qt_data;
+	evc_loop = evcon_loop_new(evcon_qt_backend(), allocator);
+
+	data->loop = evc_loop;
+	data->object = new evcon_qt_object(data);
+	data->dispatching = 0;
+	data->freed = false;
+	data->in_batch = false;
+	evcon_timer_queue_init(&data->timers, allocator);
+	data->timer_id = 0;
+	data->timer_deadline = -1;
+	data->async_first = data->async_last = NULL;
+	evcon_loop_set_backend_data(evc_loop, data);
+
+	return evc_loop;
+}
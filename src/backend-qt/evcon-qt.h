@@ -0,0 +1,22 @@
+#ifndef __EVCON_EVCON_QT_H
+#define __EVCON_EVCON_QT_H __EVCON_EVCON_QT_H
+
+#include <evcon.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Qt (QtCore >= 4.6) loop wrapper: uses the event loop (QAbstractEventDispatcher) of the thread
+ * creating it; run that loop with QCoreApplication::exec() / QEventLoop::exec() as usual.
+ * fds use (reused) QSocketNotifiers, all timers of a loop share one Qt timer, async wakeups are posted events.
+ * returns NULL if the thread has no event dispatcher (create a QCoreApplication first).
+ * the loop is destroyed with the last evcon_loop_unref()
+ */
+evcon_loop* evcon_loop_new_qt(evcon_allocator *allocator);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
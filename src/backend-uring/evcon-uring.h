@@ -0,0 +1,46 @@
+#ifndef __EVCON_EVCON_URING_H
+#define __EVCON_EVCON_URING_H __EVCON_EVCON_URING_H
+
+#include <evcon.h>
+
+#include <sys/types.h>
+
+/* native linux backend on io_uring (kernel >= 5.6): poll and timeout requests are collected
+ * for a whole loop iteration and submitted together with the wait in a single io_uring_enter().
+ * evcon_acceptor (evcon-listener.h) uses a single multishot accept request per socket (kernel >= 5.19).
+ */
+
+typedef enum {
+	EVCON_URING_RUN_DEFAULT = 0, /* run until evcon_loop_uring_break() is called */
+	EVCON_URING_RUN_ONCE    = 1, /* wait for events once and handle them */
+	EVCON_URING_RUN_NOWAIT  = 2  /* handle pending events, but don't wait for new ones */
+} evcon_uring_run_flags;
+
+/* returns NULL (with errno set, ENOSYS if the kernel lacks io_uring or a needed opcode);
+ * callers should fall back to another backend then (for example evcon_loop_new_epoll).
+ * the loop is destroyed with the last evcon_loop_unref()
+ */
+evcon_loop* evcon_loop_new_uring(evcon_allocator *allocator);
+
+void evcon_loop_uring_run(evcon_loop *loop, int flags);
+void evcon_loop_uring_break(evcon_loop *loop); /* not thread-safe; use an async watcher to break from other threads */
+
+/* multishot recv (kernel >= 6.0): one request keeps receiving on a socket into buffers the kernel picks
+ * from a provided buffer ring of the loop (256 buffers of 4k, registered on first use), without a poll
+ * and read round trip for each event.
+ */
+typedef struct evcon_uring_recv evcon_uring_recv;
+
+/* @len > 0: @buf holds the data, it is only valid during the callback (the buffer is recycled afterwards).
+ * @len == 0: EOF, @len < 0: error (-errno); these end receiving, only evcon_uring_recv_free is left to do.
+ */
+typedef void (*evcon_uring_recv_cb)(evcon_loop *loop, evcon_uring_recv *recv, const char *buf, ssize_t len, void *user_data);
+
+/* receives from the connected socket @fd until EOF, an error or evcon_uring_recv_free (doesn't take ownership of
+ * @fd; don't close it before freeing the receiver). returns NULL (with errno set, ENOSYS if the kernel lacks it).
+ */
+evcon_uring_recv* evcon_uring_recv_new(evcon_loop *loop, evcon_fd fd, evcon_uring_recv_cb cb, void *user_data);
+/* can be called from the callback */
+void evcon_uring_recv_free(evcon_uring_recv *recv);
+
+#endif
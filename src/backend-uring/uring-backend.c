@@ -0,0 +1,1049 @@
+
+#define _GNU_SOURCE
+
+#include <evcon-uring.h>
+
+#include <evcon-allocator.h>
+#include <evcon-backend.h>
+#include <evcon-listener.h>
+
+#include <evcon-config-private.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#define UNUSED(x) ((void)(x))
+
+#define EVCON_URING_SQ_ENTRIES 256
+#define EVCON_URING_CQ_ENTRIES 4096
+#define EVCON_URING_BATCH 64 /* fd events passed to core at once */
+
+/* the lower bits of the request user_data tell what kind of request completed; for timeouts the
+ * rest is a sequence number, otherwise a pointer to the request state (evcon_uring_fd, ...)
+ */
+#define EVCON_URING_TAG_IGNORE  ((uint64_t) 0x0)
+#define EVCON_URING_TAG_POLL    ((uint64_t) 0x1)
+#define EVCON_URING_TAG_TIMEOUT ((uint64_t) 0x2)
+#define EVCON_URING_TAG_ACCEPT  ((uint64_t) 0x3)
+#define EVCON_URING_TAG_RECV    ((uint64_t) 0x4)
+#define EVCON_URING_TAG_MASK    ((uint64_t) 0x7)
+#define EVCON_URING_TAG_BITS    3
+
+/* provided buffer ring for multishot recv (one per loop, registered on first use) */
+#define EVCON_URING_BUF_GROUP 0
+#define EVCON_URING_BUF_COUNT 256 /* power of 2 */
+#define EVCON_URING_BUF_SIZE  4096
+
+/* io_uring loop */
+
+typedef struct evcon_uring_ring evcon_uring_ring;
+typedef struct evcon_uring_data evcon_uring_data;
+typedef struct evcon_uring_fd evcon_uring_fd;
+typedef struct evcon_uring_async evcon_uring_async;
+typedef struct evcon_uring_accept evcon_uring_accept;
+
+struct evcon_uring_ring {
+	int fd;
+
+	unsigned int *sq_head, *sq_tail, *sq_array;
+	unsigned int sq_mask, sq_entries;
+	unsigned int sq_local_tail; /* sqes prepared, but not published to the kernel yet */
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size, sqes_map_size;
+
+	/* kernel supports multishot accept (>= 5.19) / multishot recv with provided buffer rings (>= 6.0) */
+	unsigned int multishot_accept:1, multishot_recv:1;
+};
+
+struct evcon_uring_data {
+	evcon_uring_ring ring;
+	int loop_break;
+	evcon_allocator *allocator;
+
+	/* fd watchers whose poll request doesn't match the watcher state; handled before waiting */
+	evcon_uring_fd *dirty;
+	unsigned int polls_inflight;
+
+	/* completed polls of the current reap */
+	evcon_loop *loop;
+	evcon_fd_event batch[EVCON_URING_BATCH];
+	unsigned int batch_count;
+
+	/* multishot accept and recv requests; their state is freed when the last completion arrived */
+	unsigned int multishot_inflight;
+	evcon_uring_accept *accept_pending; /* acceptors with connections to deliver after reaping */
+
+	struct io_uring_buf_ring *bufs; /* NULL until the first evcon_uring_recv */
+	char *buf_mem;
+	unsigned short buf_tail;
+
+	evcon_timer_queue timers;
+	int timeout_armed;
+	uint64_t timeout_seq;
+	evcon_interval timeout_deadline;
+	struct __kernel_timespec timeout_ts;
+
+	evcon_wakeup_fd async_wakeup;
+	evcon_fd_watcher *async_watcher;
+	pthread_mutex_t async_mutex;
+	evcon_uring_async *async_pending_head, *async_pending_tail;
+};
+
+struct evcon_uring_fd {
+	evcon_fd_watcher *watcher; /* NULL after the watcher was deleted; freed when no request references it anymore */
+	evcon_uring_fd *dirty_next;
+
+	evcon_fd fd; /* wanted poll */
+	unsigned int events;
+	evcon_fd poll_fd; /* poll request in flight */
+	unsigned int poll_events;
+
+	unsigned int dirty:1, polling:1, cancelling:1;
+	unsigned int rearm:1; /* the fd might have been closed and reused: restart the poll */
+};
+
+struct evcon_uring_async {
+	evcon_uring_async *pending_next;
+	evcon_async_watcher *orig;
+	int active;
+};
+
+struct evcon_uring_accept {
+	evcon_acceptor *acceptor; /* NULL after it was stopped */
+	evcon_uring_accept *pending_next;
+	evcon_fd fd;
+	unsigned int armed:1, cancelling:1, pending:1, busy:1;
+
+	/* connections accepted in this iteration */
+	unsigned int count;
+	evcon_fd fds[EVCON_ACCEPTOR_MAX_BATCH];
+};
+
+struct evcon_uring_recv {
+	evcon_loop *loop;
+	evcon_uring_data *data;
+	evcon_fd fd;
+	evcon_uring_recv_cb cb;
+	void *user_data;
+	unsigned int armed:1, cancelling:1, stopped:1, freed:1, incallback:1, delayed_delete:1;
+};
+
+static void evcon_uring_fatal(const char *msg) {
+	fprintf(stderr, "evcon io_uring backend: %s: %s\n", msg, strerror(errno));
+	abort();
+}
+
+/* raw ring handling */
+
+static int evcon_uring_ring_init(evcon_uring_ring *ring, evcon_allocator *allocator) {
+	static const int needed_ops[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE };
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	unsigned int i;
+	char *sq, *cq;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = EVCON_URING_CQ_ENTRIES;
+
+	if (-1 == (ring->fd = syscall(__NR_io_uring_setup, EVCON_URING_SQ_ENTRIES, &p))) return -1;
+
+	/* check the kernel knows all the opcodes we need */
+	probe = evcon_alloc0(allocator, probe_size);
+	if (-1 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256)) {
+		err = ENOSYS;
+		evcon_free(allocator, probe, probe_size);
+		goto error;
+	}
+	for (i = 0; i < sizeof(needed_ops)/sizeof(needed_ops[0]); ++i) {
+		if (needed_ops[i] > probe->last_op || 0 == (probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			err = ENOSYS;
+			evcon_free(allocator, probe, probe_size);
+			goto error;
+		}
+	}
+	/* multishot flags can't be probed; use opcodes of the same kernel release as marker */
+#ifdef IORING_ACCEPT_MULTISHOT
+	ring->multishot_accept = (IORING_OP_SOCKET <= probe->last_op && 0 != (probe->ops[IORING_OP_SOCKET].flags & IO_URING_OP_SUPPORTED)
+		&& 0 != (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED));
+#endif
+#ifdef IORING_RECV_MULTISHOT
+	ring->multishot_recv = (IORING_OP_SEND_ZC <= probe->last_op && 0 != (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED));
+#endif
+	evcon_free(allocator, probe, probe_size);
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (0 != (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		if (ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = 0;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_map) goto error_errno;
+	if (0 == ring->cq_map_size) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_map) goto error_errno;
+	}
+	ring->sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == (void*) ring->sqes) goto error_errno;
+
+	sq = (char*) ring->sq_map;
+	ring->sq_head = (unsigned int*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int*) (sq + p.sq_off.tail);
+	ring->sq_array = (unsigned int*) (sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned int*) (sq + p.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned int*) (sq + p.sq_off.ring_entries);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	cq = (char*) ring->cq_map;
+	ring->cq_head = (unsigned int*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int*) (cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	return 0;
+
+error_errno:
+	err = errno;
+error:
+	if (NULL != ring->sqes && MAP_FAILED != (void*) ring->sqes) munmap(ring->sqes, ring->sqes_map_size);
+	if (NULL != ring->cq_map && MAP_FAILED != ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+	if (NULL != ring->sq_map && MAP_FAILED != ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+	ring->fd = -1;
+	errno = err;
+	return -1;
+}
+
+static void evcon_uring_ring_clear(evcon_uring_ring *ring) {
+	munmap(ring->sqes, ring->sqes_map_size);
+	if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+	munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* publishes all prepared sqes and submits them; waits for min_complete completions */
+static void evcon_uring_enter(evcon_uring_ring *ring, unsigned int min_complete) {
+	unsigned int to_submit;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (0 == to_submit && 0 == min_complete) return;
+
+	if (-1 == syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, (0 != min_complete) ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+		case EBUSY: /* completion queue overflow; reaping completions fixes it */
+			break;
+		default:
+			evcon_uring_fatal("io_uring_enter failed");
+		}
+	}
+}
+
+static struct io_uring_sqe* evcon_uring_get_sqe(evcon_uring_ring *ring) {
+	struct io_uring_sqe *sqe;
+	unsigned int ndx;
+
+	if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		/* submission queue full: submit early */
+		evcon_uring_enter(ring, 0);
+		if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			evcon_uring_fatal("submission queue full");
+		}
+	}
+
+	ndx = ring->sq_local_tail & ring->sq_mask;
+	ring->sq_array[ndx] = ndx;
+	++ring->sq_local_tail;
+
+	sqe = &ring->sqes[ndx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static int evcon_uring_cq_ready(evcon_uring_ring *ring) {
+	return *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+/* fd watchers */
+
+static void evcon_uring_fd_mark_dirty(evcon_uring_data *data, evcon_uring_fd *w) {
+	if (w->dirty) return;
+
+	w->dirty = 1;
+	w->dirty_next = data->dirty;
+	data->dirty = w;
+}
+
+static void evcon_uring_fd_update(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_uring_data *data = (evcon_uring_data*) loop_data;
+	evcon_uring_fd *w = (evcon_uring_fd*) watcher_data;
+	unsigned int evs;
+
+	if (-1 == fd) {
+		/* delete watcher; keep the state while the kernel still references it */
+		if (NULL == w) return;
+
+		evcon_fd_set_backend_data(watcher, NULL);
+		w->watcher = NULL;
+		w->fd = -1;
+		w->events = 0;
+		if (w->polling || w->dirty) {
+			evcon_uring_fd_mark_dirty(data, w);
+		} else {
+			evcon_free(allocator, w, sizeof(*w));
+		}
+		return;
+	}
+
+	evs = 0;
+	if (0 != (events & EVCON_READ)) evs |= POLLIN | POLLRDHUP;
+	if (0 != (events & EVCON_WRITE)) evs |= POLLOUT;
+
+	if (NULL == w) {
+		/* not inline in the watcher: a poll still in flight references it after the watcher is gone */
+		w = evcon_alloc0(allocator, sizeof(evcon_uring_fd));
+		w->watcher = watcher;
+		w->poll_fd = -1;
+		evcon_fd_set_backend_data(watcher, w);
+	}
+
+	w->fd = fd;
+	w->events = evs;
+	if (evcon_fd_is_rearm(watcher)) w->rearm = 1;
+	evcon_uring_fd_mark_dirty(data, w);
+}
+
+/* queues poll requests for all dirty fd watchers; cancels polls which don't match anymore */
+static void evcon_uring_fd_flush(evcon_uring_data *data) {
+	evcon_uring_ring *ring = &data->ring;
+	struct io_uring_sqe *sqe;
+	evcon_uring_fd *w;
+
+	while (NULL != (w = data->dirty)) {
+		data->dirty = w->dirty_next;
+		w->dirty_next = NULL;
+		w->dirty = 0;
+
+		if (w->polling) {
+			if ((w->poll_fd != w->fd || w->poll_events != w->events || w->rearm) && !w->cancelling) {
+				/* poll gets restarted when the cancelled request completes */
+				sqe = evcon_uring_get_sqe(ring);
+				sqe->opcode = IORING_OP_POLL_REMOVE;
+				sqe->fd = -1;
+				sqe->addr = (uint64_t) (uintptr_t) w | EVCON_URING_TAG_POLL;
+				sqe->user_data = EVCON_URING_TAG_IGNORE;
+				w->cancelling = 1;
+			}
+			continue;
+		}
+
+		if (NULL == w->watcher) {
+			evcon_free(data->allocator, w, sizeof(*w));
+			continue;
+		}
+
+		if (-1 == w->fd || 0 == w->events) continue;
+
+		sqe = evcon_uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = w->fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		sqe->poll32_events = (w->events << 16) | (w->events >> 16);
+#else
+		sqe->poll32_events = w->events;
+#endif
+		sqe->user_data = (uint64_t) (uintptr_t) w | EVCON_URING_TAG_POLL;
+
+		w->polling = 1;
+		w->cancelling = 0;
+		w->rearm = 0;
+		w->poll_fd = w->fd;
+		w->poll_events = w->events;
+		++data->polls_inflight;
+	}
+}
+
+static void evcon_uring_fd_batch_flush(evcon_uring_data *data) {
+	unsigned int count = data->batch_count;
+
+	if (0 == count) return;
+	data->batch_count = 0;
+	evcon_feed_fd_batch(data->loop, data->batch, count);
+}
+
+static void evcon_uring_fd_complete(evcon_uring_data *data, evcon_uring_fd *w, int res) {
+	evcon_fd_event *ev;
+	int events;
+
+	w->polling = 0;
+	w->cancelling = 0;
+	--data->polls_inflight;
+
+	/* polls are oneshot: restart (or free) it on the next flush. mark it before the callback,
+	 * so deleting the watcher in a callback doesn't free the state under our feet.
+	 */
+	evcon_uring_fd_mark_dirty(data, w);
+
+	if (NULL == w->watcher || -ECANCELED == res) return;
+
+	events = 0;
+	if (res < 0) {
+		events = EVCON_ERROR;
+	} else {
+		if (0 != (res & (POLLIN | POLLRDHUP))) events |= EVCON_READ;
+		if (0 != (res & POLLOUT)) events |= EVCON_WRITE;
+		if (0 != (res & POLLHUP)) events |= EVCON_READ | EVCON_WRITE;
+		if (0 != (res & POLLERR)) events |= EVCON_ERROR | EVCON_READ | EVCON_WRITE;
+		if (0 != (res & POLLNVAL)) events |= EVCON_ERROR;
+		events &= EVCON_ERROR | evcon_fd_get_events(w->watcher);
+	}
+
+	if (0 == events) return;
+
+	/* dispatched together after reaping (or when the batch is full) */
+	ev = &data->batch[data->batch_count++];
+	ev->watcher = w->watcher;
+	ev->fd = w->poll_fd;
+	ev->events = events;
+	if (EVCON_URING_BATCH == data->batch_count) evcon_uring_fd_batch_flush(data);
+}
+
+/* timer watchers */
+
+static void evcon_uring_timer_update(evcon_timer_watcher *watcher, evcon_interval timeout, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_uring_data *data = (evcon_uring_data*) loop_data;
+	UNUSED(allocator);
+	UNUSED(watcher_data);
+
+	evcon_timer_queue_update(&data->timers, watcher, timeout);
+}
+
+/* keeps one absolute timeout request for the next timer deadline in flight */
+static void evcon_uring_timeout_flush(evcon_uring_data *data) {
+	evcon_interval deadline = evcon_timer_queue_next_deadline(&data->timers);
+	evcon_interval sec = EVCON_INTERVAL_FROM_SEC(1);
+	struct io_uring_sqe *sqe;
+
+	if (data->timeout_armed && deadline == data->timeout_deadline) return;
+
+	if (data->timeout_armed) {
+		sqe = evcon_uring_get_sqe(&data->ring);
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = (data->timeout_seq << EVCON_URING_TAG_BITS) | EVCON_URING_TAG_TIMEOUT;
+		sqe->user_data = EVCON_URING_TAG_IGNORE;
+		data->timeout_armed = 0;
+	}
+
+	if (-1 == deadline) return;
+
+	++data->timeout_seq;
+	data->timeout_deadline = deadline;
+	data->timeout_armed = 1;
+	data->timeout_ts.tv_sec = deadline / sec;
+	data->timeout_ts.tv_nsec = (long long) EVCON_INTERVAL_AS_NSEC(deadline % sec);
+
+	sqe = evcon_uring_get_sqe(&data->ring);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t) (uintptr_t) &data->timeout_ts;
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS;
+	sqe->user_data = (data->timeout_seq << EVCON_URING_TAG_BITS) | EVCON_URING_TAG_TIMEOUT;
+}
+
+/* async watchers */
+
+static void evcon_uring_async_update(evcon_async_watcher *watcher, evcon_async_func f, evcon_allocator *allocator, void *loop_data, void *watcher_data) {
+	evcon_uring_data *data = (evcon_uring_data*) loop_data;
+	evcon_uring_async *w = (evcon_uring_async*) watcher_data;
+	UNUSED(allocator);
+
+	switch (f) {
+	case EVCON_ASYNC_TRIGGER:
+		pthread_mutex_lock(&data->async_mutex);
+		if (!w->active) {
+			w->active = 1;
+			w->pending_next = NULL;
+			if (NULL == data->async_pending_tail) {
+				data->async_pending_head = data->async_pending_tail = w;
+				if (-1 == evcon_wakeup_fd_signal(&data->async_wakeup)) evcon_uring_fatal("async wake write failed");
+			} else {
+				data->async_pending_tail->pending_next = w;
+				data->async_pending_tail = w;
+			}
+		}
+		pthread_mutex_unlock(&data->async_mutex);
+		break;
+	case EVCON_ASYNC_NEW:
+		w->orig = watcher;
+		break;
+	case EVCON_ASYNC_FREE:
+		pthread_mutex_lock(&data->async_mutex);
+		if (w->active) {
+			evcon_uring_async *prev = NULL, *cur = data->async_pending_head;
+			while (cur != w) {
+				prev = cur;
+				cur = cur->pending_next;
+			}
+			if (NULL != prev) {
+				prev->pending_next = w->pending_next;
+			} else {
+				data->async_pending_head = w->pending_next;
+			}
+			if (data->async_pending_tail == w) data->async_pending_tail = prev;
+			w->active = 0;
+		}
+		pthread_mutex_unlock(&data->async_mutex);
+		return;
+	}
+}
+
+static void evcon_uring_async_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data) {
+	evcon_uring_data *data = user_data;
+	evcon_uring_async *w;
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(fd);
+	UNUSED(revents);
+
+	evcon_wakeup_fd_drain(&data->async_wakeup);
+
+	for (;;) {
+		pthread_mutex_lock(&data->async_mutex);
+		w = data->async_pending_head;
+		if (NULL != w) {
+			data->async_pending_head = w->pending_next;
+			if (NULL == data->async_pending_head) data->async_pending_tail = NULL;
+			w->pending_next = NULL;
+			w->active = 0;
+		}
+		pthread_mutex_unlock(&data->async_mutex);
+
+		if (NULL == w) break;
+
+		evcon_feed_async(w->orig);
+	}
+}
+
+/* multishot requests */
+
+static void evcon_uring_cancel(evcon_uring_data *data, uint64_t user_data) {
+	struct io_uring_sqe *sqe = evcon_uring_get_sqe(&data->ring);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = EVCON_URING_TAG_IGNORE;
+}
+
+/* acceptors: one multishot accept request per listening socket; the connections of one
+ * iteration are collected and passed to the acceptor callback together after reaping.
+ */
+
+#ifdef IORING_ACCEPT_MULTISHOT
+
+static void evcon_uring_accept_arm(evcon_uring_data *data, evcon_uring_accept *a) {
+	struct io_uring_sqe *sqe = evcon_uring_get_sqe(&data->ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = a->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = (uint64_t) (uintptr_t) a | EVCON_URING_TAG_ACCEPT;
+
+	a->armed = 1;
+	++data->multishot_inflight;
+}
+
+static void evcon_uring_accept_deliver(evcon_uring_accept *a) {
+	unsigned int count = a->count;
+
+	if (0 == count || NULL == a->acceptor) return;
+
+	/* nothing new arrives while the callback runs */
+	a->count = 0;
+	a->busy = 1;
+	evcon_feed_accept(a->acceptor, a->fds, count);
+	a->busy = 0;
+}
+
+static int evcon_uring_accept_update(evcon_acceptor *acceptor, evcon_fd fd, int start, void *loop_data) {
+	evcon_uring_data *data = (evcon_uring_data*) loop_data;
+	evcon_uring_accept *a = (evcon_uring_accept*) evcon_acceptor_get_backend_data(acceptor);
+	unsigned int i;
+
+	if (start) {
+		if (!data->ring.multishot_accept) return -1;
+
+		a = evcon_alloc0(data->allocator, sizeof(evcon_uring_accept));
+		a->acceptor = acceptor;
+		a->fd = fd;
+		evcon_acceptor_set_backend_data(acceptor, a);
+		evcon_uring_accept_arm(data, a);
+		return 0;
+	}
+
+	evcon_acceptor_set_backend_data(acceptor, NULL);
+	a->acceptor = NULL;
+	for (i = 0; i < a->count; ++i) close(a->fds[i]);
+	a->count = 0;
+
+	if (a->armed) {
+		if (!a->cancelling) {
+			evcon_uring_cancel(data, (uint64_t) (uintptr_t) a | EVCON_URING_TAG_ACCEPT);
+			a->cancelling = 1;
+		}
+	} else if (!a->pending && !a->busy) {
+		evcon_free(data->allocator, a, sizeof(*a));
+	}
+	return 0;
+}
+
+static void evcon_uring_accept_complete(evcon_uring_data *data, evcon_uring_accept *a, int res, unsigned int flags) {
+	if (0 == (flags & IORING_CQE_F_MORE)) {
+		a->armed = 0;
+		--data->multishot_inflight;
+	}
+
+	a->busy = 1;
+	if (res >= 0) {
+		if (NULL == a->acceptor) {
+			close(res);
+		} else {
+			a->fds[a->count++] = res;
+			if (EVCON_ACCEPTOR_MAX_BATCH == a->count) {
+				evcon_uring_accept_deliver(a);
+			} else if (!a->pending) {
+				a->pending = 1;
+				a->pending_next = data->accept_pending;
+				data->accept_pending = a;
+			}
+		}
+	} else if (NULL != a->acceptor && -ECANCELED != res && -EINTR != res && -EAGAIN != res && -ECONNABORTED != res) {
+		/* keep the order: connections accepted before the error first */
+		evcon_uring_accept_deliver(a);
+		if (NULL != a->acceptor) {
+			a->busy = 1;
+			errno = -res;
+			evcon_feed_accept(a->acceptor, NULL, 0);
+		}
+	}
+	a->busy = 0;
+
+	if (a->armed) return;
+
+	if (NULL == a->acceptor) {
+		if (!a->pending) evcon_free(data->allocator, a, sizeof(*a));
+	} else if (-EINVAL != res && -EBADF != res && -ENOTSOCK != res && -EOPNOTSUPP != res) {
+		/* multishot ends on errors and when the completion queue overflowed */
+		evcon_uring_accept_arm(data, a);
+	}
+}
+
+static void evcon_uring_accept_dispatch(evcon_uring_data *data) {
+	evcon_uring_accept *a;
+
+	while (NULL != (a = data->accept_pending)) {
+		data->accept_pending = a->pending_next;
+		a->pending_next = NULL;
+		a->pending = 0;
+
+		evcon_uring_accept_deliver(a);
+		if (NULL == a->acceptor && !a->armed) evcon_free(data->allocator, a, sizeof(*a));
+	}
+}
+
+#else
+
+static int evcon_uring_accept_update(evcon_acceptor *acceptor, evcon_fd fd, int start, void *loop_data) {
+	UNUSED(acceptor);
+	UNUSED(fd);
+	UNUSED(start);
+	UNUSED(loop_data);
+
+	return -1;
+}
+
+static void evcon_uring_accept_complete(evcon_uring_data *data, evcon_uring_accept *a, int res, unsigned int flags) {
+	UNUSED(data);
+	UNUSED(a);
+	UNUSED(res);
+	UNUSED(flags);
+}
+
+static void evcon_uring_accept_dispatch(evcon_uring_data *data) {
+	UNUSED(data);
+}
+
+#endif
+
+/* multishot recv into buffers of the provided buffer ring; a buffer goes back to the ring
+ * right after the callback
+ */
+
+#ifdef IORING_RECV_MULTISHOT
+
+static int evcon_uring_bufs_init(evcon_uring_data *data) {
+	size_t ring_size = EVCON_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+	void *mem;
+	int err;
+
+	/* the ring has to be page aligned; the buffers follow it */
+	mem = mmap(NULL, ring_size + EVCON_URING_BUF_COUNT * EVCON_URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mem) return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) mem;
+	reg.ring_entries = EVCON_URING_BUF_COUNT;
+	reg.bgid = EVCON_URING_BUF_GROUP;
+	if (-1 == syscall(__NR_io_uring_register, data->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		err = errno;
+		munmap(mem, ring_size + EVCON_URING_BUF_COUNT * EVCON_URING_BUF_SIZE);
+		errno = err;
+		return -1;
+	}
+
+	data->bufs = (struct io_uring_buf_ring*) mem;
+	data->buf_mem = (char*) mem + ring_size;
+	data->buf_tail = 0;
+	for (i = 0; i < EVCON_URING_BUF_COUNT; ++i) {
+		struct io_uring_buf *buf = &data->bufs->bufs[i];
+		buf->addr = (uint64_t) (uintptr_t) (data->buf_mem + i * EVCON_URING_BUF_SIZE);
+		buf->len = EVCON_URING_BUF_SIZE;
+		buf->bid = i;
+	}
+	data->buf_tail = EVCON_URING_BUF_COUNT;
+	__atomic_store_n(&data->bufs->tail, data->buf_tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void evcon_uring_bufs_clear(evcon_uring_data *data) {
+	size_t ring_size = EVCON_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+
+	if (NULL == data->bufs) return;
+
+	/* closing the ring unregisters it too, but the ring might outlive the memory otherwise */
+	{
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = EVCON_URING_BUF_GROUP;
+		syscall(__NR_io_uring_register, data->ring.fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	}
+	munmap(data->bufs, ring_size + EVCON_URING_BUF_COUNT * EVCON_URING_BUF_SIZE);
+	data->bufs = NULL;
+	data->buf_mem = NULL;
+}
+
+static void evcon_uring_buf_recycle(evcon_uring_data *data, unsigned int bid) {
+	struct io_uring_buf *buf = &data->bufs->bufs[data->buf_tail & (EVCON_URING_BUF_COUNT - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (data->buf_mem + bid * EVCON_URING_BUF_SIZE);
+	buf->len = EVCON_URING_BUF_SIZE;
+	buf->bid = bid;
+	++data->buf_tail;
+	__atomic_store_n(&data->bufs->tail, data->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void evcon_uring_recv_arm(evcon_uring_data *data, evcon_uring_recv *r) {
+	struct io_uring_sqe *sqe = evcon_uring_get_sqe(&data->ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = r->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = EVCON_URING_BUF_GROUP;
+	sqe->user_data = (uint64_t) (uintptr_t) r | EVCON_URING_TAG_RECV;
+
+	r->armed = 1;
+	++data->multishot_inflight;
+}
+
+static void evcon_uring_recv_complete(evcon_uring_data *data, evcon_uring_recv *r, int res, unsigned int flags) {
+	const char *buf = NULL;
+
+	if (0 == (flags & IORING_CQE_F_MORE)) {
+		r->armed = 0;
+		--data->multishot_inflight;
+	}
+	if (0 != (flags & IORING_CQE_F_BUFFER)) {
+		buf = data->buf_mem + (flags >> IORING_CQE_BUFFER_SHIFT) * EVCON_URING_BUF_SIZE;
+	}
+
+	if (!r->freed && !r->stopped && -ECANCELED != res && -ENOBUFS != res) {
+		/* EOF and errors end receiving */
+		if (res <= 0) r->stopped = 1;
+
+		r->incallback = 1;
+		r->cb(r->loop, r, (res > 0) ? buf : NULL, res, r->user_data);
+		r->incallback = 0;
+	}
+
+	if (NULL != buf) evcon_uring_buf_recycle(data, flags >> IORING_CQE_BUFFER_SHIFT);
+
+	if (r->delayed_delete) {
+		r->delayed_delete = 0;
+		evcon_uring_recv_free(r);
+		return;
+	}
+
+	if (r->armed) return;
+
+	if (r->freed) {
+		evcon_free(data->allocator, r, sizeof(*r));
+	} else if (!r->stopped) {
+		/* out of buffers (they are back now) or the completion queue overflowed */
+		evcon_uring_recv_arm(data, r);
+	}
+}
+
+evcon_uring_recv* evcon_uring_recv_new(evcon_loop *loop, evcon_fd fd, evcon_uring_recv_cb cb, void *user_data) {
+	evcon_uring_data *data = (evcon_uring_data*) evcon_loop_get_backend_data(loop);
+	evcon_uring_recv *r;
+
+	if (!data->ring.multishot_recv) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	if (NULL == data->bufs && -1 == evcon_uring_bufs_init(data)) return NULL;
+
+	r = evcon_alloc0(data->allocator, sizeof(evcon_uring_recv));
+	evcon_loop_ref(loop);
+	r->loop = loop;
+	r->data = data;
+	r->fd = fd;
+	r->cb = cb;
+	r->user_data = user_data;
+	evcon_uring_recv_arm(data, r);
+	return r;
+}
+
+void evcon_uring_recv_free(evcon_uring_recv *r) {
+	evcon_uring_data *data = r->data;
+	evcon_loop *loop = r->loop;
+
+	if (r->incallback) {
+		r->delayed_delete = 1;
+		return;
+	}
+	if (r->freed) return;
+
+	/* the state stays until the request is gone */
+	r->freed = 1;
+	r->loop = NULL;
+	if (r->armed) {
+		if (!r->cancelling) {
+			evcon_uring_cancel(data, (uint64_t) (uintptr_t) r | EVCON_URING_TAG_RECV);
+			r->cancelling = 1;
+		}
+	} else {
+		evcon_free(data->allocator, r, sizeof(*r));
+	}
+	evcon_loop_unref(loop);
+}
+
+#else
+
+static void evcon_uring_bufs_clear(evcon_uring_data *data) {
+	UNUSED(data);
+}
+
+static void evcon_uring_recv_complete(evcon_uring_data *data, evcon_uring_recv *r, int res, unsigned int flags) {
+	UNUSED(data);
+	UNUSED(r);
+	UNUSED(res);
+	UNUSED(flags);
+}
+
+evcon_uring_recv* evcon_uring_recv_new(evcon_loop *loop, evcon_fd fd, evcon_uring_recv_cb cb, void *user_data) {
+	UNUSED(loop);
+	UNUSED(fd);
+	UNUSED(cb);
+	UNUSED(user_data);
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+void evcon_uring_recv_free(evcon_uring_recv *r) {
+	UNUSED(r);
+}
+
+#endif
+
+/* main loop */
+
+static void evcon_uring_reap(evcon_uring_data *data) {
+	evcon_uring_ring *ring = &data->ring;
+	unsigned int head = *ring->cq_head;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		uint64_t user_data = cqe->user_data;
+		int res = cqe->res;
+		unsigned int flags = cqe->flags;
+
+		/* release the slot before running callbacks */
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+		switch (user_data & EVCON_URING_TAG_MASK) {
+		case EVCON_URING_TAG_POLL:
+			evcon_uring_fd_complete(data, (evcon_uring_fd*) (uintptr_t) (user_data & ~EVCON_URING_TAG_MASK), res);
+			break;
+		case EVCON_URING_TAG_ACCEPT:
+			evcon_uring_accept_complete(data, (evcon_uring_accept*) (uintptr_t) (user_data & ~EVCON_URING_TAG_MASK), res, flags);
+			break;
+		case EVCON_URING_TAG_RECV:
+			evcon_uring_recv_complete(data, (evcon_uring_recv*) (uintptr_t) (user_data & ~EVCON_URING_TAG_MASK), res, flags);
+			break;
+		case EVCON_URING_TAG_TIMEOUT:
+			if ((user_data >> EVCON_URING_TAG_BITS) == data->timeout_seq) data->timeout_armed = 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	evcon_uring_fd_batch_flush(data);
+}
+
+static void evcon_uring_loop_iteration(evcon_uring_data *data, int block) {
+	evcon_uring_fd_flush(data);
+	evcon_uring_timeout_flush(data);
+
+	if (block && (evcon_uring_cq_ready(&data->ring) || 0 == evcon_timer_queue_next_timeout(&data->timers))) block = 0;
+
+	/* submits all queued requests and waits in one syscall */
+	evcon_uring_enter(&data->ring, block ? 1 : 0);
+
+	/* batch end hooks run once, after all callbacks */
+	evcon_loop_batch_begin(data->loop);
+	evcon_uring_reap(data);
+	evcon_uring_accept_dispatch(data);
+	evcon_timer_queue_dispatch(&data->timers);
+	evcon_loop_batch_end(data->loop);
+}
+
+void evcon_loop_uring_run(evcon_loop *loop, int flags) {
+	evcon_uring_data *data = (evcon_uring_data*) evcon_loop_get_backend_data(loop);
+
+	data->loop_break = 0;
+	do {
+		evcon_uring_loop_iteration(data, 0 == (flags & EVCON_URING_RUN_NOWAIT));
+	} while (!data->loop_break && 0 == (flags & (EVCON_URING_RUN_ONCE | EVCON_URING_RUN_NOWAIT)));
+}
+
+void evcon_loop_uring_break(evcon_loop *loop) {
+	evcon_uring_data *data = (evcon_uring_data*) evcon_loop_get_backend_data(loop);
+	data->loop_break = 1;
+}
+
+static void evcon_uring_free_loop(evcon_loop *loop, void *loop_data, void *backend_data) {
+	evcon_uring_data *data = (evcon_uring_data*) loop_data;
+	evcon_allocator *allocator = data->allocator;
+	UNUSED(backend_data);
+
+	evcon_loop_ref(loop);
+	evcon_fd_free(data->async_watcher);
+
+	/* cancel remaining polls and wait for them (and cancelled multishot requests), they still reference their states */
+	evcon_uring_fd_flush(data);
+	while (data->polls_inflight > 0 || data->multishot_inflight > 0) {
+		evcon_uring_enter(&data->ring, 1);
+		evcon_uring_reap(data);
+		evcon_uring_accept_dispatch(data);
+		evcon_uring_fd_flush(data);
+	}
+
+	evcon_uring_bufs_clear(data);
+	evcon_uring_ring_clear(&data->ring);
+	evcon_wakeup_fd_clear(&data->async_wakeup);
+
+	pthread_mutex_destroy(&data->async_mutex);
+	evcon_timer_queue_clear(&data->timers);
+	evcon_free(allocator, data, sizeof(evcon_uring_data));
+}
+
+static char static_backend_buf[EVCON_BACKEND_RECOMMENDED_SIZE];
+static evcon_backend* static_backend = NULL;
+static pthread_once_t static_backend_once = PTHREAD_ONCE_INIT;
+
+static void evcon_uring_backend_init(void) {
+	static_backend = evcon_backend_init(static_backend_buf, sizeof(static_backend_buf), NULL, NULL, evcon_uring_free_loop, evcon_uring_fd_update, evcon_uring_timer_update, evcon_uring_async_update);
+	/* async state lives in the evcon watcher; fd state is allocated separately (see evcon_uring_fd_update) */
+	evcon_backend_set_watcher_data_sizes(static_backend, 0, 0, sizeof(evcon_uring_async));
+	evcon_backend_set_accept(static_backend, evcon_uring_accept_update);
+}
+
+static evcon_backend* evcon_uring_backend(void) {
+	pthread_once(&static_backend_once, evcon_uring_backend_init);
+	return static_backend;
+}
+
+evcon_loop* evcon_loop_new_uring(evcon_allocator *allocator) {
+	evcon_backend *backend;
+	evcon_uring_data *loop_data;
+	evcon_loop *evc_loop;
+	evcon_wakeup_fd async_wakeup;
+
+	loop_data = evcon_alloc0(allocator, sizeof(evcon_uring_data));
+	if (-1 == evcon_uring_ring_init(&loop_data->ring, allocator)) {
+		int err = errno;
+		evcon_free(allocator, loop_data, sizeof(evcon_uring_data));
+		errno = err;
+		return NULL;
+	}
+	if (-1 == evcon_wakeup_fd_init(&async_wakeup)) {
+		int err = errno;
+		evcon_uring_ring_clear(&loop_data->ring);
+		evcon_free(allocator, loop_data, sizeof(evcon_uring_data));
+		errno = err;
+		return NULL;
+	}
+
+	backend = evcon_uring_backend();
+	evc_loop = evcon_loop_new(backend, allocator);
+
+	loop_data->allocator = allocator;
+	loop_data->loop = evc_loop;
+	evcon_timer_queue_init(&loop_data->timers, allocator);
+	loop_data->async_wakeup = async_wakeup;
+	pthread_mutex_init(&loop_data->async_mutex, NULL);
+	evcon_loop_set_backend_data(evc_loop, loop_data);
+
+	loop_data->async_watcher = evcon_fd_new(evc_loop, evcon_uring_async_cb, async_wakeup.read_fd, EVCON_READ, loop_data);
+	evcon_fd_start(loop_data->async_watcher);
+	evcon_loop_unref(evc_loop);
+
+	return evc_loop;
+}
@@ -0,0 +1,67 @@
+#include "evcon-bench.h"
+
+#include <evcon-epoll.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+static evcon_loop* bench_epoll_loop_new(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+
+	if (NULL == loop) {
+		fprintf(stderr, "evcon_loop_new_epoll() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	return loop;
+}
+
+static void bench_epoll_loop_run_once(evcon_loop *loop) {
+	evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+}
+
+static void bench_epoll_loop_free(evcon_loop *loop) {
+	evcon_loop_unref(loop);
+}
+
+static void bench_epoll_raw_fd_dispatch(int (*pairs)[2], int npairs, long events) {
+	struct epoll_event evs[64];
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	long count = 0;
+	int i;
+
+	for (i = 0; i < npairs; i++) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pairs[i][0], &ev);
+	}
+
+	while (count < events) {
+		int n = epoll_wait(epoll_fd, evs, 64, -1);
+		for (i = 0; i < n; i++) {
+			int *pair = pairs[evs[i].data.u32];
+			char c;
+			if (1 == read(pair[0], &c, 1) && 1 != write(pair[1], &c, 1)) abort();
+			count++;
+		}
+	}
+
+	close(epoll_fd);
+}
+
+static const evcon_bench_backend bench_epoll = {
+	"epoll",
+	bench_epoll_loop_new,
+	bench_epoll_loop_run_once,
+	bench_epoll_loop_free,
+	bench_epoll_raw_fd_dispatch
+};
+
+int main(int argc, char **argv) {
+	return evcon_bench_main(argc, argv, &bench_epoll);
+}
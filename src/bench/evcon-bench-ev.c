@@ -0,0 +1,69 @@
+#include "evcon-bench.h"
+
+#include <evcon-ev.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static struct ev_loop *bench_ev_loop;
+
+static evcon_loop* bench_ev_loop_new(void) {
+	bench_ev_loop = ev_loop_new(0);
+	return evcon_loop_from_ev(bench_ev_loop, NULL);
+}
+
+static void bench_ev_loop_run_once(evcon_loop *loop) {
+	UNUSED(loop);
+	ev_run(bench_ev_loop, EVRUN_ONCE);
+}
+
+static void bench_ev_loop_free(evcon_loop *loop) {
+	evcon_loop_unref(loop);
+	ev_loop_destroy(bench_ev_loop);
+	bench_ev_loop = NULL;
+}
+
+static long raw_count;
+
+static void bench_ev_raw_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	int *pair = w->data;
+	char c;
+	UNUSED(loop);
+	UNUSED(revents);
+
+	if (1 == read(pair[0], &c, 1) && 1 != write(pair[1], &c, 1)) abort();
+	raw_count++;
+}
+
+static void bench_ev_raw_fd_dispatch(int (*pairs)[2], int npairs, long events) {
+	struct ev_loop *loop = ev_loop_new(0);
+	ev_io *watchers = calloc(npairs, sizeof(ev_io));
+	int i;
+
+	for (i = 0; i < npairs; i++) {
+		ev_io_init(&watchers[i], bench_ev_raw_cb, pairs[i][0], EV_READ);
+		watchers[i].data = pairs[i];
+		ev_io_start(loop, &watchers[i]);
+	}
+
+	raw_count = 0;
+	while (raw_count < events) ev_run(loop, EVRUN_ONCE);
+
+	for (i = 0; i < npairs; i++) ev_io_stop(loop, &watchers[i]);
+	free(watchers);
+	ev_loop_destroy(loop);
+}
+
+static const evcon_bench_backend bench_ev = {
+	"ev",
+	bench_ev_loop_new,
+	bench_ev_loop_run_once,
+	bench_ev_loop_free,
+	bench_ev_raw_fd_dispatch
+};
+
+int main(int argc, char **argv) {
+	return evcon_bench_main(argc, argv, &bench_ev);
+}
@@ -0,0 +1,72 @@
+#include "evcon-bench.h"
+
+#include <evcon-event.h>
+
+#include <event2/thread.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static struct event_base *bench_event_base;
+
+static evcon_loop* bench_event_loop_new(void) {
+	bench_event_base = event_base_new();
+	return evcon_loop_from_event(bench_event_base, NULL);
+}
+
+static void bench_event_loop_run_once(evcon_loop *loop) {
+	UNUSED(loop);
+	event_base_loop(bench_event_base, EVLOOP_ONCE);
+}
+
+static void bench_event_loop_free(evcon_loop *loop) {
+	evcon_loop_unref(loop);
+	event_base_free(bench_event_base);
+	bench_event_base = NULL;
+}
+
+static long raw_count;
+
+static void bench_event_raw_cb(evutil_socket_t fd, short revents, void *user_data) {
+	int *pair = user_data;
+	char c;
+	UNUSED(revents);
+
+	if (1 == read(fd, &c, 1) && 1 != write(pair[1], &c, 1)) abort();
+	raw_count++;
+}
+
+static void bench_event_raw_fd_dispatch(int (*pairs)[2], int npairs, long events) {
+	struct event_base *base = event_base_new();
+	struct event **watchers = calloc(npairs, sizeof(struct event*));
+	int i;
+
+	for (i = 0; i < npairs; i++) {
+		watchers[i] = event_new(base, pairs[i][0], EV_READ | EV_PERSIST, bench_event_raw_cb, pairs[i]);
+		event_add(watchers[i], NULL);
+	}
+
+	raw_count = 0;
+	while (raw_count < events) event_base_loop(base, EVLOOP_ONCE);
+
+	for (i = 0; i < npairs; i++) event_free(watchers[i]);
+	free(watchers);
+	event_base_free(base);
+}
+
+static const evcon_bench_backend bench_event = {
+	"event",
+	bench_event_loop_new,
+	bench_event_loop_run_once,
+	bench_event_loop_free,
+	bench_event_raw_fd_dispatch
+};
+
+int main(int argc, char **argv) {
+	/* async watchers are triggered from other threads */
+	evthread_use_pthreads();
+
+	return evcon_bench_main(argc, argv, &bench_event);
+}
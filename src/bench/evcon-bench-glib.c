@@ -0,0 +1,76 @@
+#include "evcon-bench.h"
+
+#include <evcon-glib.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static GMainContext *bench_glib_ctx;
+
+static evcon_loop* bench_glib_loop_new(void) {
+	bench_glib_ctx = g_main_context_new();
+	return evcon_loop_from_glib(bench_glib_ctx, NULL);
+}
+
+static void bench_glib_loop_run_once(evcon_loop *loop) {
+	UNUSED(loop);
+	g_main_context_iteration(bench_glib_ctx, TRUE);
+}
+
+static void bench_glib_loop_free(evcon_loop *loop) {
+	evcon_loop_unref(loop);
+	g_main_context_unref(bench_glib_ctx);
+	bench_glib_ctx = NULL;
+}
+
+static long raw_count;
+
+static gboolean bench_glib_raw_cb(GIOChannel *source, GIOCondition condition, gpointer data) {
+	int *pair = data;
+	char c;
+	UNUSED(source);
+	UNUSED(condition);
+
+	if (1 == read(pair[0], &c, 1) && 1 != write(pair[1], &c, 1)) abort();
+	raw_count++;
+
+	return TRUE;
+}
+
+static void bench_glib_raw_fd_dispatch(int (*pairs)[2], int npairs, long events) {
+	GMainContext *ctx = g_main_context_new();
+	GSource **sources = g_new0(GSource*, npairs);
+	int i;
+
+	for (i = 0; i < npairs; i++) {
+		GIOChannel *channel = g_io_channel_unix_new(pairs[i][0]);
+		sources[i] = g_io_create_watch(channel, G_IO_IN);
+		g_source_set_callback(sources[i], (GSourceFunc) bench_glib_raw_cb, pairs[i], NULL);
+		g_source_attach(sources[i], ctx);
+		g_io_channel_unref(channel);
+	}
+
+	raw_count = 0;
+	while (raw_count < events) g_main_context_iteration(ctx, TRUE);
+
+	for (i = 0; i < npairs; i++) {
+		g_source_destroy(sources[i]);
+		g_source_unref(sources[i]);
+	}
+	g_free(sources);
+	g_main_context_unref(ctx);
+}
+
+static const evcon_bench_backend bench_glib = {
+	"glib",
+	bench_glib_loop_new,
+	bench_glib_loop_run_once,
+	bench_glib_loop_free,
+	bench_glib_raw_fd_dispatch
+};
+
+int main(int argc, char **argv) {
+	return evcon_bench_main(argc, argv, &bench_glib);
+}
@@ -0,0 +1,84 @@
+#include "evcon-bench.h"
+
+#include <evcon-qt.h>
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QEventLoop>
+#include <QSocketNotifier>
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static evcon_loop* bench_qt_loop_new(void) {
+	evcon_loop *loop = evcon_loop_new_qt(NULL);
+
+	if (NULL == loop) {
+		fprintf(stderr, "evcon_loop_new_qt() failed: no event dispatcher\n");
+		exit(1);
+	}
+	return loop;
+}
+
+static void bench_qt_loop_run_once(evcon_loop *loop) {
+	UNUSED(loop);
+	QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+}
+
+static void bench_qt_loop_free(evcon_loop *loop) {
+	evcon_loop_unref(loop);
+}
+
+static long raw_count;
+
+/* no signals or slots (and no moc), like the backend: the notifier handles its activation directly */
+class bench_qt_raw_notifier : public QSocketNotifier {
+public:
+	explicit bench_qt_raw_notifier(int *fd_pair)
+	: QSocketNotifier(fd_pair[0], QSocketNotifier::Read), pair(fd_pair) { }
+
+protected:
+	virtual bool event(QEvent *e) {
+		char c;
+
+		if (QEvent::SockAct != e->type()) return QSocketNotifier::event(e);
+
+		if (1 == read(pair[0], &c, 1) && 1 != write(pair[1], &c, 1)) abort();
+		raw_count++;
+		return true;
+	}
+
+private:
+	int *pair;
+};
+
+static void bench_qt_raw_fd_dispatch(int (*pairs)[2], int npairs, long events) {
+	bench_qt_raw_notifier **notifiers = new bench_qt_raw_notifier*[npairs];
+	int i;
+
+	for (i = 0; i < npairs; i++) notifiers[i] = new bench_qt_raw_notifier(pairs[i]);
+
+	raw_count = 0;
+	while (raw_count < events) QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+
+	for (i = 0; i < npairs; i++) delete notifiers[i];
+	delete[] notifiers;
+}
+
+static const evcon_bench_backend bench_qt = {
+	"qt",
+	bench_qt_loop_new,
+	bench_qt_loop_run_once,
+	bench_qt_loop_free,
+	bench_qt_raw_fd_dispatch
+};
+
+int main(int argc, char **argv) {
+	/* the loops need the event dispatcher of the application */
+	QCoreApplication app(argc, argv);
+
+	return evcon_bench_main(argc, argv, &bench_qt);
+}
@@ -0,0 +1,135 @@
+#include "evcon-bench.h"
+
+#include <evcon-uring.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+/* same ring setup as the backend */
+#define BENCH_URING_SQ_ENTRIES 256
+#define BENCH_URING_CQ_ENTRIES 4096
+
+static evcon_loop* bench_uring_loop_new(void) {
+	evcon_loop *loop = evcon_loop_new_uring(NULL);
+
+	if (NULL == loop) {
+		fprintf(stderr, "evcon_loop_new_uring() failed: %s\n", strerror(errno));
+		exit(ENOSYS == errno ? 77 : 1); /* 77: skipped */
+	}
+	return loop;
+}
+
+static void bench_uring_loop_run_once(evcon_loop *loop) {
+	evcon_loop_uring_run(loop, EVCON_URING_RUN_ONCE);
+}
+
+static void bench_uring_loop_free(evcon_loop *loop) {
+	evcon_loop_unref(loop);
+}
+
+/* one oneshot POLL_ADD per pair, re-submitted after each completion (like the backend does) */
+static void bench_uring_raw_fd_dispatch(int (*pairs)[2], int npairs, long events) {
+	struct io_uring_params p;
+	unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_local_tail;
+	unsigned int *cq_head, *cq_tail, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	size_t sq_map_size, cq_map_size, sqes_map_size;
+	char *sq_map, *cq_map;
+	unsigned int to_submit;
+	long count = 0;
+	int ring_fd, i;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = BENCH_URING_CQ_ENTRIES;
+	if (-1 == (ring_fd = syscall(__NR_io_uring_setup, BENCH_URING_SQ_ENTRIES, &p))) abort();
+
+	sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (0 != (p.features & IORING_FEAT_SINGLE_MMAP) && cq_map_size > sq_map_size) sq_map_size = cq_map_size;
+	sq_map = mmap(NULL, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == sq_map) abort();
+	if (0 != (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq_map = sq_map;
+	} else {
+		cq_map = mmap(NULL, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == cq_map) abort();
+	}
+	sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (MAP_FAILED == (void*) sqes) abort();
+
+	sq_head = (unsigned int*) (sq_map + p.sq_off.head);
+	sq_tail = (unsigned int*) (sq_map + p.sq_off.tail);
+	sq_array = (unsigned int*) (sq_map + p.sq_off.array);
+	sq_mask = *(unsigned int*) (sq_map + p.sq_off.ring_mask);
+	sq_local_tail = *sq_tail;
+	cq_head = (unsigned int*) (cq_map + p.cq_off.head);
+	cq_tail = (unsigned int*) (cq_map + p.cq_off.tail);
+	cq_mask = *(unsigned int*) (cq_map + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*) (cq_map + p.cq_off.cqes);
+
+#define BENCH_URING_POLL(ndx) do { \
+		unsigned int sq_ndx = sq_local_tail++ & sq_mask; \
+		struct io_uring_sqe *sqe = &sqes[sq_ndx]; \
+		memset(sqe, 0, sizeof(*sqe)); \
+		sqe->opcode = IORING_OP_POLL_ADD; \
+		sqe->fd = pairs[ndx][0]; \
+		sqe->poll32_events = htole32(POLLIN); \
+		sqe->user_data = (ndx); \
+		sq_array[sq_ndx] = sq_ndx; \
+	} while (0)
+
+	/* npairs stays far below the sq size, and each completion queues one sqe */
+	for (i = 0; i < npairs; i++) BENCH_URING_POLL(i);
+
+	while (count < events) {
+		unsigned int head, tail;
+
+		__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+		to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (-1 == syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) && EINTR != errno) abort();
+
+		head = *cq_head;
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+			int ndx = (int) cqe->user_data;
+			char c;
+			if (cqe->res < 0) abort();
+			if (1 == read(pairs[ndx][0], &c, 1) && 1 != write(pairs[ndx][1], &c, 1)) abort();
+			count++;
+			BENCH_URING_POLL(ndx);
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+
+#undef BENCH_URING_POLL
+
+	munmap(sqes, sqes_map_size);
+	if (cq_map != sq_map) munmap(cq_map, cq_map_size);
+	munmap(sq_map, sq_map_size);
+	close(ring_fd);
+}
+
+static const evcon_bench_backend bench_uring = {
+	"uring",
+	bench_uring_loop_new,
+	bench_uring_loop_run_once,
+	bench_uring_loop_free,
+	bench_uring_raw_fd_dispatch
+};
+
+int main(int argc, char **argv) {
+	return evcon_bench_main(argc, argv, &bench_uring);
+}
@@ -0,0 +1,298 @@
+#include "evcon-bench.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static const evcon_bench_backend *bench_backend;
+static double bench_scale = 1.0;
+
+static long bench_count(long n) {
+	long c = (long) (n * bench_scale);
+	return (c < 1) ? 1 : c;
+}
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_report(const char *name, double ops, double secs, const char *unit, const char *extra) {
+	printf("%-8s %-20s %14.0f %-10s %s\n", bench_backend->name, name, ops / secs, unit, (NULL != extra) ? extra : "");
+	fflush(stdout);
+}
+
+static void bench_fatal(const char *msg) {
+	fprintf(stderr, "evcon-bench: %s: %s\n", msg, strerror(errno));
+	exit(1);
+}
+
+static int (*bench_pairs_new(int npairs))[2] {
+	int (*pairs)[2] = calloc(npairs, sizeof(*pairs));
+	int i;
+
+	if (NULL == pairs) bench_fatal("calloc failed");
+	for (i = 0; i < npairs; i++) {
+		if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i])) bench_fatal("socketpair failed");
+		evcon_init_fd(pairs[i][0]);
+		evcon_init_fd(pairs[i][1]);
+	}
+
+	return pairs;
+}
+
+static void bench_pairs_free(int (*pairs)[2], int npairs) {
+	int i;
+
+	for (i = 0; i < npairs; i++) {
+		close(pairs[i][0]);
+		close(pairs[i][1]);
+	}
+	free(pairs);
+}
+
+/* a loop iteration that doesn't block: wake ourself up first */
+
+static void bench_nop_async_cb(evcon_loop *loop, evcon_async_watcher *watcher, void *user_data) {
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(user_data);
+}
+
+static void bench_run_nowait(evcon_loop *loop, evcon_async_watcher *kick) {
+	evcon_async_wakeup(kick);
+	bench_backend->loop_run_once(loop);
+}
+
+/* fd watcher create/start/stop/free */
+
+static void bench_fd_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(fd);
+	UNUSED(revents);
+	UNUSED(user_data);
+}
+
+static void bench_fd_churn(int pool) {
+	evcon_loop *loop = bench_backend->loop_new();
+	long i, n = bench_count(200000);
+	int (*pairs)[2] = bench_pairs_new(1);
+	double start;
+
+	if (pool) evcon_loop_enable_pool(loop);
+
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		evcon_fd_watcher *w = evcon_fd_new(loop, bench_fd_cb, pairs[0][0], EVCON_READ, NULL);
+		evcon_fd_start(w);
+		evcon_fd_stop(w);
+		evcon_fd_free(w);
+	}
+	bench_report(pool ? "fd-churn-pool" : "fd-churn", n, bench_now() - start, "cycles/s", NULL);
+
+	bench_backend->loop_free(loop);
+	bench_pairs_free(pairs, 1);
+}
+
+/* events dispatched over N socketpairs, each one always readable */
+
+typedef struct {
+	int (*pairs)[2];
+	long count;
+} bench_dispatch_state;
+
+static bench_dispatch_state dispatch_state;
+
+static void bench_dispatch_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	int *pair = user_data;
+	char c;
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(revents);
+
+	if (1 == read(fd, &c, 1) && 1 != write(pair[1], &c, 1)) bench_fatal("write failed");
+	dispatch_state.count++;
+}
+
+static void bench_fd_dispatch(int npairs) {
+	long events = bench_count(2000000);
+	evcon_fd_watcher **watchers = calloc(npairs, sizeof(evcon_fd_watcher*));
+	evcon_loop *loop = bench_backend->loop_new();
+	char name[32], extra[64] = "";
+	double start, secs;
+	int i;
+
+	dispatch_state.pairs = bench_pairs_new(npairs);
+	dispatch_state.count = 0;
+	for (i = 0; i < npairs; i++) {
+		watchers[i] = evcon_fd_new(loop, bench_dispatch_cb, dispatch_state.pairs[i][0], EVCON_READ, dispatch_state.pairs[i]);
+		evcon_fd_start(watchers[i]);
+		if (1 != write(dispatch_state.pairs[i][1], "x", 1)) bench_fatal("write failed");
+	}
+
+	start = bench_now();
+	while (dispatch_state.count < events) bench_backend->loop_run_once(loop);
+	secs = bench_now() - start;
+
+	for (i = 0; i < npairs; i++) evcon_fd_free(watchers[i]);
+	free(watchers);
+	bench_backend->loop_free(loop);
+	bench_pairs_free(dispatch_state.pairs, npairs);
+
+	if (NULL != bench_backend->raw_fd_dispatch) {
+		int (*pairs)[2] = bench_pairs_new(npairs);
+		double raw_start, raw_secs;
+
+		for (i = 0; i < npairs; i++) {
+			if (1 != write(pairs[i][1], "x", 1)) bench_fatal("write failed");
+		}
+
+		raw_start = bench_now();
+		bench_backend->raw_fd_dispatch(pairs, npairs, events);
+		raw_secs = bench_now() - raw_start;
+
+		bench_pairs_free(pairs, npairs);
+
+		snprintf(extra, sizeof(extra), "(raw %.0f/s, evcon overhead %+.1f%%)", events / raw_secs, 100. * (secs / raw_secs - 1.));
+	}
+
+	snprintf(name, sizeof(name), "fd-dispatch-%i", npairs);
+	bench_report(name, dispatch_state.count, secs, "events/s", extra);
+}
+
+/* restarting active timers (idle timeouts) */
+
+static void bench_timer_cb(evcon_loop *loop, evcon_timer_watcher *watcher, void *user_data) {
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(user_data);
+}
+
+static void bench_timer_rearm(int wheel) {
+	long i, ntimers = bench_count(100000), rounds = 10, r;
+	evcon_timer_watcher **timers = calloc(ntimers, sizeof(evcon_timer_watcher*));
+	evcon_loop *loop = bench_backend->loop_new();
+	evcon_async_watcher *kick;
+	double start;
+
+	if (wheel) evcon_loop_enable_timer_wheel(loop, EVCON_INTERVAL_FROM_MSEC(1));
+	kick = evcon_async_new(loop, bench_nop_async_cb, NULL);
+
+	/* far enough in the future not to trigger during the benchmark */
+	for (i = 0; i < ntimers; i++) {
+		timers[i] = evcon_timer_new(loop, bench_timer_cb, NULL);
+		evcon_timer_once(timers[i], EVCON_INTERVAL_FROM_SEC(60) + i % 1000);
+	}
+	bench_run_nowait(loop, kick);
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < ntimers; i++) {
+			evcon_timer_once(timers[i], EVCON_INTERVAL_FROM_SEC(60) + (i * 7 + r) % 1000);
+		}
+		/* backends might defer work to the next iteration */
+		bench_run_nowait(loop, kick);
+	}
+	bench_report(wheel ? "timer-rearm-wheel" : "timer-rearm", ntimers * rounds, bench_now() - start, "rearms/s", NULL);
+
+	for (i = 0; i < ntimers; i++) evcon_timer_free(timers[i]);
+	free(timers);
+	evcon_async_free(kick);
+	bench_backend->loop_free(loop);
+}
+
+/* async wakeups from M threads */
+
+typedef struct {
+	evcon_async_watcher *watcher;
+	long wakeups;
+	pthread_t thread;
+} bench_async_thread;
+
+static volatile int async_threads_done;
+static long async_callbacks;
+
+static void bench_async_cb(evcon_loop *loop, evcon_async_watcher *watcher, void *user_data) {
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(user_data);
+
+	async_callbacks++;
+}
+
+static void* bench_async_thread_run(void *arg) {
+	bench_async_thread *t = arg;
+	long i;
+
+	for (i = 0; i < t->wakeups; i++) evcon_async_wakeup(t->watcher);
+
+	__sync_add_and_fetch(&async_threads_done, 1);
+	evcon_async_wakeup(t->watcher); /* make sure the loop sees the final count */
+	return NULL;
+}
+
+static void bench_async_fanin(int nthreads) {
+	bench_async_thread *threads = calloc(nthreads, sizeof(bench_async_thread));
+	evcon_loop *loop = bench_backend->loop_new();
+	long wakeups = bench_count(500000);
+	char name[32], extra[64];
+	double start;
+	int i;
+
+	async_threads_done = 0;
+	async_callbacks = 0;
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].watcher = evcon_async_new(loop, bench_async_cb, NULL);
+		threads[i].wakeups = wakeups;
+	}
+
+	start = bench_now();
+	for (i = 0; i < nthreads; i++) {
+		if (0 != (errno = pthread_create(&threads[i].thread, NULL, bench_async_thread_run, &threads[i]))) bench_fatal("pthread_create failed");
+	}
+	while (__sync_add_and_fetch(&async_threads_done, 0) < nthreads) bench_backend->loop_run_once(loop);
+
+	snprintf(name, sizeof(name), "async-fanin-%i", nthreads);
+	snprintf(extra, sizeof(extra), "(%ld callbacks)", async_callbacks);
+	bench_report(name, (double) wakeups * nthreads, bench_now() - start, "wakeups/s", extra);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		evcon_async_free(threads[i].watcher);
+	}
+	free(threads);
+	bench_backend->loop_free(loop);
+}
+
+int evcon_bench_main(int argc, char **argv, const evcon_bench_backend *backend) {
+	bench_backend = backend;
+
+	if (argc > 1) {
+		bench_scale = atof(argv[1]);
+		if (bench_scale <= 0) {
+			fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench_fd_churn(0);
+	bench_fd_churn(1);
+	bench_fd_dispatch(1);
+	bench_fd_dispatch(100);
+	bench_timer_rearm(0);
+	bench_timer_rearm(1);
+	bench_async_fanin(1);
+	bench_async_fanin(4);
+
+	return 0;
+}
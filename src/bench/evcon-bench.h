@@ -0,0 +1,39 @@
+#ifndef __EVCON_BENCH_H
+#define __EVCON_BENCH_H __EVCON_BENCH_H
+
+#include <evcon.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* backend adapter for the benchmarks (one evcon-bench-<backend>.c per backend).
+ * only one loop exists at a time, so adapters may keep the wrapped loop in a static variable.
+ */
+
+typedef struct evcon_bench_backend evcon_bench_backend;
+
+struct evcon_bench_backend {
+	const char *name;
+
+	evcon_loop* (*loop_new)(void);
+	void (*loop_run_once)(evcon_loop *loop); /* wait (blocking) for events once and handle them */
+	void (*loop_free)(evcon_loop *loop); /* drops the last evcon reference and destroys the wrapped loop */
+
+	/* the fd-dispatch workload on the raw loop, to measure the evcon overhead; NULL if not available.
+	 * watch pairs[i][0] for reading; each callback reads one byte from pairs[i][0] and writes it to
+	 * pairs[i][1] (the first byte is already written). return after @events callbacks.
+	 * the reported evcon overhead only covers fd-dispatch: timer re-arm and async fan-in have no
+	 * raw baseline.
+	 */
+	void (*raw_fd_dispatch)(int (*pairs)[2], int npairs, long events);
+};
+
+/* usage: evcon-bench-<backend> [scale]; scale (default 1.0) multiplies all iteration counts */
+int evcon_bench_main(int argc, char **argv, const evcon_bench_backend *backend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
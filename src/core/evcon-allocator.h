@@ -3,6 +3,10 @@
 
 #include <evcon.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Slab allocator */
 
 /*
@@ -32,4 +36,8 @@ evcon_allocator* evcon_allocator_init(char *mem, size_t memsize,
 void* evcon_allocator_get_data(evcon_allocator *allocator);
 void evcon_allocator_set_data(evcon_allocator *allocator, void *user_data);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
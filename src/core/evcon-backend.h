@@ -3,9 +3,15 @@
 
 #include <evcon.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef void (*evcon_backend_free_loop_cb)(evcon_loop *loop, void *loop_data, void *backend_data);
 
-/* fd == -1: delete watcher */
+/* fd == -1: delete watcher. backends that skip updates which don't change fd and events have to check
+ * evcon_fd_is_rearm first.
+ */
 typedef void (*evcon_backend_fd_update_cb)(evcon_fd_watcher *watcher, evcon_fd fd, int events, evcon_allocator *allocator, void *loop_data, void *watcher_data);
 
 /* special timeout values:
@@ -32,7 +38,7 @@ evcon_backend* evcon_backend_new(void *backend_data,
                                  evcon_backend_async_update_cb async_udpate_cb);
 void evcon_backend_free(evcon_backend *backend);
 
-#define EVCON_BACKEND_RECOMMENDED_SIZE (8*sizeof(void*))
+#define EVCON_BACKEND_RECOMMENDED_SIZE (16*sizeof(void*))
 /* if memsize is large enough to contain a backend, initialize it and returns @mem. otherwise alloc a new block */
 evcon_backend* evcon_backend_init(char *mem, size_t memsize,
                                   void *backend_data,
@@ -44,21 +50,178 @@ evcon_backend* evcon_backend_init(char *mem, size_t memsize,
 
 evcon_loop* evcon_loop_new(evcon_backend *backend, evcon_allocator *allocator);
 
+/* optional: fd watcher start/stop and event changes are not passed to fd_update_cb right away, but
+ * collected per loop (several changes of a watcher end up as a single update); the backend has to call
+ * evcon_loop_flush_fd_updates() before it polls. @dirty_cb (may be NULL) is called when a loop gets its first
+ * pending change, for backends that need to schedule the flush. fd changes and deletes are never delayed.
+ * call right after evcon_backend_init/evcon_backend_new, before creating loops.
+ */
+typedef void (*evcon_backend_fd_dirty_cb)(evcon_loop *loop, void *loop_data, void *backend_data);
+void evcon_backend_set_fd_batching(evcon_backend *backend, evcon_backend_fd_dirty_cb dirty_cb);
+void evcon_loop_flush_fd_updates(evcon_loop *loop);
+
+/* optional: allocate @fd_size / @timer_size / @async_size bytes of (zeroed, suitably aligned) backend
+ * storage in the same block as each new watcher, and initialize the watcher backend_data with it.
+ * call right after evcon_backend_init/evcon_backend_new, before creating loops. the backend must not
+ * free that storage (and shouldn't replace backend_data); it can detect first use on its own, e.g. by
+ * a NULL back pointer.
+ */
+void evcon_backend_set_watcher_data_sizes(evcon_backend *backend, size_t fd_size, size_t timer_size, size_t async_size);
+
+/* optional: native accept for evcon_acceptor (for example io_uring multishot accept). @start != 0: start
+ * accepting on the listening socket @fd, return 0 if the backend handles it or -1 to let core watch the fd instead.
+ * @start == 0: stop (only after a successful start, before the acceptor is freed); the backend has to close
+ * connections it still gets for it. accepted fds go to evcon_feed_accept, ideally all of one loop iteration at once.
+ * call right after evcon_backend_init/evcon_backend_new, before creating loops.
+ */
+typedef int (*evcon_backend_accept_cb)(evcon_acceptor *acceptor, evcon_fd fd, int start, void *loop_data);
+void evcon_backend_set_accept(evcon_backend *backend, evcon_backend_accept_cb accept_cb);
+
 void* evcon_backend_get_data(evcon_backend *backend);
 void* evcon_loop_get_backend_data(evcon_loop *loop);
 void* evcon_fd_get_backend_data(evcon_fd_watcher *watcher);
 void* evcon_timer_get_backend_data(evcon_timer_watcher *watcher);
 void* evcon_async_get_backend_data(evcon_async_watcher *watcher);
+/* in the fd update callback: evcon_fd_set_fd was called since the last update. the fd might have been closed and
+ * its number reused, so it has to be registered again even if fd and events didn't change.
+ */
+int evcon_fd_is_rearm(evcon_fd_watcher *watcher);
 
 void evcon_backend_set_data(evcon_backend *backend, void *data);
 void evcon_loop_set_backend_data(evcon_loop *loop, void *data);
 void evcon_fd_set_backend_data(evcon_fd_watcher *watcher, void *data);
 void evcon_timer_set_backend_data(evcon_timer_watcher *watcher, void *data);
 void evcon_async_set_backend_data(evcon_async_watcher *watcher, void *data);
+void* evcon_acceptor_get_backend_data(evcon_acceptor *acceptor);
+void evcon_acceptor_set_backend_data(evcon_acceptor *acceptor, void *data);
 
 
 void evcon_feed_fd(evcon_fd_watcher *watcher, int events);
 void evcon_feed_timer(evcon_timer_watcher *watcher);
 void evcon_feed_async(evcon_async_watcher *watcher);
+/* @count == 0: accept failed, errno is set (the acceptor is still active) */
+void evcon_feed_accept(evcon_acceptor *acceptor, const evcon_fd *fds, unsigned int count);
+
+/* optional: batched dispatch. pass the fd events of a poll as one array (each watcher at most once); they are
+ * dispatched in a tight loop, prefetching the next watcher. entries of watchers freed by an earlier callback are
+ * cleared (so @events gets modified), and events for an fd the watcher doesn't use anymore are dropped.
+ */
+typedef struct evcon_fd_event evcon_fd_event;
+
+struct evcon_fd_event {
+	evcon_fd_watcher *watcher;
+	evcon_fd fd; /* the fd the event is for */
+	int events;
+};
+
+void evcon_feed_fd_batch(evcon_loop *loop, evcon_fd_event *events, unsigned int count);
+
+/* brackets the callbacks of a loop iteration (can be nested): batch end hooks (evcon_batch_hook_new) run once
+ * at the outermost evcon_loop_batch_end instead of after each callback. each evcon_feed_* call (and evcon_feed_fd_batch)
+ * is a batch too.
+ */
+void evcon_loop_batch_begin(evcon_loop *loop);
+void evcon_loop_batch_end(evcon_loop *loop);
+
+/* helpers for backends that don't have a foreign event loop to wrap */
+
+/* monotonic clock in evcon_interval units; the epoch is unspecified */
+evcon_interval evcon_monotonic_now(void);
+
+/* intrusive binary min-heap, ordered by node key (for example absolute timer deadlines).
+ * the members are private, they are only public so nodes can be embedded in other structs.
+ */
+typedef struct evcon_heap evcon_heap;
+typedef struct evcon_heap_node evcon_heap_node;
+
+struct evcon_heap_node {
+	evcon_interval key;
+	unsigned int ndx; /* index + 1 in the heap array, 0 if not queued */
+};
+
+struct evcon_heap {
+	evcon_heap_node **nodes;
+	unsigned int used, size;
+	evcon_allocator *allocator;
+};
+
+void evcon_heap_init(evcon_heap *heap, evcon_allocator *allocator);
+void evcon_heap_clear(evcon_heap *heap); /* releases the heap memory; doesn't touch the nodes */
+void evcon_heap_update(evcon_heap *heap, evcon_heap_node *node, evcon_interval key); /* inserts node if not queued yet */
+void evcon_heap_remove(evcon_heap *heap, evcon_heap_node *node); /* does nothing if node is not queued */
+evcon_heap_node* evcon_heap_top(evcon_heap *heap); /* node with smallest key, NULL if empty */
+int evcon_heap_node_is_queued(evcon_heap_node *node);
+
+/* complete timer handling on top of the heap; the queue entries are embedded in the timer watchers,
+ * so a backend only has to forward its timer_update_cb and call dispatch after polling.
+ * a watcher must only be queued in one timer queue.
+ */
+typedef struct evcon_timer_queue evcon_timer_queue;
+
+struct evcon_timer_queue {
+	evcon_heap heap;
+	evcon_timer_watcher *pending; /* expired timers of the current dispatch */
+};
+
+void evcon_timer_queue_init(evcon_timer_queue *queue, evcon_allocator *allocator);
+void evcon_timer_queue_clear(evcon_timer_queue *queue);
+/* accepts the same timeout values as evcon_backend_timer_update_cb */
+void evcon_timer_queue_update(evcon_timer_queue *queue, evcon_timer_watcher *watcher, evcon_interval timeout);
+/* feeds all expired timers; timers restarted with timeout 0 are not fed again before the next dispatch */
+void evcon_timer_queue_dispatch(evcon_timer_queue *queue);
+/* time until the next timer expires (0 if one already has), -1 if no timer is queued */
+evcon_interval evcon_timer_queue_next_timeout(evcon_timer_queue *queue);
+/* absolute time (evcon_monotonic_now) of the next expiry, -1 if no timer is queued */
+evcon_interval evcon_timer_queue_next_deadline(evcon_timer_queue *queue);
+
+/* fd to wake up a loop from other threads (for async watchers): an eventfd if available, a non-blocking
+ * pipe otherwise (then read_fd != write_fd). watch read_fd for EVCON_READ.
+ */
+typedef struct evcon_wakeup_fd evcon_wakeup_fd;
+
+struct evcon_wakeup_fd {
+	evcon_fd read_fd, write_fd;
+};
+
+int evcon_wakeup_fd_init(evcon_wakeup_fd *wakeup); /* returns 0 on success, -1 on error (errno set) */
+void evcon_wakeup_fd_clear(evcon_wakeup_fd *wakeup);
+/* thread-safe. returns -1 on error (errno set); a full pipe or counter isn't an error, the loop gets woken anyway */
+int evcon_wakeup_fd_signal(evcon_wakeup_fd *wakeup);
+void evcon_wakeup_fd_drain(evcon_wakeup_fd *wakeup);
+
+/* epoll set for backends polling fd watchers with epoll (directly, or through the epoll fd in a foreign loop):
+ * keeps one registration per fd, maps EVCON_ET to EPOLLET and translates the events for evcon_feed_fd_batch.
+ * linux only; elsewhere evcon_epoll_set_init fails with ENOSYS.
+ */
+typedef struct evcon_epoll_set evcon_epoll_set;
+typedef struct evcon_epoll_entry evcon_epoll_entry;
+
+/* per watcher (for example inline backend storage); zeroed before the first update */
+struct evcon_epoll_entry {
+	evcon_fd_watcher *watcher;
+	evcon_fd fd; /* registered fd, -1 if not registered */
+	uint32_t events; /* registered epoll events */
+};
+
+struct evcon_epoll_set {
+	evcon_fd epoll_fd;
+	evcon_allocator *allocator;
+	evcon_epoll_entry **fds; /* registered entry for each fd (epoll only allows one registration per fd) */
+	unsigned int fds_size;
+};
+
+/* creates the (close-on-exec) epoll fd; returns 0 on success, -1 on error (errno set) */
+int evcon_epoll_set_init(evcon_epoll_set *set, evcon_allocator *allocator);
+void evcon_epoll_set_clear(evcon_epoll_set *set); /* closes the epoll fd */
+/* forward evcon_backend_fd_update_cb here (fd == -1 deletes). returns -1 with errno set if epoll_ctl failed, or
+ * with EEXIST if another watcher is registered for @fd (only one active watcher per fd is supported)
+ */
+int evcon_epoll_set_update(evcon_epoll_set *set, evcon_epoll_entry *entry, evcon_fd_watcher *watcher, evcon_fd fd, int events);
+/* translates an epoll event (registered with data.fd = @fd); returns 0 if there is nothing to dispatch */
+int evcon_epoll_set_event(evcon_epoll_set *set, evcon_fd fd, uint32_t revents, evcon_fd_event *ev);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+
+#include "evcon-private.h"
+
+#include <evcon-config-private.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
+
+/*****************************************************
+ *             Loop groups                           *
+ *****************************************************/
+
+typedef struct evcon_group_handoff evcon_group_handoff;
+
+/* fd (or listener) passed to the inbox of a group loop */
+struct evcon_group_handoff {
+	evcon_group_handoff *next;
+	evcon_listener *listener; /* NULL for fd watchers */
+	evcon_fd fd;
+	int events, start;
+	evcon_fd_cb cb;
+	evcon_group_fd_cb done_cb;
+	void *user_data;
+};
+
+struct evcon_group_member {
+	evcon_loop_group *group;
+	evcon_loop *loop;
+	pthread_t thread;
+	int started, error; /* protected by the group start_mutex */
+
+	/* inbox_mutex also protects the inbox watcher: it is freed (closed = 1) when the loop stops */
+	pthread_mutex_t inbox_mutex;
+	evcon_async_watcher *inbox_watcher;
+	evcon_group_handoff *inbox_first, *inbox_last;
+	int stop, closed;
+
+	evcon_listener *listeners; /* evcon_loop_group_listen; freed when the loop stops */
+
+	unsigned int fd_count; /* atomic: fd watchers on the loop, for EVCON_GROUP_LEAST_LOADED */
+};
+
+struct evcon_loop_group {
+	const evcon_loop_group_funcs *funcs;
+	void *user_data;
+	evcon_group_policy policy;
+
+	unsigned int nloops;
+	unsigned int next; /* atomic: round-robin counter */
+	evcon_group_member *members;
+
+	pthread_mutex_t start_mutex;
+	pthread_cond_t start_cond;
+};
+
+static unsigned int evcon_group_atomic_add(unsigned int *value, int n) {
+#ifdef __GNUC__
+	return __sync_fetch_and_add(value, n);
+#else
+	unsigned int old = *value;
+	*value += n;
+	return old;
+#endif
+}
+
+void evcon_group_fd_count_add(evcon_group_member *member, int n) {
+	evcon_group_atomic_add(&member->fd_count, n);
+}
+
+static void evcon_group_deliver(evcon_loop *loop, evcon_group_handoff *h) {
+	evcon_group_handoff *next;
+
+	for (; NULL != h; h = next) {
+		next = h->next;
+
+		if (NULL != h->listener) {
+			if (NULL == loop) {
+				evcon_listener_free(h->listener);
+			} else {
+				evcon_listener_attach(h->listener, loop);
+				h->listener->next = loop->group->listeners;
+				loop->group->listeners = h->listener;
+			}
+		} else if (NULL == loop) {
+			if (NULL != h->done_cb) h->done_cb(NULL, NULL, h->fd, h->user_data);
+		} else {
+			evcon_fd_watcher *watcher = evcon_fd_new(loop, h->cb, h->fd, h->events, h->user_data);
+			if (h->start) evcon_fd_start(watcher);
+			if (NULL != h->done_cb) h->done_cb(loop, watcher, h->fd, h->user_data);
+		}
+		evcon_free(NULL, h, sizeof(evcon_group_handoff));
+	}
+}
+
+static void evcon_group_inbox_cb(evcon_loop *loop, evcon_async_watcher *watcher, void *user_data) {
+	evcon_group_member *m = user_data;
+	evcon_group_handoff *list;
+	int stop;
+	UNUSED(watcher);
+
+	pthread_mutex_lock(&m->inbox_mutex);
+	list = m->inbox_first;
+	m->inbox_first = m->inbox_last = NULL;
+	stop = m->stop;
+	pthread_mutex_unlock(&m->inbox_mutex);
+
+	evcon_group_deliver(loop, list);
+
+	if (stop) m->group->funcs->loop_break(loop, m->group->user_data);
+}
+
+static void evcon_group_push(evcon_group_member *m, evcon_group_handoff *h) {
+	h->next = NULL;
+
+	pthread_mutex_lock(&m->inbox_mutex);
+	if (m->closed) {
+		pthread_mutex_unlock(&m->inbox_mutex);
+		evcon_group_deliver(NULL, h);
+		return;
+	}
+	if (NULL == m->inbox_last) {
+		m->inbox_first = h;
+	} else {
+		m->inbox_last->next = h;
+	}
+	m->inbox_last = h;
+	evcon_async_wakeup(m->inbox_watcher);
+	pthread_mutex_unlock(&m->inbox_mutex);
+}
+
+static void* evcon_group_thread(void *arg) {
+	evcon_group_member *m = arg;
+	evcon_loop_group *group = m->group;
+	evcon_group_handoff *list;
+	evcon_listener *listener;
+	evcon_loop *loop;
+	int err;
+
+	loop = group->funcs->loop_new(group->user_data);
+	err = errno;
+	if (NULL != loop) {
+		loop->group = m;
+		m->inbox_watcher = evcon_async_new(loop, evcon_group_inbox_cb, m);
+	}
+
+	pthread_mutex_lock(&group->start_mutex);
+	m->loop = loop;
+	m->error = (NULL == loop) ? err : 0;
+	m->started = 1;
+	pthread_cond_broadcast(&group->start_cond);
+	pthread_mutex_unlock(&group->start_mutex);
+
+	if (NULL == loop) return NULL;
+
+	group->funcs->loop_run(loop, group->user_data);
+
+	pthread_mutex_lock(&m->inbox_mutex);
+	m->closed = 1;
+	evcon_async_free(m->inbox_watcher);
+	m->inbox_watcher = NULL;
+	list = m->inbox_first;
+	m->inbox_first = m->inbox_last = NULL;
+	pthread_mutex_unlock(&m->inbox_mutex);
+
+	/* too late to watch them */
+	evcon_group_deliver(NULL, list);
+
+	while (NULL != (listener = m->listeners)) {
+		m->listeners = listener->next;
+		evcon_listener_free(listener);
+	}
+
+	loop->group = NULL;
+	group->funcs->loop_free(loop, group->user_data);
+	return NULL;
+}
+
+static void evcon_group_stop_and_join(evcon_loop_group *group, unsigned int nthreads) {
+	unsigned int i;
+
+	for (i = 0; i < nthreads; i++) {
+		evcon_group_member *m = &group->members[i];
+
+		pthread_mutex_lock(&m->inbox_mutex);
+		m->stop = 1;
+		if (!m->closed && NULL != m->inbox_watcher) evcon_async_wakeup(m->inbox_watcher);
+		pthread_mutex_unlock(&m->inbox_mutex);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(group->members[i].thread, NULL);
+	}
+
+	for (i = 0; i < group->nloops; i++) {
+		pthread_mutex_destroy(&group->members[i].inbox_mutex);
+	}
+	pthread_cond_destroy(&group->start_cond);
+	pthread_mutex_destroy(&group->start_mutex);
+	evcon_free(NULL, group->members, group->nloops * sizeof(evcon_group_member));
+	evcon_free(NULL, group, sizeof(evcon_loop_group));
+}
+
+evcon_loop_group* evcon_loop_group_new(const evcon_loop_group_funcs *funcs, void *user_data, unsigned int nloops, evcon_group_policy policy) {
+	evcon_loop_group *group;
+	unsigned int i, nthreads;
+	int err = 0;
+
+	if (0 == nloops) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	group = evcon_alloc0(NULL, sizeof(evcon_loop_group));
+	group->funcs = funcs;
+	group->user_data = user_data;
+	group->policy = policy;
+	group->nloops = nloops;
+	group->members = evcon_alloc0(NULL, nloops * sizeof(evcon_group_member));
+	pthread_mutex_init(&group->start_mutex, NULL);
+	pthread_cond_init(&group->start_cond, NULL);
+
+	for (i = 0; i < nloops; i++) {
+		group->members[i].group = group;
+		pthread_mutex_init(&group->members[i].inbox_mutex, NULL);
+	}
+
+	for (nthreads = 0; nthreads < nloops; nthreads++) {
+		if (0 != (err = pthread_create(&group->members[nthreads].thread, NULL, evcon_group_thread, &group->members[nthreads]))) break;
+	}
+
+	/* wait for the loops */
+	pthread_mutex_lock(&group->start_mutex);
+	for (i = 0; i < nthreads; i++) {
+		while (!group->members[i].started) pthread_cond_wait(&group->start_cond, &group->start_mutex);
+		if (0 == err && NULL == group->members[i].loop) err = group->members[i].error;
+	}
+	pthread_mutex_unlock(&group->start_mutex);
+
+	if (0 != err) {
+		evcon_group_stop_and_join(group, nthreads);
+		errno = err;
+		return NULL;
+	}
+
+	return group;
+}
+
+void evcon_loop_group_free(evcon_loop_group *group) {
+	if (NULL == group) return;
+	evcon_group_stop_and_join(group, group->nloops);
+}
+
+unsigned int evcon_loop_group_size(evcon_loop_group *group) {
+	return group->nloops;
+}
+
+evcon_loop* evcon_loop_group_get_loop(evcon_loop_group *group, unsigned int ndx) {
+	return (ndx < group->nloops) ? group->members[ndx].loop : NULL;
+}
+
+int evcon_loop_group_pin_cpus(evcon_loop_group *group) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	unsigned int i, cpu;
+	int err;
+
+	if (ncpus < 1) return -1;
+	for (i = 0; i < group->nloops; i++) {
+		cpu = i % (unsigned long) ncpus;
+		if (cpu >= CPU_SETSIZE) {
+			errno = EINVAL;
+			return -1;
+		}
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (0 != (err = pthread_setaffinity_np(group->members[i].thread, sizeof(set), &set))) {
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+#else
+	UNUSED(group);
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static evcon_group_member* evcon_group_pick(evcon_loop_group *group) {
+	unsigned int i, start = evcon_group_atomic_add(&group->next, 1) % group->nloops;
+	evcon_group_member *best;
+
+	best = &group->members[start];
+	if (EVCON_GROUP_LEAST_LOADED == group->policy) {
+		/* start at the round-robin position, so ties are spread too */
+		unsigned int best_count = evcon_group_atomic_add(&best->fd_count, 0);
+
+		for (i = 1; i < group->nloops && best_count > 0; i++) {
+			evcon_group_member *m = &group->members[(start + i) % group->nloops];
+			unsigned int count = evcon_group_atomic_add(&m->fd_count, 0);
+
+			if (count < best_count) {
+				best = m;
+				best_count = count;
+			}
+		}
+	}
+
+	return best;
+}
+
+evcon_loop* evcon_loop_group_pick(evcon_loop_group *group) {
+	return evcon_group_pick(group)->loop;
+}
+
+void evcon_loop_group_add_fd(evcon_loop_group *group, evcon_fd fd, int events, evcon_fd_cb cb, evcon_group_fd_cb added_cb, void *user_data) {
+	evcon_group_handoff *h = evcon_alloc(NULL, sizeof(evcon_group_handoff));
+
+	h->listener = NULL;
+	h->fd = fd;
+	h->events = events;
+	h->start = 1;
+	h->cb = cb;
+	h->done_cb = added_cb;
+	h->user_data = user_data;
+	evcon_group_push(evcon_group_pick(group), h);
+}
+
+int evcon_loop_group_move_fd(evcon_loop_group *group, evcon_fd_watcher *watcher, evcon_loop *target, evcon_group_fd_cb moved_cb) {
+	evcon_group_member *m = target->group;
+	evcon_group_handoff *h;
+
+	if (NULL == m || m->group != group) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	h = evcon_alloc(NULL, sizeof(evcon_group_handoff));
+	h->listener = NULL;
+	h->fd = watcher->fd;
+	h->events = watcher->events;
+	h->start = watcher->active;
+	h->cb = watcher->cb;
+	h->done_cb = moved_cb;
+	h->user_data = watcher->user_data;
+
+	/* unregisters the fd from the old loop right away */
+	evcon_fd_free(watcher);
+	evcon_group_push(m, h);
+	return 0;
+}
+
+/* the reuseport group picks socket (cpu % nsockets); sockets are numbered in listen() order */
+static void evcon_reuseport_steer_by_cpu(evcon_fd fd, unsigned int nsockets) {
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0 },
+		{ BPF_RET | BPF_A, 0, 0, 0 }
+	};
+	struct sock_fprog prog;
+
+	code[1].k = nsockets;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	/* best effort: without the program the kernel hashes */
+	(void) setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+	UNUSED(fd);
+	UNUSED(nsockets);
+#endif
+}
+
+int evcon_loop_group_listen(evcon_loop_group *group, const struct sockaddr *addr, socklen_t addrlen, int backlog, int flags, evcon_listener_cb cb, void *user_data) {
+	evcon_fd *fds = evcon_alloc(NULL, group->nloops * sizeof(evcon_fd));
+	struct sockaddr_storage bound;
+	socklen_t boundlen = sizeof(bound);
+	int reuseport = 1, err;
+	unsigned int i, n = 0;
+
+	fds[0] = evcon_listen_socket(addr, addrlen, backlog, EVCON_LISTEN_REUSEPORT);
+	if (-1 == fds[0] && (ENOPROTOOPT == errno || EOPNOTSUPP == errno || EINVAL == errno)) {
+		reuseport = 0;
+		fds[0] = evcon_listen_socket(addr, addrlen, backlog, 0);
+	}
+	if (-1 == fds[0]) goto error;
+	n = 1;
+
+	if (reuseport) {
+		/* the actual address, so port 0 gets the same port for all sockets */
+		if (-1 == getsockname(fds[0], (struct sockaddr*) &bound, &boundlen)) goto error;
+		for (; n < group->nloops; n++) {
+			if (-1 == (fds[n] = evcon_listen_socket((struct sockaddr*) &bound, boundlen, backlog, EVCON_LISTEN_REUSEPORT))) goto error;
+		}
+		if (0 != (flags & EVCON_LISTEN_STEER_CPU)) evcon_reuseport_steer_by_cpu(fds[0], group->nloops);
+	} else {
+		/* the loops share the socket; each needs its own fd for its watcher */
+		for (; n < group->nloops; n++) {
+			if (-1 == (fds[n] = dup(fds[0]))) goto error;
+			evcon_init_fd(fds[n]);
+		}
+	}
+
+	for (i = 0; i < group->nloops; i++) {
+		evcon_group_handoff *h = evcon_alloc0(NULL, sizeof(evcon_group_handoff));
+
+		h->listener = evcon_listener_alloc(fds[i], cb, user_data);
+		h->fd = fds[i];
+		evcon_group_push(&group->members[i], h);
+	}
+
+	evcon_free(NULL, fds, group->nloops * sizeof(evcon_fd));
+	return 0;
+
+error:
+	err = errno;
+	for (i = 0; i < n; i++) close(fds[i]);
+	evcon_free(NULL, fds, group->nloops * sizeof(evcon_fd));
+	errno = err;
+	return -1;
+}
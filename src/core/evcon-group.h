@@ -0,0 +1,67 @@
+#ifndef __EVCON_EVCON_GROUP_H
+#define __EVCON_EVCON_GROUP_H __EVCON_EVCON_GROUP_H
+
+#include <evcon.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Loop groups: N threads, each running its own backend loop wrapped in an evcon_loop.
+ * fds are handed to a loop of the group (or moved between them) with an async wakeup of the
+ * target loop; the fd watchers are then created in the target loop thread.
+ */
+
+typedef struct evcon_loop_group evcon_loop_group;
+typedef struct evcon_loop_group_funcs evcon_loop_group_funcs;
+
+typedef enum {
+	EVCON_GROUP_ROUND_ROBIN,
+	EVCON_GROUP_LEAST_LOADED /* loop with the fewest fd watchers */
+} evcon_group_policy;
+
+/* how to create and run the loops; all of them are called in the thread of the loop */
+struct evcon_loop_group_funcs {
+	evcon_loop* (*loop_new)(void *user_data); /* NULL on failure (with errno set) */
+	void (*loop_run)(evcon_loop *loop, void *user_data); /* run until loop_break is called */
+	void (*loop_break)(evcon_loop *loop, void *user_data); /* called from a callback of the loop */
+	void (*loop_free)(evcon_loop *loop, void *user_data); /* drops the last evcon reference and destroys the wrapped loop */
+};
+
+/* called in the thread of @loop with the new watcher; or with @loop and @watcher NULL (in any thread)
+ * if the target loop stopped before the fd was delivered (the fd is not watched then; close it).
+ */
+typedef void (*evcon_group_fd_cb)(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, void *user_data);
+
+/* starts @nloops threads and waits until all loops are created; returns NULL (with errno set) on failure.
+ * @funcs must stay valid until the group is freed.
+ */
+evcon_loop_group* evcon_loop_group_new(const evcon_loop_group_funcs *funcs, void *user_data, unsigned int nloops, evcon_group_policy policy);
+/* breaks all loops, joins the threads and frees the loops. call it from outside the group */
+void evcon_loop_group_free(evcon_loop_group *group);
+
+unsigned int evcon_loop_group_size(evcon_loop_group *group);
+evcon_loop* evcon_loop_group_get_loop(evcon_loop_group *group, unsigned int ndx);
+/* pins the thread of loop i to cpu (i % online cpus), see EVCON_LISTEN_STEER_CPU in evcon-listener.h;
+ * returns -1 (errno set, ENOSYS if not supported) if a thread couldn't be pinned.
+ */
+int evcon_loop_group_pin_cpus(evcon_loop_group *group);
+/* loop for the next fd according to the policy; thread-safe */
+evcon_loop* evcon_loop_group_pick(evcon_loop_group *group);
+
+/* thread-safe: watch @fd for @events with @cb on the loop chosen by the policy; the watcher is created
+ * and started in that loop, then passed to @added_cb (which may be NULL). user_data is used for both callbacks.
+ */
+void evcon_loop_group_add_fd(evcon_loop_group *group, evcon_fd fd, int events, evcon_fd_cb cb, evcon_group_fd_cb added_cb, void *user_data);
+
+/* call in the thread of the loop of @watcher (not necessarily a group loop): frees @watcher and creates a
+ * watcher with the same fd, events, callback, user data and state on @target, passed to @moved_cb (may be NULL).
+ * if @watcher is in a callback it is freed after it returns. returns -1 (errno = EINVAL) if @target isn't in @group.
+ */
+int evcon_loop_group_move_fd(evcon_loop_group *group, evcon_fd_watcher *watcher, evcon_loop *target, evcon_group_fd_cb moved_cb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+
+#include "evcon-private.h"
+
+#include <evcon-config-private.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+/*****************************************************
+ *             Listeners                             *
+ *****************************************************/
+
+evcon_fd evcon_listen_socket(const struct sockaddr *addr, socklen_t addrlen, int backlog, int flags) {
+	int fd, one = 1, err;
+
+	if (-1 == (fd = socket(addr->sa_family, SOCK_STREAM, 0))) return -1;
+	evcon_init_fd(fd);
+
+	if (AF_UNIX != addr->sa_family && -1 == setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) goto error;
+	if (0 != (flags & EVCON_LISTEN_REUSEPORT)) {
+#ifdef SO_REUSEPORT
+		if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) goto error;
+#else
+		errno = ENOPROTOOPT;
+		goto error;
+#endif
+	}
+	if (-1 == bind(fd, addr, addrlen)) goto error;
+	if (-1 == listen(fd, backlog)) goto error;
+
+	return fd;
+
+error:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static evcon_fd evcon_accept(evcon_fd fd, struct sockaddr *addr, socklen_t *addrlen) {
+#ifdef HAVE_ACCEPT4
+	return accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	evcon_fd confd = accept(fd, addr, addrlen);
+	if (-1 != confd) evcon_init_fd(confd);
+	return confd;
+#endif
+}
+
+struct evcon_acceptor {
+	evcon_loop *loop;
+	evcon_fd_watcher *watcher; /* NULL if the backend accepts natively */
+	evcon_timer_watcher *backoff; /* NULL until accepting was paused the first time */
+	void *backend_data;
+	evcon_fd fd;
+	evcon_acceptor_cb cb;
+	void *user_data;
+	unsigned int incallback:1, delayed_delete:1, paused:1;
+};
+
+/* errors that don't go away by accepting again right away; the connections stay in the backlog */
+static int evcon_accept_error_persistent(int err) {
+	return EMFILE == err || ENFILE == err || ENOBUFS == err || ENOMEM == err;
+}
+
+static void evcon_acceptor_accept_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data);
+
+static void evcon_acceptor_backoff_cb(evcon_loop *loop, evcon_timer_watcher *watcher, void *user_data) {
+	evcon_acceptor *acceptor = user_data;
+	evcon_backend *backend = loop->backend;
+	UNUSED(watcher);
+
+	acceptor->paused = 0;
+	if (NULL != acceptor->watcher) {
+		evcon_fd_start(acceptor->watcher);
+	} else if (0 != backend->accept_cb(acceptor, acceptor->fd, 1, loop->backend_data)) {
+		acceptor->watcher = evcon_fd_new(loop, evcon_acceptor_accept_cb, acceptor->fd, EVCON_READ, acceptor);
+		evcon_fd_start(acceptor->watcher);
+	}
+}
+
+/* a level-triggered loop would report the socket again immediately */
+static void evcon_acceptor_pause(evcon_acceptor *acceptor) {
+	evcon_loop *loop = acceptor->loop;
+
+	acceptor->paused = 1;
+	if (NULL != acceptor->watcher) {
+		evcon_fd_stop(acceptor->watcher);
+	} else {
+		loop->backend->accept_cb(acceptor, acceptor->fd, 0, loop->backend_data);
+	}
+
+	if (NULL == acceptor->backoff) acceptor->backoff = evcon_timer_new(loop, evcon_acceptor_backoff_cb, acceptor);
+	evcon_timer_once(acceptor->backoff, EVCON_ACCEPTOR_BACKOFF);
+}
+
+void evcon_feed_accept(evcon_acceptor *acceptor, const evcon_fd *fds, unsigned int count) {
+	evcon_loop *loop = acceptor->loop;
+	int err = 0 == count ? errno : 0;
+
+	evcon_loop_batch_begin(loop);
+	acceptor->incallback = 1;
+	acceptor->cb(acceptor->loop, acceptor, fds, count, acceptor->user_data);
+	acceptor->incallback = 0;
+
+	if (acceptor->delayed_delete) {
+		evcon_acceptor_free(acceptor);
+	} else if (evcon_accept_error_persistent(err) && !acceptor->paused) {
+		evcon_acceptor_pause(acceptor);
+	}
+	evcon_loop_batch_end(loop);
+}
+
+/* one batch per wakeup, so a connection storm doesn't starve the other watchers */
+static void evcon_acceptor_accept_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	evcon_acceptor *acceptor = user_data;
+	evcon_fd fds[EVCON_ACCEPTOR_MAX_BATCH];
+	unsigned int count = 0;
+	int err = 0;
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(revents);
+
+	while (count < EVCON_ACCEPTOR_MAX_BATCH) {
+		if (-1 == (fds[count] = evcon_accept(fd, NULL, NULL))) {
+			if (EINTR == errno || ECONNABORTED == errno) continue;
+			if (EAGAIN != errno && EWOULDBLOCK != errno) err = errno;
+			break;
+		}
+		count++;
+	}
+
+	if (count > 0) {
+		evcon_feed_accept(acceptor, fds, count);
+		/* the error shows up again on the next wakeup */
+		return;
+	}
+	if (0 != err) {
+		errno = err;
+		evcon_feed_accept(acceptor, NULL, 0);
+	}
+}
+
+evcon_acceptor* evcon_acceptor_new(evcon_loop *loop, evcon_fd fd, evcon_acceptor_cb cb, void *user_data) {
+	evcon_acceptor *acceptor = evcon_alloc0(loop->allocator, sizeof(evcon_acceptor));
+	evcon_backend *backend = loop->backend;
+
+	evcon_loop_ref(loop);
+	acceptor->loop = loop;
+	acceptor->fd = fd;
+	acceptor->cb = cb;
+	acceptor->user_data = user_data;
+
+	evcon_init_fd(fd);
+	if (NULL == backend->accept_cb || 0 != backend->accept_cb(acceptor, fd, 1, loop->backend_data)) {
+		acceptor->watcher = evcon_fd_new(loop, evcon_acceptor_accept_cb, fd, EVCON_READ, acceptor);
+		evcon_fd_start(acceptor->watcher);
+	}
+	return acceptor;
+}
+
+void evcon_acceptor_free(evcon_acceptor *acceptor) {
+	evcon_loop *loop = acceptor->loop;
+
+	if (acceptor->incallback) {
+		acceptor->delayed_delete = 1;
+		return;
+	}
+
+	if (NULL != acceptor->backoff) evcon_timer_free(acceptor->backoff);
+	if (NULL != acceptor->watcher) {
+		evcon_fd_free(acceptor->watcher);
+	} else if (!acceptor->paused) {
+		loop->backend->accept_cb(acceptor, acceptor->fd, 0, loop->backend_data);
+	}
+	close(acceptor->fd);
+	evcon_free(loop->allocator, acceptor, sizeof(evcon_acceptor));
+	evcon_loop_unref(loop);
+}
+
+evcon_fd evcon_acceptor_get_fd(evcon_acceptor *acceptor) {
+	return acceptor->fd;
+}
+evcon_loop* evcon_acceptor_get_loop(evcon_acceptor *acceptor) {
+	return acceptor->loop;
+}
+void* evcon_acceptor_get_user_data(evcon_acceptor *acceptor) {
+	return acceptor->user_data;
+}
+void* evcon_acceptor_get_backend_data(evcon_acceptor *acceptor) {
+	return acceptor->backend_data;
+}
+void evcon_acceptor_set_backend_data(evcon_acceptor *acceptor, void *data) {
+	acceptor->backend_data = data;
+}
+
+/* listeners wrap an acceptor and hand out the connections one by one */
+
+static void evcon_listener_accept_cb(evcon_loop *loop, evcon_acceptor *acceptor, const evcon_fd *fds, unsigned int count, void *user_data) {
+	evcon_listener *listener = user_data;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned int i;
+	UNUSED(acceptor);
+
+	listener->incallback = 1;
+	if (0 == count) listener->cb(loop, listener, -1, NULL, 0, listener->user_data);
+	for (i = 0; i < count; i++) {
+		if (listener->delayed_delete) {
+			close(fds[i]);
+			continue;
+		}
+		addrlen = sizeof(addr);
+		if (-1 == getpeername(fds[i], (struct sockaddr*) &addr, &addrlen)) addrlen = 0;
+		listener->cb(loop, listener, fds[i], 0 != addrlen ? (struct sockaddr*) &addr : NULL, addrlen, listener->user_data);
+	}
+	listener->incallback = 0;
+
+	if (listener->delayed_delete) evcon_listener_free(listener);
+}
+
+/* group listeners are created in one thread and attached in another, so they don't use a loop allocator */
+evcon_listener* evcon_listener_alloc(evcon_fd fd, evcon_listener_cb cb, void *user_data) {
+	evcon_listener *listener = evcon_alloc0(NULL, sizeof(evcon_listener));
+
+	listener->fd = fd;
+	listener->cb = cb;
+	listener->user_data = user_data;
+	return listener;
+}
+
+void evcon_listener_attach(evcon_listener *listener, evcon_loop *loop) {
+	listener->acceptor = evcon_acceptor_new(loop, listener->fd, evcon_listener_accept_cb, listener);
+}
+
+evcon_listener* evcon_listener_new(evcon_loop *loop, evcon_fd fd, evcon_listener_cb cb, void *user_data) {
+	evcon_listener *listener = evcon_listener_alloc(fd, cb, user_data);
+
+	evcon_listener_attach(listener, loop);
+	return listener;
+}
+
+void evcon_listener_free(evcon_listener *listener) {
+	if (listener->incallback) {
+		listener->delayed_delete = 1;
+		return;
+	}
+
+	if (NULL != listener->acceptor) {
+		evcon_acceptor_free(listener->acceptor);
+	} else {
+		close(listener->fd);
+	}
+	evcon_free(NULL, listener, sizeof(evcon_listener));
+}
+
+evcon_fd evcon_listener_get_fd(evcon_listener *listener) {
+	return listener->fd;
+}
+evcon_loop* evcon_listener_get_loop(evcon_listener *listener) {
+	return NULL != listener->acceptor ? evcon_acceptor_get_loop(listener->acceptor) : NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef __EVCON_EVCON_LISTENER_H
+#define __EVCON_EVCON_LISTENER_H __EVCON_EVCON_LISTENER_H
+
+#include <evcon.h>
+#include <evcon-group.h>
+
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Listeners: one callback per accepted connection, with the peer address; built on an acceptor (see below),
+ * so they accept natively where the backend supports it. accepted fds are already non-blocking and
+ * close-on-exec (accept4 where available), so they don't need evcon_init_fd.
+ */
+
+typedef struct evcon_listener evcon_listener;
+
+/* @fd == -1 if accept failed with something else than EAGAIN, EINTR or ECONNABORTED (errno is set);
+ * see evcon_acceptor_cb for what happens after that. otherwise the callback owns @fd.
+ */
+typedef void (*evcon_listener_cb)(evcon_loop *loop, evcon_listener *listener, evcon_fd fd, const struct sockaddr *addr, socklen_t addrlen, void *user_data);
+
+typedef enum {
+	EVCON_LISTEN_REUSEPORT = 0x0001, /* set SO_REUSEPORT (fails with ENOPROTOOPT if not supported) */
+	EVCON_LISTEN_STEER_CPU = 0x0002  /* evcon_loop_group_listen: steer connections by cpu, see below */
+} evcon_listen_flags;
+
+/* socket bound to @addr (with SO_REUSEADDR) and listening, non-blocking; -1 on error (errno set) */
+evcon_fd evcon_listen_socket(const struct sockaddr *addr, socklen_t addrlen, int backlog, int flags);
+
+/* takes ownership of the listening socket @fd (sets it non-blocking) */
+evcon_listener* evcon_listener_new(evcon_loop *loop, evcon_fd fd, evcon_listener_cb cb, void *user_data);
+/* closes the socket; can be called from the callback */
+void evcon_listener_free(evcon_listener *listener);
+
+evcon_fd evcon_listener_get_fd(evcon_listener *listener);
+evcon_loop* evcon_listener_get_loop(evcon_listener *listener);
+
+/* Acceptors: all connections accepted in one wakeup are passed to a single callback (no peer addresses, use
+ * getpeername). backends can accept natively (io_uring: multishot accept, one request for
+ * all connections); otherwise an fd watcher accepts with accept4 in batches of up to EVCON_ACCEPTOR_MAX_BATCH.
+ */
+
+#define EVCON_ACCEPTOR_MAX_BATCH 64
+#define EVCON_ACCEPTOR_BACKOFF EVCON_INTERVAL_FROM_MSEC(100)
+
+/* the callback owns the @count accepted fds (non-blocking and close-on-exec).
+ * @count == 0 if accept failed with something else than EAGAIN, EINTR or ECONNABORTED (errno is set).
+ * after EMFILE, ENFILE, ENOBUFS or ENOMEM the acceptor stops accepting for EVCON_ACCEPTOR_BACKOFF (pending
+ * connections wait in the backlog), so a loop doesn't spin on the socket; other errors only get reported.
+ */
+typedef void (*evcon_acceptor_cb)(evcon_loop *loop, evcon_acceptor *acceptor, const evcon_fd *fds, unsigned int count, void *user_data);
+
+/* takes ownership of the listening socket @fd (sets it non-blocking) */
+evcon_acceptor* evcon_acceptor_new(evcon_loop *loop, evcon_fd fd, evcon_acceptor_cb cb, void *user_data);
+/* closes the socket; can be called from the callback */
+void evcon_acceptor_free(evcon_acceptor *acceptor);
+
+evcon_fd evcon_acceptor_get_fd(evcon_acceptor *acceptor);
+evcon_loop* evcon_acceptor_get_loop(evcon_acceptor *acceptor);
+void* evcon_acceptor_get_user_data(evcon_acceptor *acceptor);
+
+/* thread-safe: one listener per loop of the group on the same address (port 0 picks one port for all),
+ * with a SO_REUSEPORT socket each so the kernel balances new connections; where that isn't supported
+ * all loops watch the same socket. @cb runs in the loop that accepted the connection.
+ * with EVCON_LISTEN_STEER_CPU (linux, best effort) a connection goes to loop (cpu % size), where cpu handled
+ * the incoming packet; pin the loop threads with evcon_loop_group_pin_cpus so it is handled on that cpu.
+ * the listeners are freed with the group (don't free them yourself).
+ */
+int evcon_loop_group_listen(evcon_loop_group *group, const struct sockaddr *addr, socklen_t addrlen, int backlog, int flags, evcon_listener_cb cb, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef __EVCON_EVCON_PRIVATE_H
+#define __EVCON_EVCON_PRIVATE_H __EVCON_EVCON_PRIVATE_H
+
+/* internal: state shared by the core sources (evcon.c, evcon-listener.c, evcon-group.c, evcon-stream.c).
+ * not installed.
+ */
+
+#include <evcon.h>
+#include <evcon-backend.h>
+#include <evcon-allocator.h>
+#include <evcon-group.h>
+#include <evcon-listener.h>
+#include <evcon-stream.h>
+
+#define UNUSED(x) ((void)(x))
+
+/* not exported from the library */
+#ifdef __GNUC__
+# define EVCON_INTERNAL __attribute__((visibility("hidden")))
+#else
+# define EVCON_INTERNAL
+#endif
+
+struct evcon_allocator {
+	void* user_data;
+	evcon_alloc_cb alloc_cb;
+	evcon_free_cb free_cb;
+};
+
+struct evcon_backend {
+	void *backend_data;
+	evcon_allocator *allocator;
+	evcon_backend_free_loop_cb free_loop_cb;
+	evcon_backend_fd_update_cb fd_update_cb;
+	evcon_backend_timer_update_cb timer_update_cb;
+	evcon_backend_async_update_cb async_update_cb;
+
+	/* fd watcher changes are collected until evcon_loop_flush_fd_updates, see evcon_backend_set_fd_batching */
+	unsigned int fd_batching:1;
+	evcon_backend_fd_dirty_cb fd_dirty_cb;
+
+	/* backend storage allocated together with each watcher, see evcon_backend_set_watcher_data_sizes */
+	size_t fd_data_size, timer_data_size, async_data_size;
+
+	/* NULL unless the backend accepts natively, see evcon_backend_set_accept */
+	evcon_backend_accept_cb accept_cb;
+};
+
+typedef struct evcon_timer_wheel evcon_timer_wheel;
+typedef struct evcon_pool evcon_pool;
+typedef struct evcon_callback_timing evcon_callback_timing;
+typedef struct evcon_group_member evcon_group_member;
+typedef struct evcon_stream_chunks evcon_stream_chunks;
+
+#ifdef __GNUC__
+# define EVCON_PREFETCH(p) __builtin_prefetch(p)
+#else
+# define EVCON_PREFETCH(p) ((void) 0)
+#endif
+
+struct evcon_loop {
+	unsigned int refcount;
+	void *backend_data;
+	evcon_backend *backend;
+	evcon_allocator *allocator;
+
+	evcon_timer_wheel *wheel; /* NULL unless enabled with evcon_loop_enable_timer_wheel */
+	evcon_pool *pool; /* NULL unless enabled with evcon_loop_enable_pool */
+	evcon_loop_stats *stats; /* NULL unless enabled with evcon_loop_enable_stats */
+	evcon_callback_timing *timing; /* NULL unless enabled with evcon_loop_enable_callback_timing */
+	evcon_group_member *group; /* NULL unless the loop runs in a evcon_loop_group */
+	evcon_stream_chunks *chunks; /* NULL until the first evcon_stream is created */
+	evcon_batch_hook *batch_hooks; /* NULL until the first evcon_batch_hook_new */
+
+	/* > 0 between evcon_loop_batch_begin and evcon_loop_batch_end (every callback runs in a batch): batch end
+	 * hooks wait for the end
+	 */
+	unsigned int batch_depth;
+	unsigned int batch_hooks_running:1, batch_hooks_dirty:1;
+
+	/* evcon_feed_fd_batch in progress: entries from fd_batch_next on are not dispatched yet */
+	evcon_fd_event *fd_batch;
+	unsigned int fd_batch_next, fd_batch_count;
+
+	/* fd watchers with changes not passed to the backend yet (FIFO) */
+	evcon_fd_watcher *fd_dirty_first, *fd_dirty_last;
+};
+
+#define EVCON_STAT_ADD(loop, field, n) do { if (NULL != (loop)->stats) (loop)->stats->field += (n); } while (0)
+#define EVCON_STAT_INC(loop, field) EVCON_STAT_ADD(loop, field, 1)
+
+struct evcon_fd_watcher {
+	void *user_data;
+	void *backend_data;
+	unsigned int active:1, incallback:1, delayed_delete:1, pooled:1, dirty:1;
+	unsigned int rearm:1; /* evcon_fd_set_fd since the last backend update */
+	evcon_loop *loop;
+	evcon_fd_cb cb;
+	evcon_fd fd;
+	int events;
+
+	evcon_fd_watcher *dirty_prev, *dirty_next;
+};
+
+struct evcon_timer_watcher {
+	void *user_data;
+	void *backend_data;
+	unsigned int active:1, incallback:1, delayed_delete:1, pooled:1, queue_pending:1, wheel:1, lazy:1;
+	evcon_loop *loop;
+	evcon_timer_cb cb;
+	evcon_interval timeout, repeat, slack;
+
+	/* lazy re-arm: restarting a timer to expire later than the backend timer only updates deadline (and sets lazy);
+	 * the backend timer is moved when it triggers. both are absolute (evcon_monotonic_now), -1 if not armed
+	 */
+	evcon_interval deadline, backend_deadline;
+
+	/* evcon_timer_queue entry */
+	evcon_heap_node queue_node;
+	evcon_timer_watcher *queue_prev, *queue_next;
+
+	/* evcon_timer_wheel entry; wheel_list is the slot (or pending list) the watcher is linked into */
+	evcon_timer_watcher **wheel_list, *wheel_prev, *wheel_next;
+	int64_t wheel_expires; /* in wheel ticks */
+};
+
+struct evcon_async_watcher {
+	void *user_data;
+	void *backend_data;
+	unsigned int incallback:1, delayed_delete:1, pooled:1;
+	evcon_loop *loop;
+	evcon_async_cb cb;
+};
+
+typedef union {
+	void *p;
+	int64_t i;
+	long double d;
+} evcon_max_align;
+
+#define EVCON_ALIGN(size) (((size) + sizeof(evcon_max_align) - 1) / sizeof(evcon_max_align) * sizeof(evcon_max_align))
+
+/* batches (evcon.c) */
+
+/* weak: internal hook without loop reference */
+EVCON_INTERNAL evcon_batch_hook* evcon_batch_hook_alloc(evcon_loop *loop, evcon_batch_hook_cb cb, void *user_data, int weak);
+
+/* listeners (evcon-listener.c) */
+
+struct evcon_listener {
+	evcon_listener *next; /* listeners owned by a group loop */
+	evcon_acceptor *acceptor; /* NULL until attached; owns the fd then */
+	evcon_fd fd;
+	evcon_listener_cb cb;
+	void *user_data;
+	unsigned int incallback:1, delayed_delete:1;
+};
+
+EVCON_INTERNAL evcon_listener* evcon_listener_alloc(evcon_fd fd, evcon_listener_cb cb, void *user_data);
+EVCON_INTERNAL void evcon_listener_attach(evcon_listener *listener, evcon_loop *loop);
+
+/* loop groups (evcon-group.c) */
+
+/* fd watchers on the loop of @member, for EVCON_GROUP_LEAST_LOADED */
+EVCON_INTERNAL void evcon_group_fd_count_add(evcon_group_member *member, int n);
+
+/* streams (evcon-stream.c) */
+
+/* after all streams of @loop are gone */
+EVCON_INTERNAL void evcon_stream_cache_release(evcon_loop *loop);
+
+#endif
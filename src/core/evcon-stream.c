@@ -0,0 +1,907 @@
+#define _GNU_SOURCE
+
+#include "evcon-private.h"
+
+#include <evcon-config-private.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+# include <sys/sendfile.h>
+#else
+# undef HAVE_SENDFILE
+#endif
+
+/*****************************************************
+ *             Streams                               *
+ *****************************************************/
+
+/* chunks kept in the per-loop cache (of each kind); more are returned to the allocator */
+#define EVCON_STREAM_CACHE_MAX 64
+/* empty pipes kept for splice */
+#define EVCON_STREAM_PIPE_CACHE_MAX 16
+/* chunks per writev */
+#define EVCON_STREAM_IOV_MAX 64
+/* bytes per splice (the default pipe capacity) */
+#define EVCON_STREAM_SPLICE_MAX (64*1024)
+#define EVCON_STREAM_DEFAULT_INPUT_LIMIT (4*EVCON_STREAM_CHUNK_SIZE)
+
+typedef struct evcon_stream_chunk evcon_stream_chunk;
+typedef struct evcon_stream_queue evcon_stream_queue;
+
+typedef enum {
+	EVCON_CHUNK_BUFFER,   /* EVCON_STREAM_CHUNK_SIZE bytes following the header */
+	EVCON_CHUNK_EXTERNAL, /* evcon_stream_write_external */
+	EVCON_CHUNK_FILE,     /* evcon_stream_write_file */
+	EVCON_CHUNK_PIPE      /* spliced data waiting in a pipe */
+} evcon_stream_chunk_type;
+
+struct evcon_stream_chunk {
+	evcon_stream_chunk *next;
+	evcon_stream_chunk_type type;
+	char *data; /* buffer and external chunks */
+	/* pending data: data[start..end[, file range [offset+start..offset+end[, or (end - start) bytes in the pipe */
+	size_t start, end;
+	off_t offset;
+	evcon_fd fds[2]; /* file: fds[0]; pipe: read and write end */
+	evcon_stream_free_cb free_cb;
+	evcon_stream_file_cb file_cb;
+	void *free_data;
+	unsigned int no_sendfile:1, pipe_full:1;
+};
+
+#define EVCON_STREAM_CHUNK_ALLOC_SIZE (EVCON_ALIGN(sizeof(evcon_stream_chunk)) + EVCON_STREAM_CHUNK_SIZE)
+
+/* free chunks; the cache lives as long as the loop (streams keep the loop alive) */
+struct evcon_stream_chunks {
+	evcon_stream_chunk *buffers, *headers; /* headers: chunks without buffer (external, file, pipe) */
+	unsigned int buffers_count, headers_count;
+
+	evcon_fd pipes[EVCON_STREAM_PIPE_CACHE_MAX][2];
+	unsigned int pipes_count;
+
+	/* corked streams with output to write at the end of the batch */
+	evcon_stream *corked;
+	evcon_batch_hook *cork_hook; /* weak; NULL until the first stream gets corked output */
+};
+
+struct evcon_stream_queue {
+	evcon_stream_chunk *first, *last;
+	size_t length;
+};
+
+struct evcon_stream {
+	evcon_loop *loop;
+	evcon_fd_watcher *watcher;
+	evcon_fd fd;
+	evcon_stream_cb cb;
+	void *user_data;
+
+	evcon_stream_queue in, out;
+	size_t input_limit;
+	int error; /* errno of the failed read or write */
+
+	/* evcon_stream_splice: the input of splice_src goes to the output of splice_dst */
+	evcon_stream *splice_dst, *splice_src;
+
+	/* evcon_stream_set_cork: in the corked list of the cache while cork_queued */
+	evcon_stream *cork_prev, *cork_next;
+
+	/* error_pending: the failure wasn't returned to the caller, the callback reports it */
+	unsigned int reading:1, eof:1, failed:1, error_pending:1, incallback:1, delayed_delete:1, cork:1, cork_queued:1;
+};
+
+static evcon_stream_chunks* evcon_stream_cache(evcon_loop *loop) {
+	if (NULL == loop->chunks) loop->chunks = evcon_alloc0(loop->allocator, sizeof(evcon_stream_chunks));
+	return loop->chunks;
+}
+
+void evcon_stream_cache_release(evcon_loop *loop) {
+	evcon_stream_chunks *cache = loop->chunks;
+	evcon_stream_chunk *c;
+
+	while (NULL != (c = cache->buffers)) {
+		cache->buffers = c->next;
+		evcon_free(loop->allocator, c, EVCON_STREAM_CHUNK_ALLOC_SIZE);
+	}
+	while (NULL != (c = cache->headers)) {
+		cache->headers = c->next;
+		evcon_free(loop->allocator, c, sizeof(evcon_stream_chunk));
+	}
+	while (cache->pipes_count > 0) {
+		cache->pipes_count--;
+		close(cache->pipes[cache->pipes_count][0]);
+		close(cache->pipes[cache->pipes_count][1]);
+	}
+	if (NULL != cache->cork_hook) evcon_batch_hook_free(cache->cork_hook);
+
+	loop->chunks = NULL;
+	evcon_free(loop->allocator, cache, sizeof(evcon_stream_chunks));
+}
+
+static evcon_stream_chunk* evcon_stream_chunk_new(evcon_loop *loop) {
+	evcon_stream_chunks *cache = evcon_stream_cache(loop);
+	evcon_stream_chunk *c = cache->buffers;
+
+	if (NULL != c) {
+		cache->buffers = c->next;
+		cache->buffers_count--;
+	} else {
+		c = evcon_alloc(loop->allocator, EVCON_STREAM_CHUNK_ALLOC_SIZE);
+		c->type = EVCON_CHUNK_BUFFER;
+		c->data = (char*) c + EVCON_ALIGN(sizeof(evcon_stream_chunk));
+	}
+	c->next = NULL;
+	c->start = c->end = 0;
+	return c;
+}
+
+static evcon_stream_chunk* evcon_stream_chunk_new_header(evcon_loop *loop, evcon_stream_chunk_type type) {
+	evcon_stream_chunks *cache = evcon_stream_cache(loop);
+	evcon_stream_chunk *c = cache->headers;
+
+	if (NULL != c) {
+		cache->headers = c->next;
+		cache->headers_count--;
+	} else {
+		c = evcon_alloc(loop->allocator, sizeof(evcon_stream_chunk));
+	}
+	memset(c, 0, sizeof(evcon_stream_chunk));
+	c->type = type;
+	c->fds[0] = c->fds[1] = -1;
+	return c;
+}
+
+static evcon_stream_chunk* evcon_stream_chunk_new_external(evcon_loop *loop, const void *data, size_t len, evcon_stream_free_cb free_cb, void *free_data) {
+	evcon_stream_chunk *c = evcon_stream_chunk_new_header(loop, EVCON_CHUNK_EXTERNAL);
+
+	c->data = (char*) data;
+	c->end = len;
+	c->free_cb = free_cb;
+	c->free_data = free_data;
+	return c;
+}
+
+static evcon_stream_chunk* evcon_stream_chunk_new_file(evcon_loop *loop, evcon_fd fd, off_t offset, size_t len, evcon_stream_file_cb done_cb, void *free_data) {
+	evcon_stream_chunk *c = evcon_stream_chunk_new_header(loop, EVCON_CHUNK_FILE);
+
+	c->fds[0] = fd;
+	c->offset = offset;
+	c->end = len;
+	c->file_cb = done_cb;
+	c->free_data = free_data;
+	return c;
+}
+
+#ifdef HAVE_SPLICE
+/* empty pipe chunk; NULL if no pipe could be created (errno set) */
+static evcon_stream_chunk* evcon_stream_chunk_new_pipe(evcon_loop *loop) {
+	evcon_stream_chunks *cache = evcon_stream_cache(loop);
+	evcon_stream_chunk *c;
+	int fds[2];
+
+	if (cache->pipes_count > 0) {
+		cache->pipes_count--;
+		fds[0] = cache->pipes[cache->pipes_count][0];
+		fds[1] = cache->pipes[cache->pipes_count][1];
+	} else {
+#ifdef HAVE_PIPE2
+		if (-1 == pipe2(fds, O_NONBLOCK | O_CLOEXEC)) return NULL;
+#else
+		if (-1 == pipe(fds)) return NULL;
+		evcon_init_fd(fds[0]);
+		evcon_init_fd(fds[1]);
+#endif
+	}
+
+	c = evcon_stream_chunk_new_header(loop, EVCON_CHUNK_PIPE);
+	c->fds[0] = fds[0];
+	c->fds[1] = fds[1];
+	return c;
+}
+#endif
+
+static void evcon_stream_chunk_free(evcon_loop *loop, evcon_stream_chunk *c) {
+	evcon_stream_chunks *cache = loop->chunks;
+
+	switch (c->type) {
+	case EVCON_CHUNK_BUFFER:
+		if (cache->buffers_count < EVCON_STREAM_CACHE_MAX) {
+			c->next = cache->buffers;
+			cache->buffers = c;
+			cache->buffers_count++;
+		} else {
+			evcon_free(loop->allocator, c, EVCON_STREAM_CHUNK_ALLOC_SIZE);
+		}
+		return;
+	case EVCON_CHUNK_EXTERNAL:
+		if (NULL != c->free_cb) c->free_cb(c->data, c->end, c->free_data);
+		break;
+	case EVCON_CHUNK_FILE:
+		if (NULL != c->file_cb) c->file_cb(c->fds[0], c->free_data);
+		break;
+	case EVCON_CHUNK_PIPE:
+		/* only empty pipes can be reused */
+		if (c->start == c->end && cache->pipes_count < EVCON_STREAM_PIPE_CACHE_MAX) {
+			cache->pipes[cache->pipes_count][0] = c->fds[0];
+			cache->pipes[cache->pipes_count][1] = c->fds[1];
+			cache->pipes_count++;
+		} else {
+			close(c->fds[0]);
+			close(c->fds[1]);
+		}
+		break;
+	}
+
+	if (cache->headers_count < EVCON_STREAM_CACHE_MAX) {
+		c->next = cache->headers;
+		cache->headers = c;
+		cache->headers_count++;
+	} else {
+		evcon_free(loop->allocator, c, sizeof(evcon_stream_chunk));
+	}
+}
+
+static void evcon_stream_queue_append(evcon_stream_queue *q, evcon_stream_chunk *c) {
+	c->next = NULL;
+	if (NULL != q->last) {
+		q->last->next = c;
+	} else {
+		q->first = c;
+	}
+	q->last = c;
+	q->length += c->end - c->start;
+}
+
+/* free space at the end of the queue that may be filled */
+static size_t evcon_stream_queue_tail_space(evcon_stream_queue *q) {
+	evcon_stream_chunk *c = q->last;
+	return (NULL == c || EVCON_CHUNK_BUFFER != c->type) ? 0 : EVCON_STREAM_CHUNK_SIZE - c->end;
+}
+
+static void evcon_stream_queue_consume(evcon_loop *loop, evcon_stream_queue *q, size_t len) {
+	evcon_stream_chunk *c;
+
+	while (len > 0 && NULL != (c = q->first)) {
+		size_t n = c->end - c->start;
+
+		if (len < n) {
+			c->start += len;
+			q->length -= len;
+			return;
+		}
+
+		len -= n;
+		q->length -= n;
+		if (NULL == (q->first = c->next)) q->last = NULL;
+		evcon_stream_chunk_free(loop, c);
+	}
+}
+
+static void evcon_stream_queue_clear(evcon_loop *loop, evcon_stream_queue *q) {
+	evcon_stream_chunk *c, *next;
+
+	for (c = q->first; NULL != c; c = next) {
+		next = c->next;
+		evcon_stream_chunk_free(loop, c);
+	}
+	q->first = q->last = NULL;
+	q->length = 0;
+}
+
+/* copies into the free space of the last chunk and new chunks */
+static void evcon_stream_queue_copy(evcon_loop *loop, evcon_stream_queue *q, const char *buf, size_t len) {
+	while (len > 0) {
+		size_t space = evcon_stream_queue_tail_space(q), n;
+		evcon_stream_chunk *c;
+
+		if (0 == space) {
+			evcon_stream_queue_append(q, evcon_stream_chunk_new(loop));
+			space = EVCON_STREAM_CHUNK_SIZE;
+		}
+		c = q->last;
+		n = (len < space) ? len : space;
+		memcpy(c->data + c->end, buf, n);
+		c->end += n;
+		q->length += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void evcon_stream_fail(evcon_stream *stream, int err) {
+	stream->failed = 1;
+	stream->error = err;
+}
+
+static void evcon_stream_update_events(evcon_stream *stream) {
+	int events = 0;
+
+	if (!stream->failed) {
+		evcon_stream *dst = stream->splice_dst;
+		size_t buffered = (NULL != dst) ? dst->out.length : stream->in.length;
+
+		if (stream->reading && !stream->eof && (NULL == dst || !dst->failed)
+			&& (0 == stream->input_limit || buffered < stream->input_limit)) events |= EVCON_READ;
+		/* corked output waits for the batch end */
+		if (stream->out.length > 0 && !stream->cork_queued) events |= EVCON_WRITE;
+	} else if (stream->error_pending) {
+		/* a failed socket is writable (or in error state) right away */
+		events = EVCON_WRITE;
+	}
+
+	if (0 == events) {
+		evcon_fd_stop(stream->watcher);
+	} else {
+		/* evcon_fd_set_events always passes the change on */
+		if (events != evcon_fd_get_events(stream->watcher)) evcon_fd_set_events(stream->watcher, events);
+		evcon_fd_start(stream->watcher);
+	}
+}
+
+/* reads until EAGAIN, EOF or the input limit; returns the number of bytes read */
+static size_t evcon_stream_fill(evcon_stream *stream) {
+	size_t total = 0;
+
+	while (!stream->eof && !stream->failed && (0 == stream->input_limit || stream->in.length < stream->input_limit)) {
+		evcon_stream_chunk *fresh = evcon_stream_chunk_new(stream->loop);
+		size_t space = evcon_stream_queue_tail_space(&stream->in), n;
+		struct iovec iov[2];
+		int iovcnt = 0;
+		ssize_t r;
+
+		/* fill the last chunk first */
+		if (space > 0) {
+			iov[iovcnt].iov_base = stream->in.last->data + stream->in.last->end;
+			iov[iovcnt].iov_len = space;
+			iovcnt++;
+		}
+		iov[iovcnt].iov_base = fresh->data;
+		iov[iovcnt].iov_len = EVCON_STREAM_CHUNK_SIZE;
+		iovcnt++;
+
+		r = readv(stream->fd, iov, iovcnt);
+		if (r <= 0) {
+			evcon_stream_chunk_free(stream->loop, fresh);
+			if (0 == r) {
+				stream->eof = 1;
+			} else if (EINTR == errno) {
+				continue;
+			} else if (EAGAIN != errno && EWOULDBLOCK != errno) {
+				evcon_stream_fail(stream, errno);
+			}
+			break;
+		}
+
+		total += r;
+		n = ((size_t) r < space) ? (size_t) r : space;
+		if (n > 0) {
+			stream->in.last->end += n;
+			stream->in.length += n;
+		}
+		if ((size_t) r > space) {
+			fresh->end = r - space;
+			evcon_stream_queue_append(&stream->in, fresh);
+		} else {
+			evcon_stream_chunk_free(stream->loop, fresh);
+		}
+
+		/* short read: nothing left for now */
+		if ((size_t) r < space + EVCON_STREAM_CHUNK_SIZE) break;
+	}
+
+	return total;
+}
+
+#ifdef HAVE_SPLICE
+/* moves input directly into pipe chunks at the end of the output of splice_dst, until EAGAIN, EOF or
+ * the input limit; returns the number of bytes moved, or -1 if no pipe was available (nothing moved)
+ */
+static ssize_t evcon_stream_fill_splice(evcon_stream *stream) {
+	evcon_stream *dst = stream->splice_dst;
+	size_t total = 0;
+
+	while (!stream->eof && !stream->failed && (0 == stream->input_limit || dst->out.length < stream->input_limit)) {
+		evcon_stream_chunk *c = dst->out.last;
+		int fresh = 0;
+		ssize_t r;
+
+		if (NULL == c || EVCON_CHUNK_PIPE != c->type || c->pipe_full) {
+			if (NULL == (c = evcon_stream_chunk_new_pipe(stream->loop))) {
+				if (0 == total) return -1;
+				break;
+			}
+			fresh = 1;
+		}
+
+		r = splice(stream->fd, NULL, c->fds[1], NULL, EVCON_STREAM_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (r > 0) {
+			total += r;
+			c->end += r;
+			if (fresh) {
+				evcon_stream_queue_append(&dst->out, c);
+			} else {
+				dst->out.length += r;
+			}
+			continue;
+		}
+
+		if (fresh) evcon_stream_chunk_free(stream->loop, c);
+		if (0 == r) {
+			stream->eof = 1;
+		} else if (EINTR == errno) {
+			continue;
+		} else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+			/* either the pipe or the socket is empty; a fresh pipe tells which */
+			if (!fresh) {
+				c->pipe_full = 1;
+				continue;
+			}
+		} else if (EINVAL == errno && 0 == total) {
+			/* splice not supported for this fd */
+			return -1;
+		} else {
+			evcon_stream_fail(stream, errno);
+		}
+		break;
+	}
+
+	return total;
+}
+#endif
+
+/* some of the file range as buffer chunk in front of it; no sendfile for the fd (or at all) */
+static int evcon_stream_file_read(evcon_stream *stream, evcon_stream_chunk *c) {
+	evcon_stream_chunk *buf = evcon_stream_chunk_new(stream->loop);
+	size_t len = c->end - c->start;
+	ssize_t r;
+
+	if (len > EVCON_STREAM_CHUNK_SIZE) len = EVCON_STREAM_CHUNK_SIZE;
+	while (-1 == (r = pread(c->fds[0], buf->data, len, c->offset + c->start)) && EINTR == errno) ;
+	if (r <= 0) {
+		evcon_stream_chunk_free(stream->loop, buf);
+		/* the file is shorter than the range */
+		if (0 == r) errno = EIO;
+		return -1;
+	}
+
+	buf->end = r;
+	c->start += r;
+	stream->out.first = buf;
+	if (c->start < c->end) {
+		buf->next = c;
+	} else {
+		/* range done: the buffer replaces it */
+		if (NULL == (buf->next = c->next)) stream->out.last = buf;
+		evcon_stream_chunk_free(stream->loop, c);
+	}
+	return 0;
+}
+
+/* writes the first chunk of the queue (and following memory chunks with writev); returns the bytes written,
+ * or -1 with errno (EAGAIN: try again later). *want is set to the bytes that could have been written.
+ */
+static ssize_t evcon_stream_write_chunks(evcon_stream *stream, size_t *want) {
+	evcon_stream_chunk *c = stream->out.first;
+	struct iovec iov[EVCON_STREAM_IOV_MAX];
+	int iovcnt = 0;
+
+	switch (c->type) {
+	case EVCON_CHUNK_FILE:
+		*want = c->end - c->start;
+#ifdef HAVE_SENDFILE
+		if (!c->no_sendfile) {
+			off_t offset = c->offset + c->start;
+			ssize_t r;
+
+			if (*want > EVCON_STREAM_SENDFILE_MAX) *want = EVCON_STREAM_SENDFILE_MAX;
+			r = sendfile(stream->fd, c->fds[0], &offset, *want);
+			if (0 == r) errno = EIO; /* the file is shorter than the range */
+			if (r > 0 || (EINVAL != errno && ENOSYS != errno)) return (0 == r) ? -1 : r;
+			c->no_sendfile = 1;
+		}
+#endif
+		if (-1 == evcon_stream_file_read(stream, c)) return -1;
+		return evcon_stream_write_chunks(stream, want);
+	case EVCON_CHUNK_PIPE:
+		*want = c->end - c->start;
+#ifdef HAVE_SPLICE
+		return splice(c->fds[0], NULL, stream->fd, NULL, *want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+		errno = ENOSYS; /* not reached: pipe chunks are only created with splice */
+		return -1;
+#endif
+	default:
+		break;
+	}
+
+	*want = 0;
+	for (; NULL != c && iovcnt < EVCON_STREAM_IOV_MAX && (EVCON_CHUNK_BUFFER == c->type || EVCON_CHUNK_EXTERNAL == c->type); c = c->next) {
+		if (c->end == c->start) continue;
+		iov[iovcnt].iov_base = c->data + c->start;
+		iov[iovcnt].iov_len = c->end - c->start;
+		*want += iov[iovcnt].iov_len;
+		iovcnt++;
+	}
+
+	return writev(stream->fd, iov, iovcnt);
+}
+
+/* writes queued output until EAGAIN or the queue is empty; -1 on error */
+static int evcon_stream_flush(evcon_stream *stream) {
+	while (stream->out.length > 0 && !stream->failed) {
+		size_t want;
+		ssize_t r;
+
+		r = evcon_stream_write_chunks(stream, &want);
+		if (-1 == r) {
+			if (EINTR == errno) continue;
+			if (EAGAIN == errno || EWOULDBLOCK == errno) break;
+			evcon_stream_fail(stream, errno);
+			return -1;
+		}
+
+		evcon_stream_queue_consume(stream->loop, &stream->out, r);
+		if ((size_t) r < want) break;
+	}
+
+	return 0;
+}
+
+static void evcon_stream_emit(evcon_stream *stream, evcon_stream_event event) {
+	if (stream->delayed_delete || NULL == stream->cb) return;
+	if (EVCON_STREAM_ERROR == event) {
+		stream->error_pending = 0;
+		errno = stream->error;
+	}
+	stream->cb(stream->loop, stream, event, stream->user_data);
+}
+
+/* the output of @stream shrank: a splice source might read again */
+static void evcon_stream_output_drained(evcon_stream *stream) {
+	evcon_stream *src = stream->splice_src;
+
+	if (NULL != src && src != stream && !src->incallback) evcon_stream_update_events(src);
+}
+
+/* input of a splice source: moved to the output of splice_dst through pipes, or through chunks */
+static void evcon_stream_read_splice(evcon_stream *stream) {
+	evcon_stream *dst = stream->splice_dst;
+	int failed = dst->failed;
+	ssize_t r = -1;
+
+#ifdef HAVE_SPLICE
+	int was_empty = (0 == dst->out.length);
+
+	r = evcon_stream_fill_splice(stream);
+	if (r > 0 && was_empty) (void) evcon_stream_flush(dst);
+#endif
+	if (-1 == r && evcon_stream_fill(stream) > 0) (void) evcon_stream_write_input(dst, stream);
+
+	/* the destination isn't in a callback: report write errors through its watcher */
+	if (dst->failed && !failed) dst->error_pending = 1;
+	if (dst != stream && !dst->incallback) evcon_stream_update_events(dst);
+}
+
+static void evcon_stream_cork_unlink(evcon_stream *stream) {
+	evcon_stream_chunks *cache = stream->loop->chunks;
+
+	if (!stream->cork_queued) return;
+
+	if (NULL != stream->cork_prev) {
+		stream->cork_prev->cork_next = stream->cork_next;
+	} else {
+		cache->corked = stream->cork_next;
+	}
+	if (NULL != stream->cork_next) stream->cork_next->cork_prev = stream->cork_prev;
+	stream->cork_prev = stream->cork_next = NULL;
+	stream->cork_queued = 0;
+}
+
+/* writes corked output; errors are reported by the callback */
+static void evcon_stream_cork_flush(evcon_stream *stream) {
+	evcon_stream_cork_unlink(stream);
+
+	if (!stream->failed && -1 == evcon_stream_flush(stream)) {
+		evcon_stream_queue_clear(stream->loop, &stream->out);
+		stream->error_pending = 1;
+	} else {
+		evcon_stream_output_drained(stream);
+	}
+	if (!stream->incallback) evcon_stream_update_events(stream);
+}
+
+static void evcon_stream_cork_hook_cb(evcon_loop *loop, evcon_batch_hook *hook, void *user_data) {
+	evcon_stream_chunks *cache = user_data;
+	UNUSED(loop);
+	UNUSED(hook);
+
+	while (NULL != cache->corked) evcon_stream_cork_flush(cache->corked);
+}
+
+static void evcon_stream_cork_queue(evcon_stream *stream) {
+	evcon_loop *loop = stream->loop;
+	evcon_stream_chunks *cache = loop->chunks;
+
+	if (stream->cork_queued) return;
+
+	/* weak: the cache (and the hook) live as long as the loop */
+	if (NULL == cache->cork_hook) cache->cork_hook = evcon_batch_hook_alloc(loop, evcon_stream_cork_hook_cb, cache, 1);
+
+	stream->cork_queued = 1;
+	stream->cork_prev = NULL;
+	stream->cork_next = cache->corked;
+	if (NULL != cache->corked) cache->corked->cork_prev = stream;
+	cache->corked = stream;
+}
+
+static void evcon_stream_fd_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	evcon_stream *stream = user_data;
+	UNUSED(loop);
+	UNUSED(watcher);
+	UNUSED(fd);
+
+	stream->incallback = 1;
+
+	if (stream->error_pending) {
+		stream->error_pending = 0;
+		evcon_stream_emit(stream, EVCON_STREAM_ERROR);
+	}
+
+	if (0 != (revents & (EVCON_WRITE | EVCON_ERROR)) && stream->out.length > 0 && !stream->failed) {
+		if (-1 == evcon_stream_flush(stream)) {
+			evcon_stream_emit(stream, EVCON_STREAM_ERROR);
+		} else {
+			evcon_stream_output_drained(stream);
+			if (0 == stream->out.length) evcon_stream_emit(stream, EVCON_STREAM_DRAINED);
+		}
+	}
+
+	if (0 != (revents & (EVCON_READ | EVCON_ERROR)) && stream->reading && !stream->failed && !stream->eof && !stream->delayed_delete) {
+		if (NULL != stream->splice_dst) {
+			evcon_stream_read_splice(stream);
+		} else if (evcon_stream_fill(stream) > 0) {
+			evcon_stream_emit(stream, EVCON_STREAM_READ);
+		}
+		if (stream->failed) {
+			evcon_stream_emit(stream, EVCON_STREAM_ERROR);
+		} else if (stream->eof) {
+			evcon_stream_emit(stream, EVCON_STREAM_EOF);
+		}
+	}
+
+	stream->incallback = 0;
+
+	if (stream->delayed_delete) {
+		evcon_stream_free(stream);
+	} else {
+		evcon_stream_update_events(stream);
+	}
+}
+
+evcon_stream* evcon_stream_new(evcon_loop *loop, evcon_fd fd, evcon_stream_cb cb, void *user_data) {
+	evcon_stream *stream = evcon_alloc0(loop->allocator, sizeof(evcon_stream));
+
+	evcon_init_fd(fd);
+	stream->loop = loop;
+	stream->fd = fd;
+	stream->cb = cb;
+	stream->user_data = user_data;
+	stream->input_limit = EVCON_STREAM_DEFAULT_INPUT_LIMIT;
+	stream->reading = 1;
+
+	/* the watcher keeps the loop (and so the chunk cache) alive */
+	stream->watcher = evcon_fd_new(loop, evcon_stream_fd_cb, fd, EVCON_READ, stream);
+	evcon_stream_cache(loop);
+	evcon_fd_start(stream->watcher);
+
+	return stream;
+}
+
+void evcon_stream_free(evcon_stream *stream) {
+	evcon_loop *loop = stream->loop;
+	evcon_fd_watcher *watcher = stream->watcher;
+	evcon_fd fd = stream->fd;
+
+	if (stream->incallback) {
+		stream->delayed_delete = 1;
+		return;
+	}
+
+	evcon_stream_splice(stream, NULL);
+	if (NULL != stream->splice_src) evcon_stream_splice(stream->splice_src, NULL);
+	evcon_stream_cork_unlink(stream);
+
+	evcon_stream_queue_clear(loop, &stream->in);
+	evcon_stream_queue_clear(loop, &stream->out);
+	evcon_free(loop->allocator, stream, sizeof(evcon_stream));
+
+	/* might drop the last loop reference */
+	evcon_fd_free(watcher);
+	close(fd);
+}
+
+void evcon_stream_set_input_limit(evcon_stream *stream, size_t limit) {
+	stream->input_limit = limit;
+	if (!stream->incallback) evcon_stream_update_events(stream);
+}
+
+void evcon_stream_set_cork(evcon_stream *stream, int cork) {
+	stream->cork = (0 != cork);
+	if (!stream->cork && stream->cork_queued) evcon_stream_cork_flush(stream);
+}
+
+void evcon_stream_set_reading(evcon_stream *stream, int reading) {
+	stream->reading = (0 != reading);
+	if (!stream->incallback) evcon_stream_update_events(stream);
+}
+
+size_t evcon_stream_input_length(evcon_stream *stream) {
+	return stream->in.length;
+}
+
+size_t evcon_stream_peek(evcon_stream *stream, struct iovec *iov, size_t iovcnt) {
+	evcon_stream_chunk *c;
+	size_t n = 0;
+
+	for (c = stream->in.first; NULL != c && n < iovcnt; c = c->next) {
+		if (c->end == c->start) continue;
+		iov[n].iov_base = c->data + c->start;
+		iov[n].iov_len = c->end - c->start;
+		n++;
+	}
+	return n;
+}
+
+void evcon_stream_consume(evcon_stream *stream, size_t len) {
+	evcon_stream_queue_consume(stream->loop, &stream->in, len);
+	if (!stream->incallback) evcon_stream_update_events(stream);
+}
+
+size_t evcon_stream_read(evcon_stream *stream, void *buf, size_t len) {
+	evcon_stream_chunk *c;
+	size_t done = 0;
+
+	for (c = stream->in.first; NULL != c && done < len; c = c->next) {
+		size_t n = c->end - c->start;
+		if (n > len - done) n = len - done;
+		memcpy((char*) buf + done, c->data + c->start, n);
+		done += n;
+	}
+
+	evcon_stream_consume(stream, done);
+	return done;
+}
+
+/* after new output was queued: write right away if the stream wasn't waiting for the fd already.
+ * corked output waits for the batch end; outside of batches (no callback running) nothing would end one.
+ */
+static int evcon_stream_queued(evcon_stream *stream, int was_empty) {
+	if (was_empty && stream->cork && stream->loop->batch_depth > 0) {
+		evcon_stream_cork_queue(stream);
+		return 0;
+	}
+	if (was_empty && -1 == evcon_stream_flush(stream)) {
+		evcon_stream_queue_clear(stream->loop, &stream->out);
+		errno = stream->error;
+		if (!stream->incallback) evcon_stream_update_events(stream);
+		return -1;
+	}
+	if (was_empty) evcon_stream_output_drained(stream);
+	if (!stream->incallback) evcon_stream_update_events(stream);
+	return 0;
+}
+
+int evcon_stream_write(evcon_stream *stream, const void *buf, size_t len) {
+	int was_empty = (0 == stream->out.length);
+
+	if (stream->failed) {
+		errno = stream->error;
+		return -1;
+	}
+
+	evcon_stream_queue_copy(stream->loop, &stream->out, buf, len);
+	return evcon_stream_queued(stream, was_empty);
+}
+
+int evcon_stream_write_external(evcon_stream *stream, const void *data, size_t len, evcon_stream_free_cb free_cb, void *free_data) {
+	int was_empty = (0 == stream->out.length);
+
+	if (stream->failed) {
+		if (NULL != free_cb) free_cb(data, len, free_data);
+		errno = stream->error;
+		return -1;
+	}
+	if (0 == len) {
+		if (NULL != free_cb) free_cb(data, len, free_data);
+		return 0;
+	}
+
+	evcon_stream_queue_append(&stream->out, evcon_stream_chunk_new_external(stream->loop, data, len, free_cb, free_data));
+	return evcon_stream_queued(stream, was_empty);
+}
+
+int evcon_stream_write_input(evcon_stream *dst, evcon_stream *src) {
+	int was_empty = (0 == dst->out.length);
+	evcon_stream_chunk *c, *next;
+
+	assert(dst->loop == src->loop);
+
+	if (dst->failed) {
+		evcon_stream_queue_clear(src->loop, &src->in);
+		errno = dst->error;
+		return -1;
+	}
+
+	for (c = src->in.first; NULL != c; c = next) {
+		next = c->next;
+		evcon_stream_queue_append(&dst->out, c);
+	}
+	src->in.first = src->in.last = NULL;
+	src->in.length = 0;
+	if (src != dst && !src->incallback) evcon_stream_update_events(src);
+
+	return evcon_stream_queued(dst, was_empty);
+}
+
+int evcon_stream_write_file(evcon_stream *stream, evcon_fd fd, off_t offset, size_t len, evcon_stream_file_cb done_cb, void *free_data) {
+	int was_empty = (0 == stream->out.length);
+
+	if (stream->failed || 0 == len) {
+		if (NULL != done_cb) done_cb(fd, free_data);
+		if (0 == len) return 0;
+		errno = stream->error;
+		return -1;
+	}
+
+	evcon_stream_queue_append(&stream->out, evcon_stream_chunk_new_file(stream->loop, fd, offset, len, done_cb, free_data));
+	return evcon_stream_queued(stream, was_empty);
+}
+
+int evcon_stream_splice(evcon_stream *src, evcon_stream *dst) {
+	evcon_stream *old = src->splice_dst;
+
+	if (NULL != old) {
+		old->splice_src = NULL;
+		src->splice_dst = NULL;
+	}
+
+	if (NULL != dst) {
+		assert(dst->loop == src->loop);
+		/* one source per destination */
+		if (NULL != dst->splice_src) evcon_stream_splice(dst->splice_src, NULL);
+
+		src->splice_dst = dst;
+		dst->splice_src = src;
+		if (src->in.length > 0 && -1 == evcon_stream_write_input(dst, src)) return -1;
+	}
+
+	if (!src->incallback) evcon_stream_update_events(src);
+	return 0;
+}
+
+size_t evcon_stream_output_length(evcon_stream *stream) {
+	return stream->out.length;
+}
+
+evcon_fd evcon_stream_get_fd(evcon_stream *stream) {
+	return stream->fd;
+}
+evcon_loop* evcon_stream_get_loop(evcon_stream *stream) {
+	return stream->loop;
+}
+void* evcon_stream_get_user_data(evcon_stream *stream) {
+	return stream->user_data;
+}
+
+void evcon_stream_set_cb(evcon_stream *stream, evcon_stream_cb cb) {
+	stream->cb = cb;
+}
+void evcon_stream_set_user_data(evcon_stream *stream, void *user_data) {
+	stream->user_data = user_data;
+}
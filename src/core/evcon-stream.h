@@ -0,0 +1,98 @@
+#ifndef __EVCON_EVCON_STREAM_H
+#define __EVCON_EVCON_STREAM_H __EVCON_EVCON_STREAM_H
+
+#include <evcon.h>
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Streams: buffered I/O on a (non-blocking) fd, driven by an fd watcher the stream owns.
+ * input and output are chains of fixed-size chunks (EVCON_STREAM_CHUNK_SIZE) from a per-loop cache,
+ * read with readv and written with writev. output can also come from files (sendfile) or be spliced from
+ * another stream. write interest is only registered while output is queued.
+ * not thread-safe: use a stream only in the thread of its loop.
+ */
+
+typedef struct evcon_stream evcon_stream;
+
+#define EVCON_STREAM_CHUNK_SIZE (16*1024)
+/* bytes per sendfile call; larger file ranges take several */
+#define EVCON_STREAM_SENDFILE_MAX (1024*1024*1024)
+
+typedef enum {
+	EVCON_STREAM_READ,    /* new input is buffered */
+	EVCON_STREAM_DRAINED, /* all queued output was written (only reported after the stream had to wait for the fd) */
+	EVCON_STREAM_EOF,     /* the peer closed its side; reading stops, buffered input is still available */
+	EVCON_STREAM_ERROR    /* read or write failed (errno is set); the stream stops watching the fd */
+} evcon_stream_event;
+
+typedef void (*evcon_stream_cb)(evcon_loop *loop, evcon_stream *stream, evcon_stream_event event, void *user_data);
+/* external output buffer (evcon_stream_write_external) is not needed anymore */
+typedef void (*evcon_stream_free_cb)(const void *data, size_t len, void *free_data);
+/* file range (evcon_stream_write_file) was sent or dropped; close @fd here if the stream should own it */
+typedef void (*evcon_stream_file_cb)(evcon_fd fd, void *free_data);
+
+/* takes ownership of @fd (sets it non-blocking); reading starts right away */
+evcon_stream* evcon_stream_new(evcon_loop *loop, evcon_fd fd, evcon_stream_cb cb, void *user_data);
+/* closes the fd and drops buffered data (external buffers are released); can be called from the callback */
+void evcon_stream_free(evcon_stream *stream);
+
+/* reading stops while at least @limit bytes of input are buffered (default 4 chunks), and
+ * continues once the input was consumed below it. 0 means no limit.
+ */
+void evcon_stream_set_input_limit(evcon_stream *stream, size_t limit);
+void evcon_stream_set_reading(evcon_stream *stream, int reading); /* pause (0) / resume (1) reading */
+/* corked (1): output is not written right away, but once at the end of the batch (see evcon_batch_hook_new), so
+ * the writes of all callbacks in a loop iteration go out in one writev. write errors are reported by the callback
+ * then. outside of callbacks and batches corked output is written right away. uncorking (0) writes pending output
+ * right away.
+ */
+void evcon_stream_set_cork(evcon_stream *stream, int cork);
+
+size_t evcon_stream_input_length(evcon_stream *stream);
+/* fills up to @iovcnt buffers with the buffered input (without consuming it); returns the number used */
+size_t evcon_stream_peek(evcon_stream *stream, struct iovec *iov, size_t iovcnt);
+void evcon_stream_consume(evcon_stream *stream, size_t len);
+/* copies and consumes up to @len bytes of input; returns the number of bytes copied */
+size_t evcon_stream_read(evcon_stream *stream, void *buf, size_t len);
+
+/* output. if nothing is queued yet the data is written right away, the rest is queued.
+ * returns -1 (with errno set) if the stream already failed or the write failed; the data is
+ * dropped then (external buffers are released). 0 otherwise.
+ */
+int evcon_stream_write(evcon_stream *stream, const void *buf, size_t len);
+/* zero-copy: queues @data itself, which must stay valid until @free_cb (may be NULL) is called */
+int evcon_stream_write_external(evcon_stream *stream, const void *data, size_t len, evcon_stream_free_cb free_cb, void *free_data);
+/* zero-copy: moves all buffered input of @src to the output of @dst (both on the same loop; may be the same stream) */
+int evcon_stream_write_input(evcon_stream *dst, evcon_stream *src);
+/* queues @len bytes of the (regular) file @fd from @offset, sent with sendfile() (no copy to userspace) where
+ * the platform and fd support it, otherwise read into chunks piece by piece. the file position of @fd is not used.
+ */
+int evcon_stream_write_file(evcon_stream *stream, evcon_fd fd, off_t offset, size_t len, evcon_stream_file_cb done_cb, void *free_data);
+size_t evcon_stream_output_length(evcon_stream *stream);
+
+/* proxying: input of @src goes to the output of @dst (same loop) instead of the input buffer of @src; with
+ * splice() (linux) it is moved through pipes from a per-loop cache without touching userspace, otherwise
+ * through chunks. buffered input of @src is moved first. @src reports EOF and ERROR but not READ, and stops
+ * reading while the output of @dst holds the input limit of @src. a @dst has one source at a time;
+ * NULL @dst (or freeing either stream) stops it. write errors on @dst are reported by @dst.
+ */
+int evcon_stream_splice(evcon_stream *src, evcon_stream *dst);
+
+evcon_fd evcon_stream_get_fd(evcon_stream *stream);
+evcon_loop* evcon_stream_get_loop(evcon_stream *stream);
+void* evcon_stream_get_user_data(evcon_stream *stream);
+
+void evcon_stream_set_cb(evcon_stream *stream, evcon_stream_cb cb);
+void evcon_stream_set_user_data(evcon_stream *stream, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,68 +1,29 @@
+#define _GNU_SOURCE
 
-#include <evcon.h>
-#include <evcon-backend.h>
-#include <evcon-allocator.h>
+#include "evcon-private.h"
 
 #include <evcon-config-private.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(HAVE_EVENTFD) && defined(HAVE_SYS_EVENTFD_H)
+# include <sys/eventfd.h>
+# define EVCON_USE_EVENTFD 1
+#endif
 
-#define EVCON_STR_LEN(s) (s), (sizeof(s)-1)
-
-struct evcon_allocator {
-	void* user_data;
-	evcon_alloc_cb alloc_cb;
-	evcon_free_cb free_cb;
-};
-
-struct evcon_backend {
-	void *backend_data;
-	evcon_allocator *allocator;
-	evcon_backend_free_loop_cb free_loop_cb;
-	evcon_backend_fd_update_cb fd_update_cb;
-	evcon_backend_timer_update_cb timer_update_cb;
-	evcon_backend_async_update_cb async_update_cb;
-};
-
-struct evcon_loop {
-	unsigned int refcount;
-	void *backend_data;
-	evcon_backend *backend;
-	evcon_allocator *allocator;
-};
-
-struct evcon_fd_watcher {
-	void *user_data;
-	void *backend_data;
-	unsigned int active:1, incallback:1, delayed_delete:1;
-	evcon_loop *loop;
-	evcon_fd_cb cb;
-	evcon_fd fd;
-	int events;
-};
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 
-struct evcon_timer_watcher {
-	void *user_data;
-	void *backend_data;
-	unsigned int active:1, incallback:1, delayed_delete:1;
-	evcon_loop *loop;
-	evcon_timer_cb cb;
-	evcon_interval timeout, repeat;
-};
 
-struct evcon_async_watcher {
-	void *user_data;
-	void *backend_data;
-	unsigned int incallback:1, delayed_delete:1;
-	evcon_loop *loop;
-	evcon_async_cb cb;
-};
+#define EVCON_STR_LEN(s) (s), (sizeof(s)-1)
 
 /*****************************************************
  *             Allocator                             *
@@ -164,6 +125,10 @@ evcon_backend* evcon_backend_new(void *backend_data,
 	backend->fd_update_cb = fd_update_cb;
 	backend->timer_update_cb = timer_update_cb;
 	backend->async_update_cb = async_update_cb;
+	backend->fd_data_size = backend->timer_data_size = backend->async_data_size = 0;
+	backend->fd_batching = 0;
+	backend->fd_dirty_cb = NULL;
+	backend->accept_cb = NULL;
 
 	return backend;
 }
@@ -194,11 +159,30 @@ evcon_backend* evcon_backend_init(char *mem, size_t memsize,
 		backend->fd_update_cb = fd_update_cb;
 		backend->timer_update_cb = timer_update_cb;
 		backend->async_update_cb = async_update_cb;
+		backend->fd_data_size = backend->timer_data_size = backend->async_data_size = 0;
+		backend->fd_batching = 0;
+		backend->fd_dirty_cb = NULL;
+		backend->accept_cb = NULL;
 	}
 
 	return backend;
 }
 
+void evcon_backend_set_watcher_data_sizes(evcon_backend *backend, size_t fd_size, size_t timer_size, size_t async_size) {
+	backend->fd_data_size = fd_size;
+	backend->timer_data_size = timer_size;
+	backend->async_data_size = async_size;
+}
+
+void evcon_backend_set_fd_batching(evcon_backend *backend, evcon_backend_fd_dirty_cb dirty_cb) {
+	backend->fd_batching = 1;
+	backend->fd_dirty_cb = dirty_cb;
+}
+
+void evcon_backend_set_accept(evcon_backend *backend, evcon_backend_accept_cb accept_cb) {
+	backend->accept_cb = accept_cb;
+}
+
 evcon_loop* evcon_loop_new(evcon_backend *backend, evcon_allocator *allocator) {
 	evcon_loop *loop;
 
@@ -221,6 +205,9 @@ void* evcon_loop_get_backend_data(evcon_loop *loop) {
 void* evcon_fd_get_backend_data(evcon_fd_watcher *watcher) {
 	return watcher->backend_data;
 }
+int evcon_fd_is_rearm(evcon_fd_watcher *watcher) {
+	return watcher->rearm;
+}
 void* evcon_timer_get_backend_data(evcon_timer_watcher *watcher) {
 	return watcher->backend_data;
 }
@@ -244,78 +231,1202 @@ void evcon_async_set_backend_data(evcon_async_watcher *watcher, void *data) {
 	watcher->backend_data = data;
 }
 
+static void evcon_fd_dirty_unlink(evcon_fd_watcher *watcher) {
+	evcon_loop *loop = watcher->loop;
+
+	if (NULL != watcher->dirty_prev) watcher->dirty_prev->dirty_next = watcher->dirty_next;
+	else loop->fd_dirty_first = watcher->dirty_next;
+	if (NULL != watcher->dirty_next) watcher->dirty_next->dirty_prev = watcher->dirty_prev;
+	else loop->fd_dirty_last = watcher->dirty_prev;
+
+	watcher->dirty_prev = watcher->dirty_next = NULL;
+	watcher->dirty = 0;
+}
+
+/* passes the current state to the backend now */
 static void evcon_backend_fd_update(evcon_fd_watcher *watcher) {
 	evcon_backend *backend = watcher->loop->backend;
 	int fd = watcher->fd, events = watcher->events;
+	if (watcher->dirty) evcon_fd_dirty_unlink(watcher);
 	if (!watcher->active || -1 == fd) events = 0;
+	EVCON_STAT_INC(watcher->loop, fd_updates);
 	backend->fd_update_cb(watcher, fd, events, watcher->loop->allocator, watcher->loop->backend_data, watcher->backend_data);
+	watcher->rearm = 0;
 }
 
-/* this restarts an active timer! */
-static void evcon_backend_timer_update(evcon_timer_watcher *watcher) {
+/* start/stop and event changes: with fd batching only queue the watcher, several changes end up as one update.
+ * fd changes are passed on immediately (events for the old fd must not reach the watcher).
+ */
+static void evcon_fd_changed(evcon_fd_watcher *watcher) {
+	evcon_loop *loop = watcher->loop;
+
+	if (!loop->backend->fd_batching) {
+		evcon_backend_fd_update(watcher);
+		return;
+	}
+
+	if (watcher->dirty) {
+		EVCON_STAT_INC(loop, updates_skipped);
+		return;
+	}
+
+	watcher->dirty = 1;
+	watcher->dirty_next = NULL;
+	watcher->dirty_prev = loop->fd_dirty_last;
+	if (NULL != loop->fd_dirty_last) {
+		loop->fd_dirty_last->dirty_next = watcher;
+	} else {
+		loop->fd_dirty_first = watcher;
+		if (NULL != loop->backend->fd_dirty_cb) loop->backend->fd_dirty_cb(loop, loop->backend_data, loop->backend->backend_data);
+	}
+	loop->fd_dirty_last = watcher;
+}
+
+void evcon_loop_flush_fd_updates(evcon_loop *loop) {
+	while (NULL != loop->fd_dirty_first) {
+		evcon_backend_fd_update(loop->fd_dirty_first);
+	}
+}
+
+static void evcon_timer_wheel_update(evcon_timer_wheel *wheel, evcon_timer_watcher *watcher, evcon_interval timeout);
+
+/* delays the (absolute) @deadline by up to @slack so it lands on a multiple of the largest power of two <= @slack;
+ * timers with similar expiries then share a deadline (and a wakeup)
+ */
+static evcon_interval evcon_timer_apply_slack(evcon_interval deadline, evcon_interval slack) {
+	evcon_interval step = 1;
+
+	while (step <= slack / 2) step <<= 1;
+	if (step <= 1) return deadline;
+
+	return (deadline + step - 1) / step * step;
+}
+
+static void evcon_backend_timer_arm(evcon_timer_watcher *watcher, evcon_interval timeout) {
 	evcon_backend *backend = watcher->loop->backend;
-	evcon_interval timeout = watcher->timeout;
-	if (!watcher->active || timeout < 0) timeout = -1;
+	if (watcher->wheel) {
+		evcon_timer_wheel_update(watcher->loop->wheel, watcher, timeout);
+		return;
+	}
+	EVCON_STAT_INC(watcher->loop, timer_updates);
 	backend->timer_update_cb(watcher, timeout, watcher->loop->allocator, watcher->loop->backend_data, watcher->backend_data);
 }
+
+/* this restarts an active timer! */
+static void evcon_backend_timer_update(evcon_timer_watcher *watcher) {
+	evcon_interval timeout = watcher->timeout, now, deadline;
+
+	watcher->lazy = 0;
+	if (!watcher->active || timeout < 0) {
+		watcher->deadline = watcher->backend_deadline = -1;
+		evcon_backend_timer_arm(watcher, -1);
+		return;
+	}
+
+	now = evcon_monotonic_now();
+	deadline = now + timeout;
+	if (watcher->slack > 0) {
+		deadline = evcon_timer_apply_slack(deadline, watcher->slack);
+		timeout = deadline - now;
+	}
+	watcher->deadline = deadline;
+
+	if (-1 != watcher->backend_deadline && deadline >= watcher->backend_deadline) {
+		/* backend timer triggers first; see evcon_feed_timer */
+		watcher->lazy = (deadline > watcher->backend_deadline);
+		EVCON_STAT_INC(watcher->loop, updates_skipped);
+		return;
+	}
+
+	watcher->backend_deadline = deadline;
+	evcon_backend_timer_arm(watcher, timeout);
+}
 /* tell backend to delete timer */
 static void evcon_backend_timer_delete(evcon_timer_watcher *watcher) {
 	evcon_backend *backend = watcher->loop->backend;
+	if (watcher->wheel) {
+		evcon_timer_wheel_update(watcher->loop->wheel, watcher, -1);
+		return;
+	}
+	EVCON_STAT_INC(watcher->loop, timer_updates);
 	backend->timer_update_cb(watcher, -2, watcher->loop->allocator, watcher->loop->backend_data, watcher->backend_data);
 }
 
-void evcon_feed_fd(evcon_fd_watcher *watcher, int events) {
+static uint64_t evcon_callback_timing_now(void);
+static void evcon_callback_timing_done(evcon_callback_timing *timing, evcon_loop *loop, evcon_watcher_type type, void *watcher, evcon_generic_cb cb, uint64_t start);
+
+/* returns 0 if the callback didn't run */
+static int evcon_feed_fd_dispatch(evcon_fd_watcher *watcher, int events) {
+	evcon_callback_timing *timing = watcher->loop->timing;
+	evcon_fd_cb cb = watcher->cb;
 	int oldfd, oldevents;
-	if (watcher->incallback) return;
+	uint64_t start = 0;
+	if (watcher->incallback) return 0;
+
+	/* with fd batching the backend might not know about a stop or event change yet */
+	events &= EVCON_ERROR | watcher->events;
+	if (!watcher->active || 0 == events) return 0;
 
 	oldfd = watcher->fd;
 	oldevents = watcher->events;
 
+	EVCON_STAT_INC(watcher->loop, fd_callbacks);
 	watcher->incallback = 1;
-	watcher->cb(watcher->loop, watcher, oldfd, events, watcher->user_data);
+	if (NULL != timing) start = evcon_callback_timing_now();
+	cb(watcher->loop, watcher, oldfd, events, watcher->user_data);
+	if (NULL != timing) evcon_callback_timing_done(timing, watcher->loop, EVCON_WATCHER_FD, watcher, (evcon_generic_cb) cb, start);
 	watcher->incallback = 0;
 
 	if (watcher->delayed_delete) {
 		evcon_fd_free(watcher);
-		return;
+		return 1;
+	}
+
+	if (oldfd != watcher->fd || watcher->rearm) {
+		evcon_backend_fd_update(watcher);
+	} else if (oldevents != watcher->events) {
+		evcon_fd_changed(watcher);
+	}
+	return 1;
+}
+
+void evcon_feed_fd(evcon_fd_watcher *watcher, int events) {
+	evcon_loop *loop = watcher->loop;
+
+	/* a single callback is a batch too */
+	evcon_loop_batch_begin(loop);
+	(void) evcon_feed_fd_dispatch(watcher, events);
+	evcon_loop_batch_end(loop);
+}
+
+void evcon_feed_fd_batch(evcon_loop *loop, evcon_fd_event *events, unsigned int count) {
+	unsigned int i;
+
+	assert(NULL == loop->fd_batch);
+
+	evcon_loop_batch_begin(loop);
+	loop->fd_batch = events;
+	loop->fd_batch_count = count;
+	for (i = 0; i < count; ++i) {
+		evcon_fd_watcher *watcher = events[i].watcher;
+
+		loop->fd_batch_next = i + 1;
+		if (i + 1 < count) EVCON_PREFETCH(events[i + 1].watcher);
+
+		/* freed (entry cleared by evcon_fd_free) or moved to another fd by an earlier callback */
+		if (NULL == watcher || watcher->fd != events[i].fd) continue;
+		(void) evcon_feed_fd_dispatch(watcher, events[i].events);
 	}
+	loop->fd_batch = NULL;
+	evcon_loop_batch_end(loop);
+}
 
-	if (oldfd != watcher->fd || oldevents != watcher->events) evcon_backend_fd_update(watcher);
+/* the watcher is freed: drop it from the rest of the batch */
+static void evcon_fd_batch_forget(evcon_loop *loop, evcon_fd_watcher *watcher) {
+	unsigned int i;
+
+	for (i = loop->fd_batch_next; i < loop->fd_batch_count; ++i) {
+		if (loop->fd_batch[i].watcher == watcher) loop->fd_batch[i].watcher = NULL;
+	}
 }
 
 void evcon_feed_timer(evcon_timer_watcher *watcher) {
+	evcon_loop *loop = watcher->loop;
+	evcon_callback_timing *timing = watcher->loop->timing;
+	evcon_timer_cb cb = watcher->cb;
+	uint64_t start = 0;
 	if (watcher->incallback) return;
+
+	watcher->backend_deadline = -1;
+	if (watcher->lazy) {
+		evcon_interval now = evcon_monotonic_now();
+		watcher->lazy = 0;
+		if (watcher->deadline > now) {
+			/* restarted after the backend timer was armed: not expired yet */
+			watcher->backend_deadline = watcher->deadline;
+			evcon_backend_timer_arm(watcher, watcher->deadline - now);
+			return;
+		}
+	}
+
 	watcher->timeout = watcher->repeat;
 
+	evcon_loop_batch_begin(loop);
+	EVCON_STAT_INC(watcher->loop, timer_callbacks);
 	watcher->incallback = 1;
-	watcher->cb(watcher->loop, watcher, watcher->user_data);
+	if (NULL != timing) start = evcon_callback_timing_now();
+	cb(watcher->loop, watcher, watcher->user_data);
+	if (NULL != timing) evcon_callback_timing_done(timing, watcher->loop, EVCON_WATCHER_TIMER, watcher, (evcon_generic_cb) cb, start);
 	watcher->incallback = 0;
 
 	if (watcher->delayed_delete) {
 		evcon_timer_free(watcher);
-		return;
+	} else {
+		evcon_backend_timer_update(watcher);
 	}
-
-	evcon_backend_timer_update(watcher);
+	evcon_loop_batch_end(loop);
 }
 
 void evcon_feed_async(evcon_async_watcher *watcher) {
+	evcon_loop *loop = watcher->loop;
+	evcon_callback_timing *timing = watcher->loop->timing;
+	evcon_async_cb cb = watcher->cb;
+	uint64_t start = 0;
 	if (watcher->incallback) return;
 
+	evcon_loop_batch_begin(loop);
+	EVCON_STAT_INC(watcher->loop, async_callbacks);
 	watcher->incallback = 1;
-	watcher->cb(watcher->loop, watcher, watcher->user_data);
+	if (NULL != timing) start = evcon_callback_timing_now();
+	cb(watcher->loop, watcher, watcher->user_data);
+	if (NULL != timing) evcon_callback_timing_done(timing, watcher->loop, EVCON_WATCHER_ASYNC, watcher, (evcon_generic_cb) cb, start);
 	watcher->incallback = 0;
 
-	if (watcher->delayed_delete) {
-		evcon_async_free(watcher);
+	if (watcher->delayed_delete) evcon_async_free(watcher);
+	evcon_loop_batch_end(loop);
+}
+
+/*****************************************************
+ *             Backend helpers                       *
+ *****************************************************/
+
+evcon_interval evcon_monotonic_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return EVCON_INTERVAL_FROM_SEC(ts.tv_sec) + (evcon_interval) ts.tv_nsec / (1000000000 / EVCON_INTERVAL_FROM_SEC(1));
+}
+
+#define EVCON_HEAP_PARENT(i) (((i)-1)/2)
+#define EVCON_HEAP_LEFT(i) (2*(i)+1)
+
+static void evcon_heap_set(evcon_heap *heap, unsigned int i, evcon_heap_node *node) {
+	heap->nodes[i] = node;
+	node->ndx = i + 1;
+}
+
+static void evcon_heap_sift_up(evcon_heap *heap, unsigned int i) {
+	evcon_heap_node *node = heap->nodes[i];
+
+	while (i > 0 && heap->nodes[EVCON_HEAP_PARENT(i)]->key > node->key) {
+		evcon_heap_set(heap, i, heap->nodes[EVCON_HEAP_PARENT(i)]);
+		i = EVCON_HEAP_PARENT(i);
+	}
+	evcon_heap_set(heap, i, node);
+}
+
+static void evcon_heap_sift_down(evcon_heap *heap, unsigned int i) {
+	evcon_heap_node *node = heap->nodes[i];
+
+	for (;;) {
+		unsigned int child = EVCON_HEAP_LEFT(i);
+		if (child >= heap->used) break;
+		if (child + 1 < heap->used && heap->nodes[child + 1]->key < heap->nodes[child]->key) ++child;
+		if (heap->nodes[child]->key >= node->key) break;
+		evcon_heap_set(heap, i, heap->nodes[child]);
+		i = child;
+	}
+	evcon_heap_set(heap, i, node);
+}
+
+void evcon_heap_init(evcon_heap *heap, evcon_allocator *allocator) {
+	heap->nodes = NULL;
+	heap->used = heap->size = 0;
+	heap->allocator = allocator;
+}
+
+void evcon_heap_clear(evcon_heap *heap) {
+	unsigned int i;
+	for (i = 0; i < heap->used; ++i) heap->nodes[i]->ndx = 0;
+	evcon_free(heap->allocator, heap->nodes, heap->size * sizeof(evcon_heap_node*));
+	heap->nodes = NULL;
+	heap->used = heap->size = 0;
+}
+
+void evcon_heap_update(evcon_heap *heap, evcon_heap_node *node, evcon_interval key) {
+	evcon_interval oldkey = node->key;
+	node->key = key;
+
+	if (0 == node->ndx) {
+		if (heap->used == heap->size) {
+			unsigned int newsize = (0 == heap->size) ? 16 : 2 * heap->size;
+			evcon_heap_node **nodes = evcon_alloc(heap->allocator, newsize * sizeof(evcon_heap_node*));
+			if (NULL != heap->nodes) {
+				memcpy(nodes, heap->nodes, heap->used * sizeof(evcon_heap_node*));
+				evcon_free(heap->allocator, heap->nodes, heap->size * sizeof(evcon_heap_node*));
+			}
+			heap->nodes = nodes;
+			heap->size = newsize;
+		}
+		evcon_heap_set(heap, heap->used++, node);
+		evcon_heap_sift_up(heap, node->ndx - 1);
+	} else if (key < oldkey) {
+		evcon_heap_sift_up(heap, node->ndx - 1);
+	} else if (key > oldkey) {
+		evcon_heap_sift_down(heap, node->ndx - 1);
+	}
+}
+
+void evcon_heap_remove(evcon_heap *heap, evcon_heap_node *node) {
+	unsigned int i;
+	evcon_heap_node *last;
+
+	if (0 == node->ndx) return;
+
+	i = node->ndx - 1;
+	node->ndx = 0;
+	last = heap->nodes[--heap->used];
+	if (last == node) return;
+
+	evcon_heap_set(heap, i, last);
+	if (i > 0 && heap->nodes[EVCON_HEAP_PARENT(i)]->key > last->key) {
+		evcon_heap_sift_up(heap, i);
+	} else {
+		evcon_heap_sift_down(heap, i);
+	}
+}
+
+evcon_heap_node* evcon_heap_top(evcon_heap *heap) {
+	return (0 == heap->used) ? NULL : heap->nodes[0];
+}
+
+int evcon_heap_node_is_queued(evcon_heap_node *node) {
+	return 0 != node->ndx;
+}
+
+#define EVCON_TIMER_FROM_QUEUE_NODE(node) ((evcon_timer_watcher*) (((char*) (node)) - offsetof(evcon_timer_watcher, queue_node)))
+
+static void evcon_timer_queue_unlink_pending(evcon_timer_queue *queue, evcon_timer_watcher *watcher) {
+	if (!watcher->queue_pending) return;
+
+	if (NULL != watcher->queue_prev) {
+		watcher->queue_prev->queue_next = watcher->queue_next;
+	} else {
+		queue->pending = watcher->queue_next;
+	}
+	if (NULL != watcher->queue_next) watcher->queue_next->queue_prev = watcher->queue_prev;
+
+	watcher->queue_prev = watcher->queue_next = NULL;
+	watcher->queue_pending = 0;
+}
+
+void evcon_timer_queue_init(evcon_timer_queue *queue, evcon_allocator *allocator) {
+	evcon_heap_init(&queue->heap, allocator);
+	queue->pending = NULL;
+}
+
+void evcon_timer_queue_clear(evcon_timer_queue *queue) {
+	while (NULL != queue->pending) evcon_timer_queue_unlink_pending(queue, queue->pending);
+	evcon_heap_clear(&queue->heap);
+}
+
+void evcon_timer_queue_update(evcon_timer_queue *queue, evcon_timer_watcher *watcher, evcon_interval timeout) {
+	evcon_timer_queue_unlink_pending(queue, watcher);
+
+	if (timeout < 0) {
+		evcon_heap_remove(&queue->heap, &watcher->queue_node);
+	} else {
+		evcon_heap_update(&queue->heap, &watcher->queue_node, evcon_monotonic_now() + timeout);
+	}
+}
+
+void evcon_timer_queue_dispatch(evcon_timer_queue *queue) {
+	evcon_interval now = evcon_monotonic_now();
+	evcon_heap_node *node;
+	evcon_timer_watcher *watcher, *tail = NULL;
+
+	/* collect expired timers first, so timers restarted with timeout 0 have to wait for the next dispatch */
+	while (NULL != (node = evcon_heap_top(&queue->heap)) && node->key <= now) {
+		watcher = EVCON_TIMER_FROM_QUEUE_NODE(node);
+		evcon_heap_remove(&queue->heap, node);
+
+		watcher->queue_pending = 1;
+		watcher->queue_prev = tail;
+		watcher->queue_next = NULL;
+		if (NULL != tail) {
+			tail->queue_next = watcher;
+		} else {
+			queue->pending = watcher;
+		}
+		tail = watcher;
+	}
+
+	/* callbacks may stop or free other pending timers, which unlinks them */
+	while (NULL != (watcher = queue->pending)) {
+		evcon_timer_queue_unlink_pending(queue, watcher);
+		evcon_feed_timer(watcher);
+	}
+}
+
+evcon_interval evcon_timer_queue_next_timeout(evcon_timer_queue *queue) {
+	evcon_interval timeout, deadline = evcon_timer_queue_next_deadline(queue);
+
+	if (-1 == deadline) return -1;
+
+	timeout = deadline - evcon_monotonic_now();
+	return (timeout < 0) ? 0 : timeout;
+}
+
+evcon_interval evcon_timer_queue_next_deadline(evcon_timer_queue *queue) {
+	evcon_heap_node *node = evcon_heap_top(&queue->heap);
+	return (NULL == node) ? -1 : node->key;
+}
+
+int evcon_wakeup_fd_init(evcon_wakeup_fd *wakeup) {
+	int fds[2];
+
+#ifdef EVCON_USE_EVENTFD
+	if (-1 != (fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+		wakeup->read_fd = wakeup->write_fd = fds[0];
+		return 0;
+	}
+	/* kernels before 2.6.27 don't know the flags: use a pipe */
+	if (EINVAL != errno) return -1;
+#endif
+
+#ifdef HAVE_PIPE2
+	if (-1 == pipe2(fds, O_NONBLOCK | O_CLOEXEC)) return -1;
+#else
+	if (-1 == pipe(fds)) return -1;
+
+	evcon_init_fd(fds[0]);
+	evcon_init_fd(fds[1]);
+#endif
+
+	wakeup->read_fd = fds[0];
+	wakeup->write_fd = fds[1];
+	return 0;
+}
+
+void evcon_wakeup_fd_clear(evcon_wakeup_fd *wakeup) {
+	if (-1 != wakeup->write_fd && wakeup->write_fd != wakeup->read_fd) close(wakeup->write_fd);
+	if (-1 != wakeup->read_fd) close(wakeup->read_fd);
+	wakeup->read_fd = wakeup->write_fd = -1;
+}
+
+int evcon_wakeup_fd_signal(evcon_wakeup_fd *wakeup) {
+	static const uint64_t val = 1; /* eventfd needs 8 bytes, a pipe only one */
+	size_t len = (wakeup->read_fd == wakeup->write_fd) ? sizeof(val) : 1;
+
+	while (-1 == write(wakeup->write_fd, &val, len)) {
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return 0; /* enough data in the pipe / counter to trigger */
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void evcon_wakeup_fd_drain(evcon_wakeup_fd *wakeup) {
+	char buf[64];
+
+	if (wakeup->read_fd == wakeup->write_fd) {
+		/* eventfd: one read resets the counter */
+		(void) read(wakeup->read_fd, buf, sizeof(uint64_t));
+	} else {
+		while (read(wakeup->read_fd, buf, sizeof(buf)) == sizeof(buf)) ;
+	}
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+int evcon_epoll_set_init(evcon_epoll_set *set, evcon_allocator *allocator) {
+	memset(set, 0, sizeof(evcon_epoll_set));
+	set->allocator = allocator;
+	set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	return (-1 == set->epoll_fd) ? -1 : 0;
+}
+
+void evcon_epoll_set_clear(evcon_epoll_set *set) {
+	if (-1 != set->epoll_fd) close(set->epoll_fd);
+	set->epoll_fd = -1;
+	evcon_free(set->allocator, set->fds, set->fds_size * sizeof(evcon_epoll_entry*));
+	set->fds = NULL;
+	set->fds_size = 0;
+}
+
+static void evcon_epoll_set_reserve(evcon_epoll_set *set, evcon_fd fd) {
+	unsigned int newsize;
+	evcon_epoll_entry **fds;
+
+	if ((unsigned int) fd < set->fds_size) return;
+
+	newsize = (0 == set->fds_size) ? 64 : 2 * set->fds_size;
+	while (newsize <= (unsigned int) fd) newsize *= 2;
+
+	fds = evcon_alloc0(set->allocator, newsize * sizeof(evcon_epoll_entry*));
+	if (NULL != set->fds) {
+		memcpy(fds, set->fds, set->fds_size * sizeof(evcon_epoll_entry*));
+		evcon_free(set->allocator, set->fds, set->fds_size * sizeof(evcon_epoll_entry*));
+	}
+	set->fds = fds;
+	set->fds_size = newsize;
+}
+
+static void evcon_epoll_set_unregister(evcon_epoll_set *set, evcon_epoll_entry *entry) {
+	if (-1 == entry->fd) return;
+
+	/* if the fd was closed and reused by another watcher the registration is gone already */
+	if (set->fds[entry->fd] == entry) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		(void) epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, entry->fd, &ev);
+		set->fds[entry->fd] = NULL;
+	}
+
+	entry->fd = -1;
+	entry->events = 0;
+}
+
+int evcon_epoll_set_update(evcon_epoll_set *set, evcon_epoll_entry *entry, evcon_fd_watcher *watcher, evcon_fd fd, int events) {
+	struct epoll_event ev;
+	uint32_t evs;
+	int op;
+
+	if (-1 == fd) {
+		/* delete watcher */
+		if (NULL != entry->watcher) evcon_epoll_set_unregister(set, entry);
+		return 0;
+	}
+
+	evs = 0;
+	if (0 != (events & EVCON_READ)) evs |= EPOLLIN | EPOLLRDHUP;
+	if (0 != (events & EVCON_WRITE)) evs |= EPOLLOUT;
+	if (0 != evs && 0 != (events & EVCON_ET)) evs |= EPOLLET;
+
+	if (NULL == entry->watcher) {
+		entry->watcher = watcher;
+		entry->fd = -1;
+	}
+
+	if (fd == entry->fd && evs == entry->events && !evcon_fd_is_rearm(watcher)) return 0;
+
+	if (fd != entry->fd || 0 == evs) evcon_epoll_set_unregister(set, entry);
+	if (0 == evs) return 0;
+
+	evcon_epoll_set_reserve(set, fd);
+	if (NULL != set->fds[fd] && set->fds[fd] != entry) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = evs;
+	ev.data.fd = fd;
+
+	op = (-1 == entry->fd) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (-1 == epoll_ctl(set->epoll_fd, op, fd, &ev)) {
+		/* stale registrations: the kernel drops closed fds on its own, but dup()ed fds keep them alive */
+		if (EPOLL_CTL_ADD == op && EEXIST == errno) {
+			op = EPOLL_CTL_MOD;
+		} else if (EPOLL_CTL_MOD == op && ENOENT == errno) {
+			op = EPOLL_CTL_ADD;
+		} else {
+			return -1;
+		}
+		if (-1 == epoll_ctl(set->epoll_fd, op, fd, &ev)) return -1;
+	}
+
+	entry->fd = fd;
+	entry->events = evs;
+	set->fds[fd] = entry;
+	return 0;
+}
+
+int evcon_epoll_set_event(evcon_epoll_set *set, evcon_fd fd, uint32_t revents, evcon_fd_event *ev) {
+	evcon_epoll_entry *entry;
+	int events;
+
+	/* core drops events of watchers freed or moved by callbacks of the same batch */
+	if ((unsigned int) fd >= set->fds_size || NULL == (entry = set->fds[fd])) return 0;
+	if (entry->watcher->fd != fd) return 0;
+
+	events = 0;
+	if (0 != (revents & (EPOLLIN | EPOLLRDHUP))) events |= EVCON_READ;
+	if (0 != (revents & EPOLLOUT)) events |= EVCON_WRITE;
+	if (0 != (revents & EPOLLHUP)) events |= EVCON_READ | EVCON_WRITE;
+	if (0 != (revents & EPOLLERR)) events |= EVCON_ERROR | EVCON_READ | EVCON_WRITE;
+
+	events &= EVCON_ERROR | entry->watcher->events;
+	if (0 == events) return 0;
+
+	ev->watcher = entry->watcher;
+	ev->fd = fd;
+	ev->events = events;
+	return 1;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+int evcon_epoll_set_init(evcon_epoll_set *set, evcon_allocator *allocator) {
+	memset(set, 0, sizeof(evcon_epoll_set));
+	set->allocator = allocator;
+	set->epoll_fd = -1;
+	errno = ENOSYS;
+	return -1;
+}
+
+void evcon_epoll_set_clear(evcon_epoll_set *set) {
+	UNUSED(set);
+}
+
+int evcon_epoll_set_update(evcon_epoll_set *set, evcon_epoll_entry *entry, evcon_fd_watcher *watcher, evcon_fd fd, int events) {
+	UNUSED(set);
+	UNUSED(entry);
+	UNUSED(watcher);
+	UNUSED(events);
+	if (-1 == fd) return 0;
+	errno = ENOSYS;
+	return -1;
+}
+
+int evcon_epoll_set_event(evcon_epoll_set *set, evcon_fd fd, uint32_t revents, evcon_fd_event *ev) {
+	UNUSED(set);
+	UNUSED(fd);
+	UNUSED(revents);
+	UNUSED(ev);
+	return 0;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*****************************************************
+ *             Timer wheel                           *
+ *****************************************************/
+
+/* hierarchical timing wheel (as in "Hashed and Hierarchical Timing Wheels", Varghese & Lauck):
+ * level l has EVCON_WHEEL_SIZE slots of EVCON_WHEEL_SIZE^l ticks each; a timer is placed in the
+ * lowest level its distance fits in, and cascaded down one level when the wheel reaches its slot.
+ * all timers share a single backend timer, which is only re-armed if the next event moves forward.
+ */
+
+#define EVCON_WHEEL_BITS (6)
+#define EVCON_WHEEL_SIZE (1 << EVCON_WHEEL_BITS)
+#define EVCON_WHEEL_MASK (EVCON_WHEEL_SIZE - 1)
+#define EVCON_WHEEL_LEVELS (5)
+#define EVCON_WHEEL_MAX_TICKS (((int64_t) 1 << (EVCON_WHEEL_BITS * EVCON_WHEEL_LEVELS)) - 1)
+
+struct evcon_timer_wheel {
+	evcon_timer_watcher *slots[EVCON_WHEEL_LEVELS][EVCON_WHEEL_SIZE];
+	uint64_t used[EVCON_WHEEL_LEVELS]; /* bitmap of non-empty slots per level */
+	evcon_timer_watcher *pending; /* expired, waiting for their callback */
+
+	evcon_interval base, granularity; /* tick n starts at base + n * granularity */
+	int64_t tick; /* timers up to (including) this tick have expired */
+	int64_t armed_tick; /* tick the backend timer is armed for; -1: not armed */
+	evcon_timer_watcher *backend_timer;
+};
+
+static int evcon_timer_wheel_ctz(uint64_t x) {
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int n = 0;
+	while (0 == (x & 1)) { x >>= 1; ++n; }
+	return n;
+#endif
+}
+
+/* distance (1..EVCON_WHEEL_SIZE) from slot @cur to the next used slot after it (wrapping around to @cur itself); 0 if none */
+static int evcon_timer_wheel_next_slot(uint64_t used, unsigned int cur) {
+	uint64_t rotated;
+	if (0 == used) return 0;
+	rotated = (EVCON_WHEEL_MASK == cur) ? used : ((used >> (cur + 1)) | (used << (EVCON_WHEEL_MASK - cur)));
+	return evcon_timer_wheel_ctz(rotated) + 1;
+}
+
+static void evcon_timer_wheel_link(evcon_timer_watcher **list, evcon_timer_watcher *watcher) {
+	watcher->wheel_list = list;
+	watcher->wheel_prev = NULL;
+	watcher->wheel_next = *list;
+	if (NULL != *list) (*list)->wheel_prev = watcher;
+	*list = watcher;
+}
+
+static void evcon_timer_wheel_unlink(evcon_timer_wheel *wheel, evcon_timer_watcher *watcher) {
+	evcon_timer_watcher **list = watcher->wheel_list;
+
+	if (NULL == list) return;
+
+	if (NULL != watcher->wheel_next) watcher->wheel_next->wheel_prev = watcher->wheel_prev;
+	if (NULL != watcher->wheel_prev) {
+		watcher->wheel_prev->wheel_next = watcher->wheel_next;
+	} else {
+		*list = watcher->wheel_next;
+		if (NULL == *list && list != &wheel->pending) {
+			size_t ndx = list - &wheel->slots[0][0];
+			wheel->used[ndx / EVCON_WHEEL_SIZE] &= ~((uint64_t) 1 << (ndx % EVCON_WHEEL_SIZE));
+		}
+	}
+	watcher->wheel_list = NULL;
+	watcher->wheel_prev = watcher->wheel_next = NULL;
+}
+
+static void evcon_timer_wheel_place(evcon_timer_wheel *wheel, evcon_timer_watcher *watcher) {
+	int64_t expires = watcher->wheel_expires, distance = expires - wheel->tick;
+	unsigned int level, slot;
+
+	if (distance > EVCON_WHEEL_MAX_TICKS) {
+		/* out of range: park it in the top level, it gets placed again when cascaded */
+		expires = wheel->tick + EVCON_WHEEL_MAX_TICKS;
+		distance = EVCON_WHEEL_MAX_TICKS;
+	}
+
+	for (level = 0; level < EVCON_WHEEL_LEVELS - 1; ++level) {
+		if (distance < ((int64_t) 1 << (EVCON_WHEEL_BITS * (level + 1)))) break;
+	}
+	slot = (unsigned int) (expires >> (EVCON_WHEEL_BITS * level)) & EVCON_WHEEL_MASK;
+
+	evcon_timer_wheel_link(&wheel->slots[level][slot], watcher);
+	wheel->used[level] |= (uint64_t) 1 << slot;
+}
+
+/* next tick > wheel->tick which has to be processed (expire or cascade); -1 if the wheel is empty */
+static int64_t evcon_timer_wheel_next_tick(evcon_timer_wheel *wheel) {
+	int64_t next = -1;
+	unsigned int level;
+
+	for (level = 0; level < EVCON_WHEEL_LEVELS; ++level) {
+		unsigned int shift = EVCON_WHEEL_BITS * level;
+		int distance = evcon_timer_wheel_next_slot(wheel->used[level], (unsigned int) (wheel->tick >> shift) & EVCON_WHEEL_MASK);
+		int64_t tick;
+
+		if (0 == distance) continue;
+		tick = ((wheel->tick >> shift) + distance) << shift;
+		if (-1 == next || tick < next) next = tick;
+	}
+
+	return next;
+}
+
+static void evcon_timer_wheel_cascade(evcon_timer_wheel *wheel, unsigned int level, unsigned int slot) {
+	evcon_timer_watcher *watcher = wheel->slots[level][slot], *next;
+
+	wheel->slots[level][slot] = NULL;
+	wheel->used[level] &= ~((uint64_t) 1 << slot);
+
+	for (; NULL != watcher; watcher = next) {
+		next = watcher->wheel_next;
+		evcon_timer_wheel_place(wheel, watcher);
+	}
+}
+
+/* move all timers expiring up to @target into the pending list */
+static void evcon_timer_wheel_advance(evcon_timer_wheel *wheel, int64_t target) {
+	while (wheel->tick < target) {
+		int64_t next = evcon_timer_wheel_next_tick(wheel);
+		unsigned int level, slot;
+		evcon_timer_watcher *watcher, *next_watcher;
+
+		if (-1 == next || next > target) {
+			wheel->tick = target;
+			break;
+		}
+		wheel->tick = next;
+
+		/* cascade higher levels whose slot boundary we just crossed */
+		for (level = 1; level < EVCON_WHEEL_LEVELS; ++level) {
+			if (0 != (next & (((int64_t) 1 << (EVCON_WHEEL_BITS * level)) - 1))) break;
+			evcon_timer_wheel_cascade(wheel, level, (unsigned int) (next >> (EVCON_WHEEL_BITS * level)) & EVCON_WHEEL_MASK);
+		}
+
+		slot = (unsigned int) next & EVCON_WHEEL_MASK;
+		watcher = wheel->slots[0][slot];
+		wheel->slots[0][slot] = NULL;
+		wheel->used[0] &= ~((uint64_t) 1 << slot);
+		for (; NULL != watcher; watcher = next_watcher) {
+			next_watcher = watcher->wheel_next;
+			evcon_timer_wheel_link(&wheel->pending, watcher);
+		}
+	}
+}
+
+static void evcon_timer_wheel_rearm(evcon_timer_wheel *wheel) {
+	int64_t next = evcon_timer_wheel_next_tick(wheel);
+	evcon_interval timeout;
+
+	if (next == wheel->armed_tick) return;
+	wheel->armed_tick = next;
+
+	if (-1 == next) {
+		evcon_timer_stop(wheel->backend_timer);
 		return;
 	}
+
+	timeout = wheel->base + next * wheel->granularity - evcon_monotonic_now();
+	evcon_timer_once(wheel->backend_timer, (timeout < 0) ? 0 : timeout);
+}
+
+static int64_t evcon_timer_wheel_now_tick(evcon_timer_wheel *wheel) {
+	return (evcon_monotonic_now() - wheel->base) / wheel->granularity;
+}
+
+/* O(1) unless it moves the next event forward, which needs a backend update */
+static void evcon_timer_wheel_update(evcon_timer_wheel *wheel, evcon_timer_watcher *watcher, evcon_interval timeout) {
+	int64_t expires;
+
+	evcon_timer_wheel_unlink(wheel, watcher);
+	if (timeout < 0) return; /* the backend timer is not stopped; a spurious wakeup is cheaper */
+
+	/* round up: never trigger early */
+	expires = (evcon_monotonic_now() + timeout - wheel->base + wheel->granularity - 1) / wheel->granularity;
+	if (expires <= wheel->tick) expires = wheel->tick + 1;
+	watcher->wheel_expires = expires;
+	evcon_timer_wheel_place(wheel, watcher);
+
+	if (-1 == wheel->armed_tick || expires < wheel->armed_tick) evcon_timer_wheel_rearm(wheel);
+}
+
+static void evcon_timer_wheel_cb(evcon_loop *loop, evcon_timer_watcher *timer, void *user_data) {
+	evcon_timer_wheel *wheel = user_data;
+	evcon_timer_watcher *watcher;
+	UNUSED(loop);
+	UNUSED(timer);
+
+	wheel->armed_tick = -1;
+	evcon_timer_wheel_advance(wheel, evcon_timer_wheel_now_tick(wheel));
+
+	/* callbacks may stop or free other pending timers, which unlinks them */
+	while (NULL != (watcher = wheel->pending)) {
+		evcon_timer_wheel_unlink(wheel, watcher);
+		evcon_feed_timer(watcher);
+	}
+
+	evcon_timer_wheel_rearm(wheel);
+}
+
+void evcon_loop_enable_timer_wheel(evcon_loop *loop, evcon_interval granularity) {
+	evcon_timer_wheel *wheel;
+
+	if (NULL != loop->wheel) return;
+	if (granularity <= 0) granularity = EVCON_INTERVAL_FROM_MSEC(1);
+
+	wheel = evcon_alloc0(loop->allocator, sizeof(evcon_timer_wheel));
+	wheel->base = evcon_monotonic_now();
+	wheel->granularity = granularity;
+	wheel->tick = 0;
+	wheel->armed_tick = -1;
+
+	/* created before loop->wheel is set: this one goes to the backend */
+	wheel->backend_timer = evcon_timer_new(loop, evcon_timer_wheel_cb, wheel);
+	evcon_loop_unref(loop); /* weak reference */
+
+	loop->wheel = wheel;
+}
+
+static void evcon_timer_wheel_free(evcon_loop *loop) {
+	evcon_timer_wheel *wheel = loop->wheel;
+
+	/* all wheel timers are gone already: each of them held a loop reference */
+	evcon_loop_ref(loop);
+	evcon_timer_free(wheel->backend_timer);
+
+	loop->wheel = NULL;
+	memset(wheel, 0, sizeof(evcon_timer_wheel));
+	evcon_free(loop->allocator, wheel, sizeof(evcon_timer_wheel));
+}
+
+/*****************************************************
+ *             Watcher pool                          *
+ *****************************************************/
+
+/* per-loop pool for watcher objects: size-class free lists, carved from larger slabs of the loop
+ * allocator and released in bulk with the loop. not thread-safe (neither are watchers).
+ */
+
+#define EVCON_POOL_CLASSES (32)
+#define EVCON_POOL_MAX_SIZE (EVCON_POOL_CLASSES * sizeof(evcon_max_align))
+#define EVCON_POOL_SLAB_SIZE (16384)
+
+typedef struct evcon_pool_slab evcon_pool_slab;
+typedef struct evcon_pool_object evcon_pool_object;
+
+struct evcon_pool_slab {
+	evcon_pool_slab *next;
+};
+
+struct evcon_pool_object {
+	evcon_pool_object *next;
+};
+
+struct evcon_pool {
+	evcon_pool_object *free_lists[EVCON_POOL_CLASSES];
+	evcon_pool_slab *slabs;
+	char *slab_pos, *slab_end; /* unused space in the newest slab */
+};
+
+static unsigned int evcon_pool_class(size_t size) {
+	return (unsigned int) (EVCON_ALIGN(size) / sizeof(evcon_max_align)) - 1;
+}
+
+/* @size must be > 0 and <= EVCON_POOL_MAX_SIZE; returns zeroed memory */
+static void* evcon_pool_alloc(evcon_loop *loop, size_t size) {
+	evcon_pool *pool = loop->pool;
+	unsigned int cls = evcon_pool_class(size);
+	size_t objsize = (cls + 1) * sizeof(evcon_max_align);
+	void *ptr;
+
+	if (NULL != pool->free_lists[cls]) {
+		evcon_pool_object *obj = pool->free_lists[cls];
+		pool->free_lists[cls] = obj->next;
+		ptr = obj;
+	} else {
+		if ((size_t) (pool->slab_end - pool->slab_pos) < objsize) {
+			/* the rest of the old slab is lost; it is smaller than the largest size class */
+			evcon_pool_slab *slab = evcon_alloc(loop->allocator, EVCON_POOL_SLAB_SIZE);
+			slab->next = pool->slabs;
+			pool->slabs = slab;
+			pool->slab_pos = (char*) slab + EVCON_ALIGN(sizeof(evcon_pool_slab));
+			pool->slab_end = (char*) slab + EVCON_POOL_SLAB_SIZE;
+		}
+		ptr = pool->slab_pos;
+		pool->slab_pos += objsize;
+	}
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static void evcon_pool_free(evcon_loop *loop, void *ptr, size_t size) {
+	evcon_pool *pool = loop->pool;
+	unsigned int cls = evcon_pool_class(size);
+	evcon_pool_object *obj = ptr;
+
+	obj->next = pool->free_lists[cls];
+	pool->free_lists[cls] = obj;
+}
+
+void evcon_loop_enable_pool(evcon_loop *loop) {
+	if (NULL != loop->pool) return;
+	loop->pool = evcon_alloc0(loop->allocator, sizeof(evcon_pool));
+}
+
+/* after all watchers are gone */
+static void evcon_pool_release(evcon_loop *loop) {
+	evcon_pool *pool = loop->pool;
+	evcon_pool_slab *slab, *next;
+
+	for (slab = pool->slabs; NULL != slab; slab = next) {
+		next = slab->next;
+		evcon_free(loop->allocator, slab, EVCON_POOL_SLAB_SIZE);
+	}
+
+	loop->pool = NULL;
+	evcon_free(loop->allocator, pool, sizeof(evcon_pool));
+}
+
+/* watchers allocated before the pool was enabled (or too large for it) come from the allocator */
+static void* evcon_watcher_alloc(evcon_loop *loop, size_t size, int *pooled) {
+	*pooled = (NULL != loop->pool && size <= EVCON_POOL_MAX_SIZE);
+	return *pooled ? evcon_pool_alloc(loop, size) : evcon_alloc0(loop->allocator, size);
+}
+
+static void evcon_watcher_free(evcon_loop *loop, void *watcher, size_t size, int pooled) {
+	if (pooled) {
+		evcon_pool_free(loop, watcher, size);
+	} else {
+		evcon_free(loop->allocator, watcher, size);
+	}
+}
+
+/*****************************************************
+ *             Stats                                 *
+ *****************************************************/
+
+/* async triggers come from other threads */
+static void evcon_stats_atomic_inc(uint64_t *counter) {
+#ifdef __GNUC__
+	__sync_fetch_and_add(counter, 1);
+#else
+	++*counter;
+#endif
+}
+
+void evcon_loop_enable_stats(evcon_loop *loop) {
+	if (NULL != loop->stats) return;
+	loop->stats = evcon_alloc0(loop->allocator, sizeof(evcon_loop_stats));
+}
+
+int evcon_loop_get_stats(evcon_loop *loop, evcon_loop_stats *stats) {
+	uint64_t triggers;
+
+	if (NULL == loop->stats) {
+		memset(stats, 0, sizeof(evcon_loop_stats));
+		return 0;
+	}
+
+	*stats = *loop->stats;
+#ifdef __GNUC__
+	triggers = __sync_fetch_and_add(&loop->stats->async_triggers, 0);
+#else
+	triggers = loop->stats->async_triggers;
+#endif
+	stats->async_triggers = triggers;
+	stats->async_coalesced = (triggers > stats->async_callbacks) ? triggers - stats->async_callbacks : 0;
+	return 1;
+}
+
+/*****************************************************
+ *             Callback timing                       *
+ *****************************************************/
+
+struct evcon_callback_timing {
+	uint64_t threshold_ns;
+	evcon_slow_callback_cb slow_cb;
+	void *user_data;
+
+	uint64_t buckets[EVCON_CALLBACK_HISTOGRAM_BUCKETS];
+};
+
+static uint64_t evcon_callback_timing_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static unsigned int evcon_callback_timing_bucket(uint64_t duration) {
+	unsigned int bucket;
+#ifdef __GNUC__
+	bucket = (0 == duration) ? 0 : 64 - __builtin_clzll(duration);
+#else
+	for (bucket = 0; duration > 0; duration >>= 1) ++bucket;
+#endif
+	return (bucket < EVCON_CALLBACK_HISTOGRAM_BUCKETS) ? bucket : EVCON_CALLBACK_HISTOGRAM_BUCKETS - 1;
+}
+
+static void evcon_callback_timing_done(evcon_callback_timing *timing, evcon_loop *loop, evcon_watcher_type type, void *watcher, evcon_generic_cb cb, uint64_t start) {
+	uint64_t duration = evcon_callback_timing_now() - start;
+
+	timing->buckets[evcon_callback_timing_bucket(duration)]++;
+	if (0 != timing->threshold_ns && duration >= timing->threshold_ns && NULL != timing->slow_cb) {
+		timing->slow_cb(loop, type, watcher, cb, duration, timing->user_data);
+	}
+}
+
+void evcon_loop_enable_callback_timing(evcon_loop *loop, uint64_t threshold_ns, evcon_slow_callback_cb slow_cb, void *user_data) {
+	if (NULL == loop->timing) loop->timing = evcon_alloc0(loop->allocator, sizeof(evcon_callback_timing));
+	loop->timing->threshold_ns = threshold_ns;
+	loop->timing->slow_cb = slow_cb;
+	loop->timing->user_data = user_data;
+}
+
+int evcon_loop_get_callback_histogram(evcon_loop *loop, uint64_t buckets[EVCON_CALLBACK_HISTOGRAM_BUCKETS]) {
+	if (NULL == loop->timing) {
+		memset(buckets, 0, EVCON_CALLBACK_HISTOGRAM_BUCKETS * sizeof(uint64_t));
+		return 0;
+	}
+	memcpy(buckets, loop->timing->buckets, EVCON_CALLBACK_HISTOGRAM_BUCKETS * sizeof(uint64_t));
+	return 1;
+}
+
+/*****************************************************
+ *             Batches                               *
+ *****************************************************/
+
+struct evcon_batch_hook {
+	evcon_loop *loop;
+	evcon_batch_hook *next;
+	evcon_batch_hook_cb cb;
+	void *user_data;
+	unsigned int weak:1, deleted:1; /* weak: internal hook without loop reference */
+};
+
+evcon_batch_hook* evcon_batch_hook_alloc(evcon_loop *loop, evcon_batch_hook_cb cb, void *user_data, int weak) {
+	evcon_batch_hook *hook = evcon_alloc0(loop->allocator, sizeof(evcon_batch_hook)), **link;
+
+	if (!weak) evcon_loop_ref(loop);
+	hook->loop = loop;
+	hook->cb = cb;
+	hook->user_data = user_data;
+	hook->weak = weak;
+
+	/* run in creation order */
+	for (link = &loop->batch_hooks; NULL != *link; link = &(*link)->next) ;
+	*link = hook;
+	return hook;
+}
+
+/* unlinks hooks deleted while the hooks were running */
+static void evcon_batch_hooks_sweep(evcon_loop *loop) {
+	evcon_batch_hook **link = &loop->batch_hooks, *hook;
+	unsigned int refs = 0;
+
+	loop->batch_hooks_dirty = 0;
+	while (NULL != (hook = *link)) {
+		if (hook->deleted) {
+			*link = hook->next;
+			if (!hook->weak) refs++;
+			evcon_free(loop->allocator, hook, sizeof(evcon_batch_hook));
+		} else {
+			link = &hook->next;
+		}
+	}
+
+	/* the last one might free the loop */
+	while (refs-- > 0) evcon_loop_unref(loop);
+}
+
+static void evcon_batch_hooks_run(evcon_loop *loop) {
+	evcon_batch_hook *hook;
+
+	if (loop->batch_hooks_running) return;
+
+	/* hooks might drop the last loop reference */
+	evcon_loop_ref(loop);
+	loop->batch_hooks_running = 1;
+	for (hook = loop->batch_hooks; NULL != hook; hook = hook->next) {
+		if (!hook->deleted) hook->cb(loop, hook, hook->user_data);
+	}
+	loop->batch_hooks_running = 0;
+	if (loop->batch_hooks_dirty) evcon_batch_hooks_sweep(loop);
+	evcon_loop_unref(loop);
+}
+
+evcon_batch_hook* evcon_batch_hook_new(evcon_loop *loop, evcon_batch_hook_cb cb, void *user_data) {
+	return evcon_batch_hook_alloc(loop, cb, user_data, 0);
+}
+
+void evcon_batch_hook_free(evcon_batch_hook *hook) {
+	evcon_loop *loop = hook->loop;
+
+	hook->deleted = 1;
+	if (loop->batch_hooks_running) {
+		loop->batch_hooks_dirty = 1;
+	} else {
+		evcon_batch_hooks_sweep(loop);
+	}
+}
+
+void evcon_loop_batch_begin(evcon_loop *loop) {
+	loop->batch_depth++;
+}
+
+void evcon_loop_batch_end(evcon_loop *loop) {
+	assert(loop->batch_depth > 0);
+	if (0 == --loop->batch_depth && NULL != loop->batch_hooks) evcon_batch_hooks_run(loop);
 }
 
 /*****************************************************
  *             Main interface                        *
  *****************************************************/
 
+/* inline backend storage follows the watcher */
+#define EVCON_INLINE_OFFSET(size) EVCON_ALIGN(size)
+
+static size_t evcon_watcher_alloc_size(size_t watcher_size, size_t data_size) {
+	return (0 == data_size) ? watcher_size : EVCON_INLINE_OFFSET(watcher_size) + data_size;
+}
+
+static void* evcon_watcher_inline_data(void *watcher, size_t watcher_size, size_t data_size) {
+	return (0 == data_size) ? NULL : (char*) watcher + EVCON_INLINE_OFFSET(watcher_size);
+}
+
 void evcon_loop_ref(evcon_loop *loop) {
 	assert(loop->refcount > 0);
 	++loop->refcount;
@@ -328,7 +1439,12 @@ void evcon_loop_unref(evcon_loop *loop) {
 		evcon_allocator *allocator = loop->allocator;
 
 		loop->refcount = 1; /* fake reference: allows loops to use own watchers with weak references */
+		if (NULL != loop->wheel) evcon_timer_wheel_free(loop);
 		loop->backend->free_loop_cb(loop, loop->backend_data, loop->backend->backend_data);
+		if (NULL != loop->pool) evcon_pool_release(loop);
+		if (NULL != loop->chunks) evcon_stream_cache_release(loop);
+		if (NULL != loop->stats) evcon_free(allocator, loop->stats, sizeof(evcon_loop_stats));
+		if (NULL != loop->timing) evcon_free(allocator, loop->timing, sizeof(evcon_callback_timing));
 		memset(loop, 0, sizeof(evcon_loop));
 		evcon_free(allocator, loop, sizeof(evcon_loop));
 	}
@@ -353,16 +1469,25 @@ void evcon_init_fd(evcon_fd fd) {
 }
 
 evcon_fd_watcher* evcon_fd_new(evcon_loop *loop, evcon_fd_cb cb, evcon_fd fd, int events, void* user_data) {
-	evcon_fd_watcher *watcher = evcon_alloc0(loop->allocator, sizeof(evcon_fd_watcher));
+	size_t data_size = loop->backend->fd_data_size;
+	int pooled;
+	evcon_fd_watcher *watcher = evcon_watcher_alloc(loop, evcon_watcher_alloc_size(sizeof(evcon_fd_watcher), data_size), &pooled);
 	evcon_loop_ref(loop);
+	if (NULL != loop->group) evcon_group_fd_count_add(loop->group, 1);
+	EVCON_STAT_INC(loop, fd_allocs);
+	EVCON_STAT_ADD(loop, fd_alloc_bytes, evcon_watcher_alloc_size(sizeof(evcon_fd_watcher), data_size));
 
 	watcher->user_data = user_data;
-	watcher->backend_data = NULL;
+	watcher->backend_data = evcon_watcher_inline_data(watcher, sizeof(evcon_fd_watcher), data_size);
 	watcher->active = watcher->incallback = watcher->delayed_delete = 0;
+	watcher->pooled = pooled;
 	watcher->loop = loop;
 	watcher->cb = cb;
 	watcher->fd = fd;
 	watcher->events = events;
+	watcher->dirty = 0;
+	watcher->rearm = 0;
+	watcher->dirty_prev = watcher->dirty_next = NULL;
 
 	return watcher;
 }
@@ -370,14 +1495,14 @@ evcon_fd_watcher* evcon_fd_new(evcon_loop *loop, evcon_fd_cb cb, evcon_fd fd, in
 void evcon_fd_start(evcon_fd_watcher *watcher) {
 	if (!watcher->active) {
 		watcher->active = 1;
-		evcon_backend_fd_update(watcher);
+		evcon_fd_changed(watcher);
 	}
 }
 
 void evcon_fd_stop(evcon_fd_watcher *watcher) {
 	if (watcher->active) {
 		watcher->active = 0;
-		evcon_backend_fd_update(watcher);
+		evcon_fd_changed(watcher);
 	}
 }
 
@@ -386,12 +1511,16 @@ void evcon_fd_free(evcon_fd_watcher* watcher) {
 	watcher->fd = -1;
 	watcher->events = 0;
 	if (watcher->incallback) { /* delay delete */
+		EVCON_STAT_INC(watcher->loop, delayed_deletes);
 		watcher->delayed_delete = 1;
 	} else {
 		evcon_loop *loop = watcher->loop;
+		int pooled = watcher->pooled;
 		evcon_backend_fd_update(watcher);
+		if (NULL != loop->fd_batch) evcon_fd_batch_forget(loop, watcher);
+		if (NULL != loop->group) evcon_group_fd_count_add(loop->group, -1);
 		memset(watcher, 0, sizeof(evcon_fd_watcher));
-		evcon_free(loop->allocator, watcher, sizeof(evcon_fd_watcher));
+		evcon_watcher_free(loop, watcher, evcon_watcher_alloc_size(sizeof(evcon_fd_watcher), loop->backend->fd_data_size), pooled);
 		evcon_loop_unref(loop);
 	}
 }
@@ -421,27 +1550,37 @@ void evcon_fd_set_cb(evcon_fd_watcher *watcher, evcon_fd_cb cb) {
 }
 void evcon_fd_set_fd(evcon_fd_watcher *watcher, evcon_fd fd) {
 	watcher->fd = fd;
+	watcher->rearm = 1;
 	if (watcher->active && !watcher->incallback) evcon_backend_fd_update(watcher);
 }
 void evcon_fd_set_events(evcon_fd_watcher *watcher, int events) {
 	watcher->events = events;
-	if (-1 != watcher->fd && watcher->active && !watcher->incallback) evcon_backend_fd_update(watcher);
+	if (-1 != watcher->fd && watcher->active && !watcher->incallback) evcon_fd_changed(watcher);
 }
 void evcon_fd_set_user_data(evcon_fd_watcher *watcher, void* user_data) {
 	watcher->user_data = user_data;
 }
 
 evcon_timer_watcher *evcon_timer_new(evcon_loop *loop, evcon_timer_cb cb, void *user_data) {
-	evcon_timer_watcher *watcher = evcon_alloc0(loop->allocator, sizeof(evcon_timer_watcher));
+	size_t data_size = loop->backend->timer_data_size;
+	int pooled;
+	evcon_timer_watcher *watcher = evcon_watcher_alloc(loop, evcon_watcher_alloc_size(sizeof(evcon_timer_watcher), data_size), &pooled);
 	evcon_loop_ref(loop);
+	EVCON_STAT_INC(loop, timer_allocs);
+	EVCON_STAT_ADD(loop, timer_alloc_bytes, evcon_watcher_alloc_size(sizeof(evcon_timer_watcher), data_size));
 
 	watcher->user_data = user_data;
-	watcher->backend_data = NULL;
+	watcher->backend_data = evcon_watcher_inline_data(watcher, sizeof(evcon_timer_watcher), data_size);
 	watcher->active = watcher->incallback = watcher->delayed_delete = 0;
+	watcher->pooled = pooled;
 	watcher->loop = loop;
 	watcher->cb = cb;
 	watcher->timeout = -1;
 	watcher->repeat = -1;
+	watcher->slack = 0;
+	watcher->lazy = 0;
+	watcher->deadline = watcher->backend_deadline = -1;
+	watcher->wheel = (NULL != loop->wheel);
 
 	return watcher;
 }
@@ -471,12 +1610,14 @@ void evcon_timer_free(evcon_timer_watcher *watcher) {
 	watcher->active = 0;
 	watcher->timeout = watcher->repeat = -1;
 	if (watcher->incallback) { /* delay delete */
+		EVCON_STAT_INC(watcher->loop, delayed_deletes);
 		watcher->delayed_delete = 1;
 	} else {
 		evcon_loop *loop = watcher->loop;
+		int pooled = watcher->pooled;
 		evcon_backend_timer_delete(watcher);
 		memset(watcher, 0, sizeof(evcon_timer_watcher));
-		evcon_free(loop->allocator, watcher, sizeof(evcon_timer_watcher));
+		evcon_watcher_free(loop, watcher, evcon_watcher_alloc_size(sizeof(evcon_timer_watcher), loop->backend->timer_data_size), pooled);
 		evcon_loop_unref(loop);
 	}
 }
@@ -494,6 +1635,9 @@ evcon_interval evcon_timer_get_timeout(evcon_timer_watcher *watcher) {
 evcon_interval evcon_timer_get_repeat(evcon_timer_watcher *watcher) {
 	return watcher->repeat;
 }
+evcon_interval evcon_timer_get_slack(evcon_timer_watcher *watcher) {
+	return watcher->slack;
+}
 void* evcon_timer_get_user_data(evcon_timer_watcher *watcher) {
 	return watcher->user_data;
 }
@@ -507,18 +1651,25 @@ void evcon_timer_set_cb(evcon_timer_watcher *watcher, evcon_timer_cb cb) {
 void evcon_timer_set_repeat(evcon_timer_watcher *watcher, evcon_interval repeat) {
 	watcher->repeat = repeat;
 }
+void evcon_timer_set_slack(evcon_timer_watcher *watcher, evcon_interval slack) {
+	watcher->slack = slack;
+}
 void evcon_timer_set_user_data(evcon_timer_watcher *watcher, void *user_data) {
 	watcher->user_data = user_data;
 }
 
 evcon_async_watcher* evcon_async_new(evcon_loop *loop, evcon_async_cb cb, void* user_data) {
-	evcon_async_watcher *watcher = evcon_alloc0(loop->allocator, sizeof(evcon_async_watcher));
-	evcon_backend *backend = watcher->loop->backend;
+	evcon_backend *backend = loop->backend;
+	int pooled;
+	evcon_async_watcher *watcher = evcon_watcher_alloc(loop, evcon_watcher_alloc_size(sizeof(evcon_async_watcher), backend->async_data_size), &pooled);
 	evcon_loop_ref(loop);
+	EVCON_STAT_INC(loop, async_allocs);
+	EVCON_STAT_ADD(loop, async_alloc_bytes, evcon_watcher_alloc_size(sizeof(evcon_async_watcher), backend->async_data_size));
 
 	watcher->user_data = user_data;
-	watcher->backend_data = NULL;
+	watcher->backend_data = evcon_watcher_inline_data(watcher, sizeof(evcon_async_watcher), backend->async_data_size);
 	watcher->incallback = watcher->delayed_delete = 0;
+	watcher->pooled = pooled;
 	watcher->loop = loop;
 	watcher->cb = cb;
 
@@ -528,20 +1679,23 @@ evcon_async_watcher* evcon_async_new(evcon_loop *loop, evcon_async_cb cb, void*
 
 void evcon_async_wakeup(evcon_async_watcher *watcher) {
 	evcon_backend *backend = watcher->loop->backend;
+	if (NULL != watcher->loop->stats) evcon_stats_atomic_inc(&watcher->loop->stats->async_triggers);
 	backend->async_update_cb(watcher, EVCON_ASYNC_TRIGGER, watcher->loop->allocator, watcher->loop->backend_data, watcher->backend_data);
 }
 
 void evcon_async_free(evcon_async_watcher* watcher) {
 	if (watcher->incallback) { /* delay delete */
+		EVCON_STAT_INC(watcher->loop, delayed_deletes);
 		watcher->delayed_delete = 1;
 	} else {
 		evcon_loop *loop = watcher->loop;
 		evcon_backend *backend = watcher->loop->backend;
+		int pooled = watcher->pooled;
 
 		backend->async_update_cb(watcher, EVCON_ASYNC_FREE, watcher->loop->allocator, watcher->loop->backend_data, watcher->backend_data);
 
 		memset(watcher, 0, sizeof(evcon_async_watcher));
-		evcon_free(loop->allocator, watcher, sizeof(evcon_async_watcher));
+		evcon_watcher_free(loop, watcher, evcon_watcher_alloc_size(sizeof(evcon_async_watcher), backend->async_data_size), pooled);
 		evcon_loop_unref(loop);
 	}
 }
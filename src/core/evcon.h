@@ -15,21 +15,41 @@
 # include <sys/types.h>
 #endif
 
-/* (positive) time interval in milliseconds; negative values have special meanings */
-/* use of macros is recommended, in case someone needs to change this for porting */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* (positive) time interval in milliseconds (nanoseconds if built with --enable-nsec-interval,
+ * see EVCON_INTERVAL_NSEC); negative values have special meanings.
+ * use the macros, the unit depends on the build. conversions round up, so timers never trigger early.
+ */
 
 typedef int64_t evcon_interval;
+#ifdef EVCON_INTERVAL_NSEC
+#define EVCON_INTERVAL_FROM_DOUBLE_SEC(x) ((evcon_interval) ceil((x)*1.e9))
+#define EVCON_INTERVAL_FROM_NSEC(x) ((evcon_interval) (x))
+#define EVCON_INTERVAL_FROM_USEC(x) ((evcon_interval) (x) * 1000)
+#define EVCON_INTERVAL_FROM_MSEC(x) ((evcon_interval) (x) * 1000000)
+#define EVCON_INTERVAL_FROM_SEC(x) ((evcon_interval) (x) * 1000000000)
+
+#define EVCON_INTERVAL_AS_DOUBLE_SEC(x) ((x)*1.e-9)
+#define EVCON_INTERVAL_AS_NSEC(x) ((int64_t) (x))
+#define EVCON_INTERVAL_AS_USEC(x) (((int64_t) (x) + 999) / 1000)
+#define EVCON_INTERVAL_AS_MSEC(x) (((int64_t) (x) + 999999) / 1000000)
+#define EVCON_INTERVAL_AS_SEC(x) (((int64_t) (x) + 999999999) / 1000000000)
+#else
 #define EVCON_INTERVAL_FROM_DOUBLE_SEC(x) ((evcon_interval) ceil((x)*1.e3))
-#define EVCON_INTERVAL_FROM_NSEC(x) ((x+(evcon_interval)1e6-1)/1e6)
-#define EVCON_INTERVAL_FROM_USEC(x) ((x+(evcon_interval)1e3-1)/1e3)
-#define EVCON_INTERVAL_FROM_MSEC(x) (x)
-#define EVCON_INTERVAL_FROM_SEC(x) ((x)*(evcon_interval)1e3)
+#define EVCON_INTERVAL_FROM_NSEC(x) (((evcon_interval) (x) + 999999) / 1000000)
+#define EVCON_INTERVAL_FROM_USEC(x) (((evcon_interval) (x) + 999) / 1000)
+#define EVCON_INTERVAL_FROM_MSEC(x) ((evcon_interval) (x))
+#define EVCON_INTERVAL_FROM_SEC(x) ((evcon_interval) (x) * 1000)
 
 #define EVCON_INTERVAL_AS_DOUBLE_SEC(x) ((x)*1.e-3)
-#define EVCON_INTERVAL_AS_NSEC(x) ((x)*1e6)
-#define EVCON_INTERVAL_AS_USEC(x) ((x)*1e3)
-#define EVCON_INTERVAL_AS_MSEC(x) (x)
-#define EVCON_INTERVAL_AS_SEC(x) ((x+1e3-1)/1e3)
+#define EVCON_INTERVAL_AS_NSEC(x) ((int64_t) (x) * 1000000)
+#define EVCON_INTERVAL_AS_USEC(x) ((int64_t) (x) * 1000)
+#define EVCON_INTERVAL_AS_MSEC(x) ((int64_t) (x))
+#define EVCON_INTERVAL_AS_SEC(x) (((int64_t) (x) + 999) / 1000)
+#endif
 
 
 typedef struct evcon_loop evcon_loop;
@@ -39,13 +59,19 @@ typedef struct evcon_allocator evcon_allocator;
 typedef struct evcon_fd_watcher evcon_fd_watcher;
 typedef struct evcon_timer_watcher evcon_timer_watcher;
 typedef struct evcon_async_watcher evcon_async_watcher;
+typedef struct evcon_acceptor evcon_acceptor; /* see evcon-listener.h */
 
 typedef int evcon_fd;
 
 typedef enum {
 	EVCON_ERROR     = 0x0001,
 	EVCON_READ      = 0x0002,
-	EVCON_WRITE     = 0x0004
+	EVCON_WRITE     = 0x0004,
+	/* flag for fd watchers: edge-triggered, i.e. readiness is only reported again after it was lost (read/write
+	 * until EAGAIN before waiting again). native with epoll, glib on linux (internal epoll set) and libevent on
+	 * epoll; other backends stay level-triggered, which only reports more often.
+	 */
+	EVCON_ET        = 0x0008
 } evcon_events;
 
 typedef void (*evcon_fd_cb)(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data);
@@ -60,6 +86,75 @@ void evcon_loop_unref(evcon_loop *loop);
 
 evcon_allocator* evcon_loop_get_allocator(evcon_loop *loop);
 
+/* optional: timers created afterwards on this loop are kept in a hierarchical timer wheel and share
+ * a single backend timer, which makes starting and stopping them O(1) (useful for many idle timeouts
+ * that get restarted all the time). they trigger with @granularity resolution (<= 0: 1ms), but never early.
+ * timers created before are not affected; calling it again has no effect.
+ */
+void evcon_loop_enable_timer_wheel(evcon_loop *loop, evcon_interval granularity);
+
+/* optional: allocate watchers created afterwards from a per-loop pool (size-class free lists carved
+ * from larger blocks of the loop allocator, all released together with the loop) instead of one
+ * allocator call each. not thread-safe: create and free watchers only in the loop thread then.
+ */
+void evcon_loop_enable_pool(evcon_loop *loop);
+
+/* optional: count what the loop is doing (cumulative since enabled). without this each counter
+ * costs a NULL check. enable before other threads use the loop (async triggers are counted atomically).
+ */
+typedef struct evcon_loop_stats evcon_loop_stats;
+struct evcon_loop_stats {
+	uint64_t fd_callbacks, timer_callbacks, async_callbacks;
+
+	uint64_t fd_updates, timer_updates; /* calls into the backend */
+	uint64_t updates_skipped; /* fd changes merged into a pending (batched) update, timer restarts covered by the armed timer */
+	uint64_t delayed_deletes; /* watchers freed in their own callback */
+
+	uint64_t fd_allocs, fd_alloc_bytes;
+	uint64_t timer_allocs, timer_alloc_bytes;
+	uint64_t async_allocs, async_alloc_bytes;
+
+	uint64_t async_triggers; /* evcon_async_wakeup() calls */
+	uint64_t async_coalesced; /* triggers that didn't result in a callback (yet) */
+};
+
+void evcon_loop_enable_stats(evcon_loop *loop);
+/* copies the counters; returns 0 (and zeroes @stats) if stats are not enabled. not thread-safe */
+int evcon_loop_get_stats(evcon_loop *loop, evcon_loop_stats *stats);
+
+/* optional: measure how long each watcher callback takes (two monotonic clock reads per callback).
+ * durations are collected in a per-loop histogram; bucket 0 counts callbacks below 1ns,
+ * bucket i (> 0) those taking [2^(i-1), 2^i) ns, the last bucket everything longer.
+ * callbacks taking at least @threshold_ns (0: never) are reported to @slow_cb (which may be NULL);
+ * it runs after the callback returned, but before a delayed free of the watcher.
+ * calling it again only changes threshold and hook; not thread-safe.
+ */
+typedef enum {
+	EVCON_WATCHER_FD,
+	EVCON_WATCHER_TIMER,
+	EVCON_WATCHER_ASYNC
+} evcon_watcher_type;
+
+typedef void (*evcon_generic_cb)(void); /* cast to evcon_fd_cb / evcon_timer_cb / evcon_async_cb */
+/* @watcher is a evcon_fd_watcher, evcon_timer_watcher or evcon_async_watcher, depending on @type */
+typedef void (*evcon_slow_callback_cb)(evcon_loop *loop, evcon_watcher_type type, void *watcher, evcon_generic_cb cb, uint64_t duration_ns, void *user_data);
+
+#define EVCON_CALLBACK_HISTOGRAM_BUCKETS (40)
+
+void evcon_loop_enable_callback_timing(evcon_loop *loop, uint64_t threshold_ns, evcon_slow_callback_cb slow_cb, void *user_data);
+/* copies the histogram; returns 0 (and zeroes @buckets) if timing is not enabled */
+int evcon_loop_get_callback_histogram(evcon_loop *loop, uint64_t buckets[EVCON_CALLBACK_HISTOGRAM_BUCKETS]);
+
+/* batch end hooks: run after each batch of watcher callbacks, so work the callbacks coalesced (like corked
+ * output) is done once instead of after each event. backends that dispatch in batches (epoll, io_uring) run the
+ * hooks once per loop iteration, others after each callback. hooks run in creation order and keep a loop reference.
+ */
+typedef struct evcon_batch_hook evcon_batch_hook;
+typedef void (*evcon_batch_hook_cb)(evcon_loop *loop, evcon_batch_hook *hook, void *user_data);
+
+evcon_batch_hook* evcon_batch_hook_new(evcon_loop *loop, evcon_batch_hook_cb cb, void *user_data);
+void evcon_batch_hook_free(evcon_batch_hook *hook); /* can be called from any callback (including hooks) */
+
 /* sets fd to non-blocking (and FD_CLOEXEC if supported) */
 void evcon_init_fd(evcon_fd fd);
 
@@ -92,11 +187,16 @@ int evcon_timer_is_active(evcon_fd_watcher* watcher); /* 1 == started, 0 == stop
 evcon_timer_cb evcon_timer_get_cb(evcon_timer_watcher *watcher);
 evcon_interval evcon_timer_get_timeout(evcon_timer_watcher *watcher); /* last used timeout, not the time until next event. after a trigger this gets setted to the repeat value */
 evcon_interval evcon_timer_get_repeat(evcon_timer_watcher *watcher);
+evcon_interval evcon_timer_get_slack(evcon_timer_watcher *watcher);
 void* evcon_timer_get_user_data(evcon_timer_watcher *watcher);
 evcon_loop *evcon_timer_get_loop(evcon_timer_watcher *watcher);
 
 void evcon_timer_set_cb(evcon_timer_watcher *watcher, evcon_timer_cb cb);
 void evcon_timer_set_repeat(evcon_timer_watcher *watcher, evcon_interval repeat); /* set repeat value for the future, doesn't change current timer nor does it start the watcher */
+/* allow the timer to trigger up to @slack later than requested (default 0), so timers with similar timeouts
+ * can share a wakeup. applies when the timer is (re)started next.
+ */
+void evcon_timer_set_slack(evcon_timer_watcher *watcher, evcon_interval slack);
 void evcon_timer_set_user_data(evcon_timer_watcher *watcher, void *user_data);
 
 /* async watcher.  */
@@ -111,4 +211,8 @@ evcon_loop *evcon_async_get_loop(evcon_async_watcher *watcher);
 void evcon_async_set_cb(evcon_async_watcher *watcher, evcon_async_cb cb);
 void evcon_async_set_user_data(evcon_async_watcher *watcher, void *user_data);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -10,7 +10,23 @@
 
 #define UNUSED(x) ((void)(x))
 
-static void echo_server_con_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data) {
+static void echo_server_con_close(EchoServerConnection *con) {
+	if (NULL != con->stream) {
+		evcon_stream_free(con->stream);
+	} else {
+		int fd = evcon_fd_get_fd(con->conn_watcher);
+
+		shutdown(fd, SHUT_RDWR);
+		close(fd);
+		evcon_fd_free(con->conn_watcher);
+	}
+	g_queue_unlink(&con->srv->connections, &con->con_link);
+	g_slice_free(EchoServerConnection, con);
+}
+
+/* plain fd watcher server */
+
+static void echo_server_con_fd_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data) {
 	static char buf[512];
 	EchoServerConnection *con = (EchoServerConnection*) user_data;
 	int r, r1;
@@ -30,10 +46,14 @@ static void echo_server_con_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evco
 			return;
 		default:
 			g_warning("Connection error (fatal): %s\n", g_strerror(errno));
-			goto closecon;
+			echo_server_con_close(con);
+			return;
 		}
 	}
-	if (0 == r) goto closecon;
+	if (0 == r) {
+		echo_server_con_close(con);
+		return;
+	}
 
 	r1 = write(fd, buf, r);
 
@@ -48,76 +68,82 @@ static void echo_server_con_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evco
 			return;
 		default:
 			g_warning("Connection error (fatal): %s\n", g_strerror(errno));
-			goto closecon;
+			echo_server_con_close(con);
+			return;
 		}
 	}
 
 	if (r1 < r) {
 		g_warning("Connection: write not complete, loosing remaining data\n");
 	}
+}
 
-	return;
+/* evcon_stream server */
 
-closecon:
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
-	evcon_fd_free(con->conn_watcher);
-	g_queue_unlink(&con->srv->connections, &con->con_link);
-	g_slice_free(EchoServerConnection, con);
+static void echo_server_con_stream_cb(evcon_loop *loop, evcon_stream *stream, evcon_stream_event event, void* user_data) {
+	EchoServerConnection *con = (EchoServerConnection*) user_data;
+	UNUSED(loop);
+
+	switch (event) {
+	case EVCON_STREAM_READ:
+		/* hands the input chunks to the output queue; nothing is lost on partial writes */
+		if (-1 == evcon_stream_write_input(stream, stream)) {
+			g_warning("Connection error (fatal): %s\n", g_strerror(errno));
+			echo_server_con_close(con);
+		}
+		break;
+	case EVCON_STREAM_DRAINED:
+		if (con->closing) echo_server_con_close(con);
+		break;
+	case EVCON_STREAM_EOF:
+		con->closing = TRUE;
+		if (0 == evcon_stream_output_length(stream)) echo_server_con_close(con);
+		break;
+	case EVCON_STREAM_ERROR:
+		g_warning("Connection error (fatal): %s\n", g_strerror(errno));
+		echo_server_con_close(con);
+		break;
+	}
 }
 
 static EchoServerConnection* echo_server_con_new(EchoServer* srv, evcon_fd fd) {
 	EchoServerConnection *con = g_slice_new0(EchoServerConnection);
-	evcon_init_fd(fd);
 	con->srv = srv;
-	con->conn_watcher = evcon_fd_new(srv->loop, echo_server_con_cb, fd, EVCON_READ, con);
-	evcon_fd_start(con->conn_watcher);
+	if (srv->use_stream) {
+		con->stream = evcon_stream_new(srv->loop, fd, echo_server_con_stream_cb, con);
+	} else {
+		con->conn_watcher = evcon_fd_new(srv->loop, echo_server_con_fd_cb, fd, EVCON_READ, con);
+		evcon_fd_start(con->conn_watcher);
+	}
 	con->con_link.data = con;
 	g_queue_push_tail_link(&srv->connections, &con->con_link);
 	return con;
 }
 
-static void echo_server_listen_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void* user_data) {
+static void echo_server_accept_cb(evcon_loop *loop, evcon_acceptor *acceptor, const evcon_fd *fds, unsigned int count, void* user_data) {
 	EchoServer *srv = (EchoServer*) user_data;
-	int confd;
+	unsigned int i;
 	UNUSED(loop);
-	UNUSED(watcher);
-	UNUSED(revents);
+	UNUSED(acceptor);
 
-	while (-1 != (confd = accept(fd, NULL, NULL))) {
-		echo_server_con_new(srv, confd);
-	}
+	if (0 == count) g_error("accept() failed: %s\n", g_strerror(errno));
 
-	switch (errno) {
-	case EINTR:
-	case EAGAIN:
-#if EWOULDBLOCK != EAGAIN
-	case EWOULDBLOCK:
-#endif
-		return;
-	default:
-		g_error("accept() failed: %s\n", g_strerror(errno));
-		break;
-	}
+	for (i = 0; i < count; ++i) echo_server_con_new(srv, fds[i]);
 }
 
-EchoServer* echo_server_new(evcon_loop *loop) {
+EchoServer* echo_server_new(evcon_loop *loop, gboolean use_stream) {
 	EchoServer *srv = g_slice_new0(EchoServer);
 	struct sockaddr_in addr;
 	int fd;
 
 	evcon_loop_ref(loop);
 	srv->loop = loop;
-
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	evcon_init_fd(fd);
-	if (-1 == fd) g_error("socket() failed: %s\n", g_strerror(errno));
+	srv->use_stream = use_stream;
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	if (-1 == bind(fd, (struct sockaddr*) &addr, sizeof(addr))) g_error("bind() failed: %s\n", g_strerror(errno));
-
-	if (-1 == listen(fd, 128)) g_error("listen() failed: %s\n", g_strerror(errno));
+	fd = evcon_listen_socket((struct sockaddr*) &addr, sizeof(addr), 128, 0);
+	if (-1 == fd) g_error("listen failed: %s\n", g_strerror(errno));
 
 	{
 		socklen_t addrlen = sizeof(addr);
@@ -125,8 +151,7 @@ EchoServer* echo_server_new(evcon_loop *loop) {
 		srv->port = ntohs(addr.sin_port);
 	}
 
-	srv->listen_watcher = evcon_fd_new(srv->loop, echo_server_listen_cb, fd, EVCON_READ, srv);
-	evcon_fd_start(srv->listen_watcher);
+	srv->acceptor = evcon_acceptor_new(srv->loop, fd, echo_server_accept_cb, srv);
 
 	return srv;
 }
@@ -134,18 +159,11 @@ EchoServer* echo_server_new(evcon_loop *loop) {
 void echo_server_free(EchoServer *srv) {
 	GList *link;
 
-	while (NULL != (link = g_queue_pop_head_link(&srv->connections))) {
-		EchoServerConnection *con = link->data;
-		int fd = evcon_fd_get_fd(con->conn_watcher);
-
-		shutdown(fd, SHUT_RDWR);
-		close(fd);
-		evcon_fd_free(con->conn_watcher);
-		g_slice_free(EchoServerConnection, con);
+	while (NULL != (link = g_queue_peek_head_link(&srv->connections))) {
+		echo_server_con_close(link->data);
 	}
 
-	close(evcon_fd_get_fd(srv->listen_watcher));
-	evcon_fd_free(srv->listen_watcher);
+	evcon_acceptor_free(srv->acceptor);
 
 	evcon_loop_unref(srv->loop);
 	g_slice_free(EchoServer, srv);
@@ -2,26 +2,33 @@
 #define __EVCON_ECHO_H __EVCON_ECHO_H
 
 #include <evcon.h>
+#include <evcon-listener.h>
+#include <evcon-stream.h>
 #include <glib.h>
 
 #include <time.h>
 
+G_BEGIN_DECLS
+
 typedef struct EchoServerConnection EchoServerConnection;
 typedef struct EchoServer EchoServer;
 
 struct EchoServerConnection {
 	EchoServer *srv;
-	evcon_fd_watcher *conn_watcher;
+	evcon_fd_watcher *conn_watcher; /* NULL if stream is used */
+	evcon_stream *stream;
 	GList con_link;
+	gboolean closing;
 };
 struct EchoServer {
 	unsigned short port;
 	evcon_loop *loop;
-	evcon_fd_watcher *listen_watcher;
+	gboolean use_stream; /* serve connections with evcon_stream instead of plain fd watchers */
+	evcon_acceptor *acceptor;
 	GQueue connections; /* <EchoServerConnection> */
 };
 
-EchoServer* echo_server_new(evcon_loop *loop);
+EchoServer* echo_server_new(evcon_loop *loop, gboolean use_stream);
 void echo_server_free(EchoServer *srv);
 
 
@@ -51,4 +58,6 @@ struct EchoClient {
 EchoClient* echo_client_new(EchoServer *srv, int count, EchoClientFinishedCB finished_cb, void *finished_data);
 void echo_client_free(EchoClient *client);
 
+G_END_DECLS
+
 #endif
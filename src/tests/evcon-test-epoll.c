@@ -0,0 +1,547 @@
+
+#include "evcon-echo.h"
+#include "evcon-transfer.h"
+
+#include <evcon-backend.h>
+#include <evcon-epoll.h>
+#include <evcon-group.h>
+#include <evcon-stream.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static void test_epoll_client_finished_cb(EchoClient* client, void *user_data) {
+	evcon_loop *loop = (evcon_loop*) user_data;
+	UNUSED(client);
+
+	evcon_loop_epoll_break(loop);
+}
+
+
+static void run_test_epoll(gboolean timer_wheel, gboolean pool, gboolean stats, gboolean use_stream) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+	EchoClient *client;
+	EchoServer *srv;
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+
+	if (timer_wheel) evcon_loop_enable_timer_wheel(loop, EVCON_INTERVAL_FROM_MSEC(1));
+	if (pool) evcon_loop_enable_pool(loop);
+	if (stats) {
+		evcon_loop_enable_stats(loop);
+		evcon_loop_enable_callback_timing(loop, 0, NULL, NULL);
+	}
+
+	srv = echo_server_new(loop, use_stream);
+	g_debug("Listening on port %i\n", srv->port);
+
+	client = echo_client_new(srv, 5, test_epoll_client_finished_cb, loop);
+
+	evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_DEFAULT);
+
+	if (stats) {
+		evcon_loop_stats st;
+		uint64_t buckets[EVCON_CALLBACK_HISTOGRAM_BUCKETS], timed = 0;
+		guint i;
+
+		g_assert(evcon_loop_get_stats(loop, &st));
+		g_assert(st.fd_callbacks > 0);
+		g_assert(st.fd_updates > 0);
+		g_assert(st.fd_allocs > 0);
+		g_assert(st.fd_alloc_bytes >= st.fd_allocs);
+
+		g_assert(evcon_loop_get_callback_histogram(loop, buckets));
+		for (i = 0; i < EVCON_CALLBACK_HISTOGRAM_BUCKETS; i++) timed += buckets[i];
+		g_assert(timed == st.fd_callbacks + st.timer_callbacks + st.async_callbacks);
+	}
+
+	echo_client_free(client);
+	echo_server_free(srv);
+
+	evcon_loop_unref(loop);
+}
+
+static void test_epoll(void) {
+	run_test_epoll(FALSE, FALSE, FALSE, FALSE);
+}
+
+static void test_epoll_timer_wheel(void) {
+	run_test_epoll(TRUE, FALSE, FALSE, FALSE);
+}
+
+static void test_epoll_pool(void) {
+	run_test_epoll(FALSE, TRUE, FALSE, FALSE);
+}
+
+static void test_epoll_stats(void) {
+	run_test_epoll(FALSE, FALSE, TRUE, FALSE);
+}
+
+static void test_epoll_stream(void) {
+	run_test_epoll(FALSE, FALSE, FALSE, TRUE);
+}
+
+/* timer slack: timers expiring within the slack are aligned to the same deadline and fire in one iteration */
+
+#define TEST_SLACK_TIMERS 4
+
+typedef struct {
+	evcon_interval expected; /* earliest allowed expiry */
+	guint fired;
+} test_slack_timer;
+
+static void test_slack_timer_cb(evcon_loop *loop, evcon_timer_watcher *watcher, void *user_data) {
+	test_slack_timer *t = user_data;
+	UNUSED(loop);
+	UNUSED(watcher);
+
+	g_assert(evcon_monotonic_now() >= t->expected);
+	t->fired++;
+}
+
+static void test_epoll_timer_slack(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+	evcon_interval step = EVCON_INTERVAL_FROM_MSEC(32), now, target;
+	evcon_timer_watcher *watchers[TEST_SLACK_TIMERS];
+	test_slack_timer timers[TEST_SLACK_TIMERS];
+	guint i, fired = 0, iterations = 0;
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+
+	/* the timeouts end 1..n ms before a multiple of the slack at least half a slack away */
+	now = evcon_monotonic_now();
+	target = (now + step / 2 + step - 1) / step * step;
+	for (i = 0; i < TEST_SLACK_TIMERS; i++) {
+		evcon_interval timeout = target - now - EVCON_INTERVAL_FROM_MSEC(1 + i);
+
+		timers[i].expected = now + timeout;
+		timers[i].fired = 0;
+		watchers[i] = evcon_timer_new(loop, test_slack_timer_cb, &timers[i]);
+		evcon_timer_set_slack(watchers[i], step);
+		g_assert(step == evcon_timer_get_slack(watchers[i]));
+		evcon_timer_once(watchers[i], timeout);
+	}
+
+	while (0 == fired) {
+		evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+		for (fired = 0, i = 0; i < TEST_SLACK_TIMERS; i++) fired += timers[i].fired;
+		g_assert(++iterations < 100);
+	}
+	/* all of them in the first iteration that fired any */
+	g_assert_cmpuint(fired, ==, TEST_SLACK_TIMERS);
+	g_assert(evcon_monotonic_now() >= target);
+
+	for (i = 0; i < TEST_SLACK_TIMERS; i++) evcon_timer_free(watchers[i]);
+	evcon_loop_unref(loop);
+}
+
+/* EVCON_ET: readiness is reported once; data left unread doesn't trigger the watcher again */
+
+static void test_et_read_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	guint *calls = user_data;
+	char c;
+	UNUSED(loop);
+	UNUSED(watcher);
+
+	g_assert(revents & EVCON_READ);
+	g_assert(1 == read(fd, &c, 1));
+	(*calls)++;
+}
+
+static void test_epoll_et(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+	evcon_fd_watcher *watcher;
+	guint i, calls = 0;
+	int pair[2];
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) g_error("socketpair failed: %s\n", g_strerror(errno));
+	evcon_init_fd(pair[0]);
+
+	watcher = evcon_fd_new(loop, test_et_read_cb, pair[0], EVCON_READ | EVCON_ET, &calls);
+	evcon_fd_start(watcher);
+
+	g_assert(2 == write(pair[1], "ab", 2));
+	for (i = 0; i < 100 && 0 == calls; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+	g_assert_cmpuint(calls, ==, 1);
+
+	/* one byte is still buffered, but no new data arrived */
+	for (i = 0; i < 10; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_NOWAIT);
+	g_assert_cmpuint(calls, ==, 1);
+
+	g_assert(1 == write(pair[1], "c", 1));
+	for (i = 0; i < 100 && 1 == calls; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+	g_assert_cmpuint(calls, ==, 2);
+
+	evcon_fd_free(watcher);
+	evcon_loop_unref(loop);
+	close(pair[0]);
+	close(pair[1]);
+}
+
+/* evcon_fd_set_fd with the current fd: the fd was closed and its number reused, it has to be registered again */
+
+static void test_rearm_read_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	guint *calls = user_data;
+	char c;
+	UNUSED(loop);
+	UNUSED(watcher);
+
+	g_assert(revents & EVCON_READ);
+	g_assert(1 == read(fd, &c, 1));
+	(*calls)++;
+}
+
+static void test_epoll_fd_rearm(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+	evcon_fd_watcher *watcher;
+	guint i, calls = 0;
+	int pair[2], reused[2];
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) g_error("socketpair failed: %s\n", g_strerror(errno));
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, reused)) g_error("socketpair failed: %s\n", g_strerror(errno));
+	evcon_init_fd(pair[0]);
+	evcon_init_fd(reused[0]);
+
+	watcher = evcon_fd_new(loop, test_rearm_read_cb, pair[0], EVCON_READ, &calls);
+	evcon_fd_start(watcher);
+	g_assert(1 == write(pair[1], "a", 1));
+	for (i = 0; i < 100 && 0 == calls; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+	g_assert_cmpuint(calls, ==, 1);
+
+	/* same number, other socket: the kernel dropped the registration with the closed one */
+	close(pair[0]);
+	g_assert(pair[0] == dup2(reused[0], pair[0]));
+	close(reused[0]);
+	evcon_fd_set_fd(watcher, pair[0]);
+
+	g_assert(1 == write(reused[1], "b", 1));
+	for (i = 0; i < 100 && 1 == calls; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_NOWAIT);
+	g_assert_cmpuint(calls, ==, 2);
+
+	evcon_fd_free(watcher);
+	evcon_loop_unref(loop);
+	close(pair[0]);
+	close(pair[1]);
+	close(reused[1]);
+}
+
+/* acceptor backoff: EMFILE stops accepting for a while instead of reporting the socket in every iteration */
+
+typedef struct {
+	guint errors, accepted;
+} test_backoff_state;
+
+static void test_backoff_accept_cb(evcon_loop *loop, evcon_acceptor *acceptor, const evcon_fd *fds, unsigned int count, void *user_data) {
+	test_backoff_state *st = user_data;
+	unsigned int i;
+	UNUSED(loop);
+	UNUSED(acceptor);
+
+	if (0 == count) {
+		g_assert_cmpint(errno, ==, EMFILE);
+		st->errors++;
+	}
+	for (i = 0; i < count; i++) close(fds[i]);
+	st->accepted += count;
+}
+
+static void test_epoll_accept_backoff(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+	evcon_acceptor *acceptor;
+	test_backoff_state st;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct rlimit limit, low;
+	evcon_interval paused;
+	int fd, client;
+	guint i;
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+	memset(&st, 0, sizeof(st));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = evcon_listen_socket((struct sockaddr*) &addr, sizeof(addr), 16, 0);
+	if (-1 == fd) g_error("listen failed: %s\n", g_strerror(errno));
+	if (-1 == getsockname(fd, (struct sockaddr*) &addr, &addrlen)) g_error("getsockname() failed: %s\n", g_strerror(errno));
+	acceptor = evcon_acceptor_new(loop, fd, test_backoff_accept_cb, &st);
+
+	if (-1 == (client = socket(AF_INET, SOCK_STREAM, 0))) g_error("socket() failed: %s\n", g_strerror(errno));
+	if (-1 == connect(client, (struct sockaddr*) &addr, sizeof(addr))) g_error("connect() failed: %s\n", g_strerror(errno));
+
+	/* no fd left for the accepted connection */
+	if (-1 == getrlimit(RLIMIT_NOFILE, &limit)) g_error("getrlimit() failed: %s\n", g_strerror(errno));
+	low = limit;
+	low.rlim_cur = client + 1;
+	if (-1 == setrlimit(RLIMIT_NOFILE, &low)) g_error("setrlimit() failed: %s\n", g_strerror(errno));
+
+	for (i = 0; i < 100 && 0 == st.errors; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+	paused = evcon_monotonic_now();
+	for (i = 0; i < 100; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_NOWAIT);
+	g_assert_cmpuint(st.errors, ==, 1);
+	g_assert_cmpuint(st.accepted, ==, 0);
+
+	/* the connection waited in the backlog */
+	if (-1 == setrlimit(RLIMIT_NOFILE, &limit)) g_error("setrlimit() failed: %s\n", g_strerror(errno));
+	for (i = 0; i < 100 && 0 == st.accepted; i++) evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+	g_assert_cmpuint(st.accepted, ==, 1);
+	g_assert(evcon_monotonic_now() - paused >= EVCON_ACCEPTOR_BACKOFF);
+
+	evcon_acceptor_free(acceptor);
+	close(client);
+	evcon_loop_unref(loop);
+}
+
+/* loop group: the fd starts on loop 0, moves itself to loop 1 on the first byte */
+
+static evcon_loop* test_group_loop_new(void *user_data) {
+	UNUSED(user_data);
+	return evcon_loop_new_epoll(NULL);
+}
+static void test_group_loop_run(evcon_loop *loop, void *user_data) {
+	UNUSED(user_data);
+	evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_DEFAULT);
+}
+static void test_group_loop_break(evcon_loop *loop, void *user_data) {
+	UNUSED(user_data);
+	evcon_loop_epoll_break(loop);
+}
+static void test_group_loop_free(evcon_loop *loop, void *user_data) {
+	UNUSED(user_data);
+	evcon_loop_unref(loop);
+}
+
+static const evcon_loop_group_funcs test_group_funcs = {
+	test_group_loop_new,
+	test_group_loop_run,
+	test_group_loop_break,
+	test_group_loop_free
+};
+
+typedef struct {
+	evcon_loop_group *group;
+	gint reads, moved, wrong_loop;
+} test_group_state;
+
+static void test_group_moved_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, void *user_data) {
+	test_group_state *st = user_data;
+	UNUSED(fd);
+
+	if (NULL == watcher || loop != evcon_loop_group_get_loop(st->group, 1)) g_atomic_int_inc(&st->wrong_loop);
+	g_atomic_int_inc(&st->moved);
+}
+
+static void test_group_read_cb(evcon_loop *loop, evcon_fd_watcher *watcher, evcon_fd fd, int revents, void *user_data) {
+	test_group_state *st = user_data;
+	char c;
+	UNUSED(revents);
+
+	if (1 != read(fd, &c, 1)) return;
+
+	if ('x' == c) {
+		if (loop != evcon_loop_group_get_loop(st->group, 0)) g_atomic_int_inc(&st->wrong_loop);
+		g_assert(0 == evcon_loop_group_move_fd(st->group, watcher, evcon_loop_group_get_loop(st->group, 1), test_group_moved_cb));
+	} else {
+		if (loop != evcon_loop_group_get_loop(st->group, 1)) g_atomic_int_inc(&st->wrong_loop);
+		evcon_fd_free(watcher);
+	}
+	g_atomic_int_inc(&st->reads);
+}
+
+static void test_group_wait(gint *value, gint expected) {
+	guint i;
+
+	for (i = 0; i < 5000 && g_atomic_int_get(value) < expected; i++) g_usleep(1000);
+	g_assert(g_atomic_int_get(value) == expected);
+}
+
+static void test_epoll_group(void) {
+	test_group_state st;
+	int pair[2];
+
+	memset(&st, 0, sizeof(st));
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) g_error("socketpair failed: %s\n", g_strerror(errno));
+	evcon_init_fd(pair[0]);
+
+	st.group = evcon_loop_group_new(&test_group_funcs, NULL, 2, EVCON_GROUP_ROUND_ROBIN);
+	if (NULL == st.group) g_error("evcon_loop_group_new() failed: %s\n", g_strerror(errno));
+	g_assert(2 == evcon_loop_group_size(st.group));
+
+	/* round robin starts with loop 0 */
+	evcon_loop_group_add_fd(st.group, pair[0], EVCON_READ, test_group_read_cb, NULL, &st);
+
+	g_assert(1 == write(pair[1], "x", 1));
+	test_group_wait(&st.moved, 1);
+	g_assert(1 == write(pair[1], "y", 1));
+	test_group_wait(&st.reads, 2);
+	g_assert(0 == g_atomic_int_get(&st.wrong_loop));
+
+	evcon_loop_group_free(st.group);
+	close(pair[0]);
+	close(pair[1]);
+}
+
+/* group listen: one SO_REUSEPORT listener per loop, connections accepted in the loop threads */
+
+#define TEST_GROUP_CONNECTIONS 16
+
+typedef struct {
+	evcon_loop_group *group;
+	gint accepted, wrong_loop;
+} test_group_listen_state;
+
+static void test_group_listen_cb(evcon_loop *loop, evcon_listener *listener, evcon_fd fd, const struct sockaddr *addr, socklen_t addrlen, void *user_data) {
+	test_group_listen_state *st = user_data;
+	UNUSED(addr);
+	UNUSED(addrlen);
+
+	if (-1 == fd) g_error("accept failed: %s\n", g_strerror(errno));
+	if (loop != evcon_listener_get_loop(listener)
+		|| (loop != evcon_loop_group_get_loop(st->group, 0) && loop != evcon_loop_group_get_loop(st->group, 1))) {
+		g_atomic_int_inc(&st->wrong_loop);
+	}
+	close(fd);
+	g_atomic_int_inc(&st->accepted);
+}
+
+static void test_epoll_group_listen(void) {
+	test_group_listen_state st;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd, clients[TEST_GROUP_CONNECTIONS];
+	guint i;
+
+	memset(&st, 0, sizeof(st));
+	st.group = evcon_loop_group_new(&test_group_funcs, NULL, 2, EVCON_GROUP_ROUND_ROBIN);
+	if (NULL == st.group) g_error("evcon_loop_group_new() failed: %s\n", g_strerror(errno));
+	if (0 != evcon_loop_group_pin_cpus(st.group)) g_message("evcon_loop_group_pin_cpus() failed: %s\n", g_strerror(errno));
+
+	/* the group doesn't report the port it picked for port 0: take a free one */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = evcon_listen_socket((struct sockaddr*) &addr, sizeof(addr), 1, 0);
+	if (-1 == fd) g_error("listen failed: %s\n", g_strerror(errno));
+	if (-1 == getsockname(fd, (struct sockaddr*) &addr, &addrlen)) g_error("getsockname() failed: %s\n", g_strerror(errno));
+	close(fd);
+
+	if (0 != evcon_loop_group_listen(st.group, (struct sockaddr*) &addr, sizeof(addr), 128, EVCON_LISTEN_STEER_CPU, test_group_listen_cb, &st)) {
+		g_error("evcon_loop_group_listen() failed: %s\n", g_strerror(errno));
+	}
+
+	for (i = 0; i < TEST_GROUP_CONNECTIONS; i++) {
+		if (-1 == (clients[i] = socket(AF_INET, SOCK_STREAM, 0))) g_error("socket() failed: %s\n", g_strerror(errno));
+		if (-1 == connect(clients[i], (struct sockaddr*) &addr, sizeof(addr))) g_error("connect() failed: %s\n", g_strerror(errno));
+	}
+	test_group_wait(&st.accepted, TEST_GROUP_CONNECTIONS);
+	g_assert(0 == g_atomic_int_get(&st.wrong_loop));
+
+	/* frees the listeners */
+	evcon_loop_group_free(st.group);
+	for (i = 0; i < TEST_GROUP_CONNECTIONS; i++) close(clients[i]);
+}
+
+/* stream transfers: file ranges (sendfile and the read fallback) and splice proxying */
+
+static void test_epoll_run_once(evcon_loop *loop) {
+	evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+}
+
+static void test_epoll_stream_file(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+	transfer_test_write_file(loop, test_epoll_run_once, TRUE);
+	transfer_test_write_file(loop, test_epoll_run_once, FALSE);
+	evcon_loop_unref(loop);
+}
+
+static void test_epoll_stream_splice(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+	transfer_test_splice(loop, test_epoll_run_once);
+	evcon_loop_unref(loop);
+}
+
+/* corked output: written at the end of the callback batch, or right away outside of callbacks */
+
+static void test_cork_stream_cb(evcon_loop *loop, evcon_stream *stream, evcon_stream_event event, void *user_data) {
+	UNUSED(loop);
+	UNUSED(stream);
+	UNUSED(user_data);
+
+	if (EVCON_STREAM_ERROR == event) g_error("stream failed: %s\n", g_strerror(errno));
+}
+
+static void test_cork_timer_cb(evcon_loop *loop, evcon_timer_watcher *watcher, void *user_data) {
+	evcon_stream *stream = (evcon_stream*) user_data;
+	UNUSED(loop);
+	UNUSED(watcher);
+
+	g_assert_cmpint(evcon_stream_write(stream, "in ", 3), ==, 0);
+	g_assert_cmpint(evcon_stream_write(stream, "callback", 8), ==, 0);
+	/* waits for the batch end */
+	g_assert_cmpuint(evcon_stream_output_length(stream), ==, 11);
+}
+
+static void test_epoll_cork(void) {
+	evcon_loop *loop = evcon_loop_new_epoll(NULL);
+	evcon_timer_watcher *timer;
+	evcon_stream *stream;
+	char buf[32];
+	int pair[2];
+
+	if (NULL == loop) g_error("evcon_loop_new_epoll() failed: %s\n", g_strerror(errno));
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) g_error("socketpair() failed: %s\n", g_strerror(errno));
+	stream = evcon_stream_new(loop, pair[0], test_cork_stream_cb, NULL);
+	evcon_stream_set_cork(stream, 1);
+
+	/* no callback running: nothing would flush it */
+	g_assert_cmpint(evcon_stream_write(stream, "idle", 4), ==, 0);
+	g_assert_cmpuint(evcon_stream_output_length(stream), ==, 0);
+	g_assert_cmpint(recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT), ==, 4);
+	g_assert(0 == memcmp(buf, "idle", 4));
+
+	timer = evcon_timer_new(loop, test_cork_timer_cb, stream);
+	evcon_timer_once(timer, 0);
+	evcon_loop_epoll_run(loop, EVCON_EPOLL_RUN_ONCE);
+	g_assert_cmpuint(evcon_stream_output_length(stream), ==, 0);
+	g_assert_cmpint(recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT), ==, 11);
+	g_assert(0 == memcmp(buf, "in callback", 11));
+
+	evcon_timer_free(timer);
+	evcon_stream_free(stream);
+	close(pair[1]);
+	evcon_loop_unref(loop);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/evcon-echo/test-epoll", test_epoll);
+	g_test_add_func("/evcon-echo/test-epoll-timer-wheel", test_epoll_timer_wheel);
+	g_test_add_func("/evcon-echo/test-epoll-pool", test_epoll_pool);
+	g_test_add_func("/evcon-echo/test-epoll-stats", test_epoll_stats);
+	g_test_add_func("/evcon-echo/test-epoll-stream", test_epoll_stream);
+	g_test_add_func("/evcon-echo/test-epoll-group", test_epoll_group);
+	g_test_add_func("/evcon-echo/test-epoll-group-listen", test_epoll_group_listen);
+	g_test_add_func("/evcon-epoll/timer-slack", test_epoll_timer_slack);
+	g_test_add_func("/evcon-epoll/et", test_epoll_et);
+	g_test_add_func("/evcon-epoll/fd-rearm", test_epoll_fd_rearm);
+	g_test_add_func("/evcon-epoll/accept-backoff", test_epoll_accept_backoff);
+	g_test_add_func("/evcon-epoll/stream-file", test_epoll_stream_file);
+	g_test_add_func("/evcon-epoll/stream-splice", test_epoll_stream_splice);
+	g_test_add_func("/evcon-epoll/cork", test_epoll_cork);
+
+	return g_test_run();
+}
@@ -13,14 +13,14 @@ static void test_ev_client_finished_cb(EchoClient* client, void *user_data) {
 }
 
 
-static void test_ev(void) {
+static void run_test_ev(gboolean use_stream) {
 	struct ev_loop *l = ev_loop_new(0);
 	evcon_allocator *alloc = evcon_glib_allocator();
 	evcon_loop *loop = evcon_loop_from_ev(l, alloc);
 	EchoClient *client;
 	EchoServer *srv;
 
-	srv = echo_server_new(loop);
+	srv = echo_server_new(loop, use_stream);
 	g_debug("Listening on port %i\n", srv->port);
 
 	client = echo_client_new(srv, 5, test_ev_client_finished_cb, l);
@@ -35,11 +35,20 @@ static void test_ev(void) {
 	ev_loop_destroy(l);
 }
 
+static void test_ev(void) {
+	run_test_ev(FALSE);
+}
+
+static void test_ev_stream(void) {
+	run_test_ev(TRUE);
+}
+
 
 int main(int argc, char** argv) {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/evcon-echo/test-ev", test_ev);
+	g_test_add_func("/evcon-echo/test-ev-stream", test_ev_stream);
 
 	return g_test_run();
 }
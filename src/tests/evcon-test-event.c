@@ -13,13 +13,13 @@ static void test_event_client_finished_cb(EchoClient* client, void *user_data) {
 }
 
 
-static void test_event(void) {
+static void run_test_event(gboolean use_stream) {
 	struct event_base *base = event_base_new();
 	evcon_loop *loop = evcon_loop_from_event(base, NULL);
 	EchoClient *client;
 	EchoServer *srv;
 
-	srv = echo_server_new(loop);
+	srv = echo_server_new(loop, use_stream);
 	g_debug("Listening on port %i\n", srv->port);
 
 	client = echo_client_new(srv, 5, test_event_client_finished_cb, base);
@@ -34,10 +34,19 @@ static void test_event(void) {
 	event_base_free(base);
 }
 
+static void test_event(void) {
+	run_test_event(FALSE);
+}
+
+static void test_event_stream(void) {
+	run_test_event(TRUE);
+}
+
 int main(int argc, char** argv) {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/evcon-echo/test-event", test_event);
+	g_test_add_func("/evcon-echo/test-event-stream", test_event_stream);
 
 	return g_test_run();
 }
@@ -12,7 +12,7 @@ static void test_glib_client_finished_cb(EchoClient* client, void *user_data) {
 }
 
 
-static void test_glib(void) {
+static void run_test_glib(gboolean use_stream) {
 	GMainContext *ctx = g_main_context_new();
 	GMainLoop *gloop = g_main_loop_new(ctx, FALSE);
 	evcon_allocator *alloc = evcon_glib_allocator();
@@ -20,7 +20,7 @@ static void test_glib(void) {
 	EchoClient *client;
 	EchoServer *srv;
 
-	srv = echo_server_new(loop);
+	srv = echo_server_new(loop, use_stream);
 	g_debug("Listening on port %i\n", srv->port);
 
 	client = echo_client_new(srv, 5, test_glib_client_finished_cb, gloop);
@@ -36,12 +36,21 @@ static void test_glib(void) {
 	g_main_context_unref(ctx);
 }
 
+static void test_glib(void) {
+	run_test_glib(FALSE);
+}
+
+static void test_glib_stream(void) {
+	run_test_glib(TRUE);
+}
+
 
 
 int main(int argc, char** argv) {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/evcon-echo/test-glib", test_glib);
+	g_test_add_func("/evcon-echo/test-glib-stream", test_glib_stream);
 
 	return g_test_run();
 }
@@ -0,0 +1,63 @@
+
+#include "evcon-echo.h"
+
+#include <evcon-qt.h>
+
+#include <QCoreApplication>
+
+#define UNUSED(x) ((void)(x))
+
+static void test_qt_client_finished_cb(EchoClient* client, void *user_data) {
+	UNUSED(client);
+	UNUSED(user_data);
+
+	QCoreApplication::quit();
+}
+
+
+static void run_test_qt(gboolean timer_wheel, gboolean use_stream) {
+	evcon_loop *loop = evcon_loop_new_qt(NULL);
+	EchoClient *client;
+	EchoServer *srv;
+
+	g_assert(NULL != loop);
+
+	if (timer_wheel) evcon_loop_enable_timer_wheel(loop, EVCON_INTERVAL_FROM_MSEC(1));
+
+	srv = echo_server_new(loop, use_stream);
+	g_debug("Listening on port %i\n", srv->port);
+
+	client = echo_client_new(srv, 5, test_qt_client_finished_cb, NULL);
+
+	QCoreApplication::exec();
+
+	echo_client_free(client);
+	echo_server_free(srv);
+
+	evcon_loop_unref(loop);
+}
+
+static void test_qt(void) {
+	run_test_qt(FALSE, FALSE);
+}
+
+static void test_qt_timer_wheel(void) {
+	run_test_qt(TRUE, FALSE);
+}
+
+static void test_qt_stream(void) {
+	run_test_qt(FALSE, TRUE);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	/* the loops need the event dispatcher of the application */
+	QCoreApplication app(argc, argv);
+
+	g_test_add_func("/evcon-echo/test-qt", test_qt);
+	g_test_add_func("/evcon-echo/test-qt-timer-wheel", test_qt_timer_wheel);
+	g_test_add_func("/evcon-echo/test-qt-stream", test_qt_stream);
+
+	return g_test_run();
+}
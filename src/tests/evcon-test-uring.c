@@ -0,0 +1,212 @@
+
+#include "evcon-echo.h"
+#include "evcon-transfer.h"
+
+#include <evcon-listener.h>
+#include <evcon-uring.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+static void test_uring_client_finished_cb(EchoClient* client, void *user_data) {
+	evcon_loop *loop = (evcon_loop*) user_data;
+	UNUSED(client);
+
+	evcon_loop_uring_break(loop);
+}
+
+
+static void run_test_uring(gboolean use_stream) {
+	evcon_loop *loop = evcon_loop_new_uring(NULL);
+	EchoClient *client;
+	EchoServer *srv;
+
+	if (NULL == loop) {
+		/* kernel without (usable) io_uring: nothing to test */
+		g_message("evcon_loop_new_uring() failed, skipping: %s\n", g_strerror(errno));
+		return;
+	}
+
+	srv = echo_server_new(loop, use_stream);
+	g_debug("Listening on port %i\n", srv->port);
+
+	client = echo_client_new(srv, 5, test_uring_client_finished_cb, loop);
+
+	evcon_loop_uring_run(loop, EVCON_URING_RUN_DEFAULT);
+
+	echo_client_free(client);
+	echo_server_free(srv);
+
+	evcon_loop_unref(loop);
+}
+
+static void test_uring(void) {
+	run_test_uring(FALSE);
+}
+
+static void test_uring_stream(void) {
+	run_test_uring(TRUE);
+}
+
+typedef struct {
+	GString *received;
+	gboolean eof;
+} RecvTest;
+
+static void test_uring_recv_cb(evcon_loop *loop, evcon_uring_recv *recv, const char *buf, ssize_t len, void *user_data) {
+	RecvTest *t = (RecvTest*) user_data;
+	UNUSED(recv);
+
+	if (len < 0) g_error("recv failed: %s\n", g_strerror(-len));
+
+	if (0 == len) {
+		t->eof = TRUE;
+		evcon_loop_uring_break(loop);
+	} else {
+		g_string_append_len(t->received, buf, len);
+	}
+}
+
+static void test_uring_recv(void) {
+	evcon_loop *loop = evcon_loop_new_uring(NULL);
+	evcon_uring_recv *recv;
+	RecvTest t;
+	char data[10000];
+	int fds[2];
+	guint i;
+
+	if (NULL == loop) {
+		g_message("evcon_loop_new_uring() failed, skipping: %s\n", g_strerror(errno));
+		return;
+	}
+
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) g_error("socketpair() failed: %s\n", g_strerror(errno));
+	evcon_init_fd(fds[0]);
+
+	t.received = g_string_new(NULL);
+	t.eof = FALSE;
+	recv = evcon_uring_recv_new(loop, fds[0], test_uring_recv_cb, &t);
+	if (NULL == recv) {
+		g_message("evcon_uring_recv_new() failed, skipping: %s\n", g_strerror(errno));
+	} else {
+		/* more than one buffer */
+		for (i = 0; i < sizeof(data); ++i) data[i] = 'A' + (i % 26);
+		if (sizeof(data) != write(fds[1], data, sizeof(data))) g_error("write() failed\n");
+		shutdown(fds[1], SHUT_WR);
+
+		evcon_loop_uring_run(loop, EVCON_URING_RUN_DEFAULT);
+
+		g_assert(t.eof);
+		g_assert_cmpuint(t.received->len, ==, sizeof(data));
+		g_assert(0 == memcmp(t.received->str, data, sizeof(data)));
+		evcon_uring_recv_free(recv);
+	}
+
+	g_string_free(t.received, TRUE);
+	close(fds[0]);
+	close(fds[1]);
+	evcon_loop_unref(loop);
+}
+
+/* listener on top of the native acceptor: one callback per connection with its peer address */
+
+#define TEST_LISTENER_CONNECTIONS 3
+
+static void test_uring_listener_cb(evcon_loop *loop, evcon_listener *listener, evcon_fd fd, const struct sockaddr *addr, socklen_t addrlen, void *user_data) {
+	guint *accepted = (guint*) user_data;
+
+	if (-1 == fd) g_error("accept failed: %s\n", g_strerror(errno));
+	g_assert(NULL != addr && addrlen >= sizeof(struct sockaddr_in));
+	g_assert(AF_INET == addr->sa_family);
+	g_assert(htonl(INADDR_LOOPBACK) == ((const struct sockaddr_in*) addr)->sin_addr.s_addr);
+	close(fd);
+
+	if (TEST_LISTENER_CONNECTIONS == ++(*accepted)) {
+		/* from the callback: connections still left in the batch are closed */
+		evcon_listener_free(listener);
+		evcon_loop_uring_break(loop);
+	}
+}
+
+static void test_uring_listener(void) {
+	evcon_loop *loop = evcon_loop_new_uring(NULL);
+	evcon_listener *listener;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd, clients[TEST_LISTENER_CONNECTIONS];
+	guint i, accepted = 0;
+
+	if (NULL == loop) {
+		g_message("evcon_loop_new_uring() failed, skipping: %s\n", g_strerror(errno));
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = evcon_listen_socket((struct sockaddr*) &addr, sizeof(addr), 16, 0);
+	if (-1 == fd) g_error("listen failed: %s\n", g_strerror(errno));
+	if (-1 == getsockname(fd, (struct sockaddr*) &addr, &addrlen)) g_error("getsockname() failed: %s\n", g_strerror(errno));
+
+	listener = evcon_listener_new(loop, fd, test_uring_listener_cb, &accepted);
+	g_assert(fd == evcon_listener_get_fd(listener));
+	g_assert(loop == evcon_listener_get_loop(listener));
+
+	for (i = 0; i < TEST_LISTENER_CONNECTIONS; ++i) {
+		if (-1 == (clients[i] = socket(AF_INET, SOCK_STREAM, 0))) g_error("socket() failed: %s\n", g_strerror(errno));
+		if (-1 == connect(clients[i], (struct sockaddr*) &addr, sizeof(addr))) g_error("connect() failed: %s\n", g_strerror(errno));
+	}
+
+	evcon_loop_uring_run(loop, EVCON_URING_RUN_DEFAULT);
+	g_assert_cmpuint(accepted, ==, TEST_LISTENER_CONNECTIONS);
+
+	for (i = 0; i < TEST_LISTENER_CONNECTIONS; ++i) close(clients[i]);
+	evcon_loop_unref(loop);
+}
+
+/* stream transfers: file ranges (sendfile and the read fallback) and splice proxying */
+
+static void test_uring_run_once(evcon_loop *loop) {
+	evcon_loop_uring_run(loop, EVCON_URING_RUN_ONCE);
+}
+
+static void test_uring_stream_file(void) {
+	evcon_loop *loop = evcon_loop_new_uring(NULL);
+
+	if (NULL == loop) {
+		g_message("evcon_loop_new_uring() failed, skipping: %s\n", g_strerror(errno));
+		return;
+	}
+	transfer_test_write_file(loop, test_uring_run_once, TRUE);
+	transfer_test_write_file(loop, test_uring_run_once, FALSE);
+	evcon_loop_unref(loop);
+}
+
+static void test_uring_stream_splice(void) {
+	evcon_loop *loop = evcon_loop_new_uring(NULL);
+
+	if (NULL == loop) {
+		g_message("evcon_loop_new_uring() failed, skipping: %s\n", g_strerror(errno));
+		return;
+	}
+	transfer_test_splice(loop, test_uring_run_once);
+	evcon_loop_unref(loop);
+}
+
+int main(int argc, char** argv) {
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/evcon-echo/test-uring", test_uring);
+	g_test_add_func("/evcon-echo/test-uring-stream", test_uring_stream);
+	g_test_add_func("/evcon-uring/recv", test_uring_recv);
+	g_test_add_func("/evcon-uring/listener", test_uring_listener);
+	g_test_add_func("/evcon-uring/stream-file", test_uring_stream_file);
+	g_test_add_func("/evcon-uring/stream-splice", test_uring_stream_splice);
+
+	return g_test_run();
+}
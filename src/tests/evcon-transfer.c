@@ -0,0 +1,222 @@
+
+#include "evcon-transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+/* the written file has data around the start, the first sendfile boundary and the end; holes read as zeros */
+#define TRANSFER_MARK (64*1024)
+
+typedef struct {
+	guint64 size, received;
+	gboolean sparse; /* zeros outside the marked ranges */
+	gboolean eof;
+} TransferSink;
+
+typedef struct {
+	guint files_done;
+	gboolean proxy_eof;
+} TransferState;
+
+static guchar transfer_byte(guint64 pos) {
+	return (guchar) (pos * 13 + pos / 777 + 1);
+}
+
+/* end of the hole containing @pos, or @pos if it is in a marked range */
+static guint64 transfer_hole_end(TransferSink *sink, guint64 pos) {
+	guint64 boundary = EVCON_STREAM_SENDFILE_MAX;
+
+	if (!sink->sparse || pos < TRANSFER_MARK || pos >= sink->size - TRANSFER_MARK) return pos;
+	if (pos < boundary - TRANSFER_MARK) return boundary - TRANSFER_MARK;
+	if (pos < boundary + TRANSFER_MARK) return pos;
+	return sink->size - TRANSFER_MARK;
+}
+
+static void transfer_sink_check(TransferSink *sink, const guchar *data, gsize len) {
+	static const guchar zeros[4096];
+
+	g_assert(sink->received + len <= sink->size);
+	while (len > 0) {
+		guint64 end = transfer_hole_end(sink, sink->received);
+		gsize n;
+
+		if (end > sink->received) {
+			n = MIN(len, MIN(end - sink->received, sizeof(zeros)));
+			g_assert(0 == memcmp(data, zeros, n));
+		} else {
+			g_assert(transfer_byte(sink->received) == data[0]);
+			n = 1;
+		}
+		data += n;
+		len -= n;
+		sink->received += n;
+	}
+}
+
+static void transfer_sink_cb(evcon_loop *loop, evcon_stream *stream, evcon_stream_event event, void *user_data) {
+	TransferSink *sink = (TransferSink*) user_data;
+	struct iovec iov[16];
+	gsize i, n, len;
+	UNUSED(loop);
+
+	switch (event) {
+	case EVCON_STREAM_READ:
+		while (0 != (n = evcon_stream_peek(stream, iov, G_N_ELEMENTS(iov)))) {
+			for (len = 0, i = 0; i < n; i++) {
+				transfer_sink_check(sink, iov[i].iov_base, iov[i].iov_len);
+				len += iov[i].iov_len;
+			}
+			evcon_stream_consume(stream, len);
+		}
+		break;
+	case EVCON_STREAM_EOF:
+		sink->eof = TRUE;
+		break;
+	case EVCON_STREAM_ERROR:
+		g_error("sink failed: %s\n", g_strerror(errno));
+		break;
+	default:
+		break;
+	}
+}
+
+static void transfer_writer_cb(evcon_loop *loop, evcon_stream *stream, evcon_stream_event event, void *user_data) {
+	UNUSED(loop);
+	UNUSED(stream);
+	UNUSED(user_data);
+
+	if (EVCON_STREAM_ERROR == event) g_error("writer failed: %s\n", g_strerror(errno));
+}
+
+static void transfer_file_done_cb(evcon_fd fd, void *free_data) {
+	TransferState *state = (TransferState*) free_data;
+
+	close(fd);
+	state->files_done++;
+}
+
+static evcon_fd transfer_file_new(TransferSink *sink) {
+	char name[] = "/tmp/evcon-transfer-XXXXXX";
+	guchar buf[TRANSFER_MARK];
+	guint64 pos, end;
+	evcon_fd fd;
+	gsize i, n;
+
+	if (-1 == (fd = mkstemp(name))) g_error("mkstemp() failed: %s\n", g_strerror(errno));
+	unlink(name);
+	if (-1 == ftruncate(fd, sink->size)) g_error("ftruncate() failed: %s\n", g_strerror(errno));
+
+	/* the marked ranges start and end at multiples of TRANSFER_MARK (or the end of the file) */
+	for (pos = 0; pos < sink->size; pos += n) {
+		if ((end = transfer_hole_end(sink, pos)) > pos) {
+			n = end - pos;
+			continue;
+		}
+		n = MIN(TRANSFER_MARK, sink->size - pos);
+		for (i = 0; i < n; i++) buf[i] = transfer_byte(pos + i);
+		if ((ssize_t) n != pwrite(fd, buf, n, pos)) g_error("pwrite() failed: %s\n", g_strerror(errno));
+	}
+	return fd;
+}
+
+void transfer_test_write_file(evcon_loop *loop, TransferRunOnceCB run_once, gboolean use_sendfile) {
+	TransferState state;
+	TransferSink sink;
+	evcon_stream *writer, *reader;
+	evcon_fd fd;
+	int pair[2];
+
+	memset(&state, 0, sizeof(state));
+	memset(&sink, 0, sizeof(sink));
+	sink.size = use_sendfile ? (guint64) EVCON_STREAM_SENDFILE_MAX + 3 * TRANSFER_MARK : 16 * TRANSFER_MARK + 123;
+	sink.sparse = use_sendfile;
+
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) g_error("socketpair() failed: %s\n", g_strerror(errno));
+	writer = evcon_stream_new(loop, pair[0], transfer_writer_cb, &state);
+	reader = evcon_stream_new(loop, pair[1], transfer_sink_cb, &sink);
+	if (!use_sendfile) {
+		/* after evcon_stream_new, which resets the file status flags */
+		int flags = fcntl(pair[0], F_GETFL);
+		if (-1 == fcntl(pair[0], F_SETFL, flags | O_APPEND)) g_error("fcntl() failed: %s\n", g_strerror(errno));
+	}
+
+	fd = transfer_file_new(&sink);
+	if (0 != evcon_stream_write_file(writer, fd, 0, sink.size, transfer_file_done_cb, &state)) {
+		g_error("evcon_stream_write_file() failed: %s\n", g_strerror(errno));
+	}
+
+	while (sink.received < sink.size) run_once(loop);
+	g_assert_cmpuint(state.files_done, ==, 1);
+	g_assert_cmpuint(evcon_stream_output_length(writer), ==, 0);
+
+	evcon_stream_free(writer);
+	while (!sink.eof) run_once(loop);
+	g_assert_cmpuint(sink.received, ==, sink.size);
+	evcon_stream_free(reader);
+}
+
+static void transfer_proxy_cb(evcon_loop *loop, evcon_stream *stream, evcon_stream_event event, void *user_data) {
+	TransferState *state = (TransferState*) user_data;
+	UNUSED(loop);
+	UNUSED(stream);
+
+	switch (event) {
+	case EVCON_STREAM_READ:
+		g_error("splice source reported READ\n");
+		break;
+	case EVCON_STREAM_EOF:
+		state->proxy_eof = TRUE;
+		break;
+	case EVCON_STREAM_ERROR:
+		g_error("proxy failed: %s\n", g_strerror(errno));
+		break;
+	default:
+		break;
+	}
+}
+
+void transfer_test_splice(evcon_loop *loop, TransferRunOnceCB run_once) {
+	TransferState state;
+	TransferSink sink;
+	evcon_stream *writer, *proxy_in, *proxy_out, *reader;
+	guchar *data;
+	int in_pair[2], out_pair[2];
+	gsize i;
+
+	memset(&state, 0, sizeof(state));
+	memset(&sink, 0, sizeof(sink));
+	sink.size = 16 * TRANSFER_MARK + 123;
+
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, in_pair)) g_error("socketpair() failed: %s\n", g_strerror(errno));
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, out_pair)) g_error("socketpair() failed: %s\n", g_strerror(errno));
+	writer = evcon_stream_new(loop, in_pair[0], transfer_writer_cb, &state);
+	proxy_in = evcon_stream_new(loop, in_pair[1], transfer_proxy_cb, &state);
+	proxy_out = evcon_stream_new(loop, out_pair[0], transfer_writer_cb, &state);
+	reader = evcon_stream_new(loop, out_pair[1], transfer_sink_cb, &sink);
+	evcon_stream_set_reading(proxy_out, 0);
+	if (0 != evcon_stream_splice(proxy_in, proxy_out)) g_error("evcon_stream_splice() failed: %s\n", g_strerror(errno));
+
+	data = g_malloc(sink.size);
+	for (i = 0; i < sink.size; i++) data[i] = transfer_byte(i);
+	if (0 != evcon_stream_write(writer, data, sink.size)) g_error("evcon_stream_write() failed: %s\n", g_strerror(errno));
+	g_free(data);
+
+	while (sink.received < sink.size) run_once(loop);
+
+	/* EOF reaches the proxy once the writer is gone */
+	while (0 != evcon_stream_output_length(writer)) run_once(loop);
+	evcon_stream_free(writer);
+	while (!state.proxy_eof) run_once(loop);
+	g_assert_cmpuint(sink.received, ==, sink.size);
+
+	evcon_stream_free(proxy_in);
+	evcon_stream_free(proxy_out);
+	while (!sink.eof) run_once(loop);
+	evcon_stream_free(reader);
+}
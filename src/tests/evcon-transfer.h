@@ -0,0 +1,25 @@
+#ifndef __EVCON_TRANSFER_H
+#define __EVCON_TRANSFER_H __EVCON_TRANSFER_H
+
+#include <evcon.h>
+#include <evcon-stream.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* stream transfers over socketpairs on any backend; the tests drive the loop with @run_once until done */
+
+typedef void (*TransferRunOnceCB)(evcon_loop *loop);
+
+/* evcon_stream_write_file with a sparse file larger than EVCON_STREAM_SENDFILE_MAX (several sendfile calls).
+ * with @use_sendfile FALSE the socket gets O_APPEND, which sendfile() refuses, so the stream falls back to
+ * reading the file into chunks; a smaller file does then.
+ */
+void transfer_test_write_file(evcon_loop *loop, TransferRunOnceCB run_once, gboolean use_sendfile);
+
+/* writer -> proxy (evcon_stream_splice) -> sink */
+void transfer_test_splice(evcon_loop *loop, TransferRunOnceCB run_once);
+
+G_END_DECLS
+
+#endif